@@ -20,4 +20,6 @@ typedef int64_t  i64;
 
 typedef char* str;                    // string type
 
+typedef struct BFS BFS;               // a mounted volume (see bfs.h)
+
 #endif
\ No newline at end of file
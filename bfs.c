@@ -2,14 +2,149 @@
 // bfs.c
 // ============================================================================
 
+#include <pthread.h>
+#include <stdbool.h>
+
 #include "bfs.h"
+#include "crc.h"
+#include "lz.h"
+#include "stats.h"
+
+#define RECLAIMBATCH 32               // DBNs the reclaimer frees at a time
+#define CHECKTHREADS 4                // workers scanning Inodes, in bfsCheck
+#define CHECKRUN     64               // blocks per read, in bfsCheck
+
+typedef struct {          // shared by bfsCheck and its workers
+  BFS* fs;                // the volume being checked
+  i8*  image;             // the disk as read: indirect blocks only
+  i32  end;               // first DBN after the metadata
+  i32  next;              // next inum for a worker to take
+  i32* owners;            // # of times each DBN is mapped
+  i32  numFiles;          // # files scanned
+  i32  numBadDbns;        // pointers outside end .. BLOCKSPERDISK - 1
+} Check;
+
+static i32 bfsLayout(Super* sb, i32 features);
+
+
+
+// ============================================================================
+// Free-space bitmap helpers.  Bit 'dbn' of fs->freeMap is set while DBN 'dbn'
+// is in use.  The bitmap is cached, and written through by bfsSaveFreeMap
+// once per allocation or free, however many blocks it covers: just the
+// bitmap blocks that changed, in one run
+// ============================================================================
+static bool bfsInUse(BFS* fs, i32 dbn) {
+  return (fs->freeMap[dbn / 8] >> (dbn % 8)) & 1;
+}
+
+static void bfsSetInUse(BFS* fs, i32 dbn, bool used) {
+  if (used) fs->freeMap[dbn / 8] |=  (u8)(1 << (dbn % 8));
+  else      fs->freeMap[dbn / 8] &= (u8)~(1 << (dbn % 8));
+  i32 b = dbn / BITSPERBLOCK;
+  if (b < fs->freeDirtyLo) fs->freeDirtyLo = b;
+  if (b > fs->freeDirtyHi) fs->freeDirtyHi = b;
+}
+
+static i32 bfsNextFree(BFS* fs, i32 dbn) {  // lowest free DBN >= 'dbn', or 0
+  for (; dbn < BLOCKSPERDISK; ++dbn) if (!bfsInUse(fs, dbn)) return dbn;
+  return 0;
+}
+
+static void bfsClaim(BFS* fs, i32 dbn) {    // mark 'dbn' in use, by one owner
+  bfsSetInUse(fs, dbn, true);
+  STATADD(fs, allocs, 1);
+  if (fs->dbnRefs != 0) {                   // contents not yet known
+    fs->refs.refs[dbn] = 1;
+    fs->refs.fps[dbn]  = 0;
+    fs->refsDirty = true;
+  }
+}
+
+static void bfsSaveFreeMap(BFS* fs) {
+  if (fs->freeDirtyHi < fs->freeDirtyLo) return;
+  bioWriteRun(fs, fs->dbnFree + fs->freeDirtyLo,
+              fs->freeDirtyHi - fs->freeDirtyLo + 1,
+              fs->freeMap + fs->freeDirtyLo * BYTESPERBLOCK);
+  fs->freeDirtyLo = NUMFREEMAP;
+  fs->freeDirtyHi = -1;
+}
+
+static i32 bfsCountFree(BFS* fs) {
+  i32 numFree = 0;
+  for (i32 d = MINDBN; d < BLOCKSPERDISK; ++d) if (!bfsInUse(fs, d)) ++numFree;
+  return numFree;
+}
+
+
+
+// ============================================================================
+// Metadata block helpers.  The SuperBlock, Inodes and Dir blocks are read
+// once, at mount or format, and kept in fs->meta.  Reads are served from
+// there; writes go through to disk
+// ============================================================================
+static void bfsGetMeta(BFS* fs, i32 dbn, void* buf) {
+  memcpy(buf, fs->meta[dbn], BYTESPERBLOCK);
+}
+
+static void bfsSaveMeta(BFS* fs, i32 dbn) {
+  bioWrite(fs, dbn, fs->meta[dbn]);
+}
+
+static void bfsPutMeta(BFS* fs, i32 dbn, void* buf) {
+  memcpy(fs->meta[dbn], buf, BYTESPERBLOCK);
+  bfsSaveMeta(fs, dbn);
+}
+
+
+
+// ============================================================================
+// Read or write indirect block 'dbn', so that it is counted as such (see
+// STATKIND) rather than as data
+// ============================================================================
+static void bfsReadIndirect(BFS* fs, i32 dbn, void* buf16) {
+  STATKIND(STATINDIRECT);
+  bioRead(fs, dbn, buf16);
+  STATKIND(STATDATA);
+}
+
+static void bfsWriteIndirect(BFS* fs, i32 dbn, void* buf16) {
+  STATKIND(STATINDIRECT);
+  bioWrite(fs, dbn, buf16);
+  STATKIND(STATDATA);
+}
+
+
+
+// ============================================================================
+// Free every DBN still queued for the reclaimer, here and now.  Used by an
+// allocator that would otherwise run out of space; the caller holds the
+// volume lock, so no batch is half-done by the reclaimer meanwhile
+// ============================================================================
+static void bfsReclaimNow(BFS* fs) {
+  i16 batch[RECLAIMBATCH];
+  for (;;) {
+    pthread_mutex_lock(&fs->rclLock);
+    i32 count = (fs->rclLen < RECLAIMBATCH) ? fs->rclLen : RECLAIMBATCH;
+    fs->rclLen -= count;
+    if (count > 0) {
+      memcpy(batch, fs->rclQueue + fs->rclLen, count * sizeof(i16));
+    }
+    if (fs->rclLen == 0 && !fs->rclBusy) pthread_cond_broadcast(&fs->rclIdle);
+    pthread_mutex_unlock(&fs->rclLock);
+    if (count == 0) return;
+    bfsFreeRun(fs, batch, count);
+  }
+}
+
+
 
 // ============================================================================
 // Allocate a free disk block for the file whose Inode number is 'inum' and
 // assign it to FBN 'fbn' in the file's Inode.  On success, return the DBN
 // allocated.  On failure, abort
 // ============================================================================
-i32 bfsAllocBlock(i32 inum, i32 fbn) {
+i32 bfsAllocBlock(BFS* fs, i32 inum, i32 fbn) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
@@ -18,33 +153,34 @@ i32 bfsAllocBlock(i32 inum, i32 fbn) {
 
   // Grab the next free block in the BFS disk
 
-  i32 dbn = bfsFindFreeBlock();
+  i32 dbn = bfsFindFreeBlock(fs);
 
   // Update the corresponding Inode, or IndirectBlock
 
   i8 buf8[BYTESPERBLOCK] = {0};           // 1-block buffer
-  bioRead(DBNINODES, buf8);
+  bfsGetMeta(fs, DBNINODES, buf8);
  
   Inode* pinodes = (Inode*)buf8;          // array of Inodes
   Inode* pinode  = &pinodes[inum];        // target Inode
 
   if (fbn < NUMDIRECT) {                  // in direct[] array?
     pinode->direct[fbn] = dbn;
-    bioWrite(DBNINODES, buf8);
+    bfsPutMeta(fs, DBNINODES, buf8);
     return dbn;
   } else {                                // in indirect block?
     i16 buf16[I16SPERBLOCK]= {0};
     i32 dbnIndirect = pinode->indirect;   // DBN of indirect block
 
     if (dbnIndirect == 0) {               // not yet allocated
-      dbnIndirect = bfsFindFreeBlock();
+      dbnIndirect = bfsFindFreeBlock(fs);
       pinode->indirect = dbnIndirect;
+      bfsWriteIndirect(fs, dbnIndirect, buf16);   // start with no FBNs mapped
     }
 
-    bioRead(dbnIndirect, buf16);
+    bfsReadIndirect(fs, dbnIndirect, buf16);
     buf16[fbn - NUMDIRECT] = dbn;
-    bioWrite(dbnIndirect, buf16);
-    bioWrite(DBNINODES, buf8);
+    bfsWriteIndirect(fs, dbnIndirect, buf16);
+    bfsPutMeta(fs, DBNINODES, buf8);
   }
 
   return dbn;                             // allocated DBN
@@ -54,105 +190,490 @@ i32 bfsAllocBlock(i32 inum, i32 fbn) {
 
 
 // ============================================================================
-// Create file 'fname'.  Find a free inum; ie, free slot in the Directory.
-// Leave the size of the file as zero, until the user performs a write, or a
-// seek into the file.  On success, return the file's inum.  On failure, abort
+// Allocate 'count' free blocks in one go, returning their DBNs in 'dbns',
+// lowest first, so that neighbouring FBNs tend to land on neighbouring DBNs.
+// The bitmap is written once, however many blocks are taken.  On success,
+// return 0.  FATAL otherwise
 // ============================================================================
-i32 bfsCreateFile(str fname) {
+i32 bfsAllocRun(BFS* fs, i32 count, i16* dbns) {
+
+  if (dbns == NULL) FATAL(ENULLPTR);
+  if (count <= 0) return 0;
+  if (bfsCountFree(fs) < count) bfsReclaimNow(fs);
+
+  i32 dbn = fs->freeHint;
+  for (i32 i = 0; i < count; ++i) {
+    dbn = bfsNextFree(fs, dbn);
+    if (dbn == 0) FATAL(EDISKFULL);
+    bfsClaim(fs, dbn);
+    dbns[i] = dbn;
+  }
+  fs->freeHint = dbns[0] + 1;
 
-  if (fname == NULL) FATAL(ENULLPTR);
+  bfsSaveFreeMap(fs);
+  return 0;
+}
 
-  if (strlen(fname) > FNAMESIZE - 1) FATAL(EBIGFNAME);  // fname too big
 
-  i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNDIR, buf);
+// ============================================================================
+// Allocate 'count' free blocks, choosing them to be as contiguous as the free
+// space allows: the smallest run of free DBNs that holds them all, or else
+// the longest runs there are.  Their DBNs are returned in 'dbns', lowest
+// first.  On success, return 0.  FATAL otherwise
+// ============================================================================
+i32 bfsAllocContig(BFS* fs, i32 count, i16* dbns) {
+
+  if (dbns == NULL) FATAL(ENULLPTR);
+  if (count <= 0) return 0;
+
+  if (bfsCountFree(fs) < count) bfsReclaimNow(fs);
+  if (bfsCountFree(fs) < count) FATAL(EDISKFULL);
+
+  //Take runs of free DBNs until we have 'count' blocks: the best fit if one
+  //run is big enough, otherwise the longest remaining run each time
+  i32 numTaken = 0;
+  while (numTaken < count) {
+    i32 want = count - numTaken;
+    i32 bestStart = 0, bestLen = 0;
+    for (i32 d = MINDBN; d < BLOCKSPERDISK; ) {
+      if (bfsInUse(fs, d)) { ++d; continue; }
+      i32 len = 0;
+      while (d + len < BLOCKSPERDISK && !bfsInUse(fs, d + len)) ++len;
+      bool fits     = len >= want;
+      bool bestFits = bestLen >= want;
+      if ((fits && (!bestFits || len < bestLen))
+          || (!bestFits && len > bestLen)) {
+        bestStart = d;
+        bestLen   = len;
+      }
+      d += len;
+    }
+    i32 len = (bestLen < want) ? bestLen : want;
+    for (i32 i = 0; i < len; ++i) {
+      bfsClaim(fs, bestStart + i);
+      dbns[numTaken++] = bestStart + i;
+    }
+  }
 
-  Dir* dir = (Dir*)buf;
+  for (i32 i = 1; i < count; ++i) {   // insertion sort: 'count' is small
+    i16 dbn = dbns[i];
+    i32 j = i;
+    for (; j > 0 && dbns[j - 1] > dbn; --j) dbns[j] = dbns[j - 1];
+    dbns[j] = dbn;
+  }
 
-  for (int inum = 0; inum < NUMINODES; ++inum) {        // search Directory
-    if (strlen(dir->fname[inum]) == 0) {                // free slot
-      strcpy(dir->fname[inum], fname);
-      bioWrite(DBNDIR, dir);
-      bfsRefOFT(inum);
-      return inum;
+  bfsSaveFreeMap(fs);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return true if DBN 'dbn' may be mapped by a file: past the metadata, and
+// on the disk
+// ============================================================================
+static bool bfsCheckRange(Check* ck, i32 dbn) {
+  return dbn >= ck->end && dbn < BLOCKSPERDISK;
+}
+
+
+
+// ============================================================================
+// bfsCheck worker.  Takes Inodes one at a time, and counts every DBN each
+// live file maps, its indirect block included, in 'owners'.  Indirect blocks
+// come from the image bfsCheck read; nothing here does I/O
+// ============================================================================
+static void* bfsCheckWorker(void* arg) {
+  Check* ck     = (Check*)arg;
+  BFS*   fs     = ck->fs;
+  Dir*   dir    = (Dir*)fs->meta[DBNDIR];
+  Inode* inodes = (Inode*)fs->meta[DBNINODES];
+
+  for (;;) {
+    i32 inum = __atomic_fetch_add(&ck->next, 1, __ATOMIC_RELAXED);
+    if (inum >= NUMINODES) return NULL;
+    if (strlen(dir->fname[inum]) == 0) continue;
+    __atomic_fetch_add(&ck->numFiles, 1, __ATOMIC_RELAXED);
+
+    Inode* inode = &inodes[inum];
+    if (inode->flags & INODEINLINE) continue;
+
+    i16 dbns[NUMDIRECT + 1 + I16SPERBLOCK];
+    i32 count = 0;
+    for (i32 d = 0; d < NUMDIRECT; ++d) dbns[count++] = inode->direct[d];
+    if (inode->indirect != 0) {
+      dbns[count++] = inode->indirect;
+      if (bfsCheckRange(ck, inode->indirect)) {
+        memcpy(dbns + count, ck->image + inode->indirect * BYTESPERBLOCK,
+               BYTESPERBLOCK);
+        count += I16SPERBLOCK;
+      }
     }
-  }
 
-  FATAL(EDIRFULL);                                      // Directory full
-  return 0;                                             // pacify compiler
+    for (i32 i = 0; i < count; ++i) {
+      i32 dbn = dbns[i];
+      if (dbn == 0) continue;
+      if (bfsCheckRange(ck, dbn)) {
+        __atomic_fetch_add(&ck->owners[dbn], 1, __ATOMIC_RELAXED);
+      } else {
+        __atomic_fetch_add(&ck->numBadDbns, 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
 }
 
 
 
 // ============================================================================
-// Dereference file with Inode number 'inum' in the Open File Table.  If
-// refcount reaches 0, free up that entry in the OFT
+// Repair one block pointer, '*slot', of a file: clear it if it points
+// outside the disk or into the metadata, and, unless the volume shares
+// blocks, give it a copy of its block if an earlier pointer (per 'seen')
+// already claimed that one.  Return the # of fixes made: 0 or 1
 // ============================================================================
-i32 bfsDerefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  --g_oft[ofte].refs;
-  if (g_oft[ofte].refs == 0) {
-    g_oft[ofte].inum = -1;
-    g_oft[ofte].curs = 0;
+static i32 bfsCheckSlot(BFS* fs, Check* ck, i16* slot, u8* seen) {
+  i32 dbn = *slot;
+  if (dbn == 0) return 0;
+  if (!bfsCheckRange(ck, dbn)) {
+    *slot = 0;
+    return 1;
+  }
+  if (fs->dbnRefs == 0 && seen[dbn]) {
+    i8 block[BYTESPERBLOCK];
+    bioRead(fs, dbn, block);
+    *slot = bfsFindFreeBlock(fs);
+    bioWrite(fs, *slot, block);
+    --ck->owners[dbn];
+    ++ck->owners[*slot];
+    seen[*slot] = 1;
+    return 1;
   }
+  seen[dbn] = 1;
   return 0;
 }
 
 
 
 // ============================================================================
-// Extend file 'inum' out to FBN 'fbn'
+// Repair the block pointers of file 'inum' (see bfsCheckSlot), direct,
+// indirect and in the indirect block, writing back what changed.  Return
+// the # of fixes made
 // ============================================================================
-i32 bfsExtend(i32 inum, i32 fbn) {
-  i32 size = bfsGetSize(inum);
-  i32 fbnLast = (size + 1) / BYTESPERBLOCK;
-  for (i32 f = fbnLast; f <= fbn; ++f) {
-    bfsAllocBlock(inum, f);
+static i32 bfsCheckFix(BFS* fs, Check* ck, i32 inum, u8* seen) {
+  Inode inode;
+  bfsReadInode(fs, inum, &inode);
+  if (inode.flags & INODEINLINE) return 0;
+
+  i32 numFixed = 0;
+  for (i32 d = 0; d < NUMDIRECT; ++d) {
+    numFixed += bfsCheckSlot(fs, ck, &inode.direct[d], seen);
   }
-  return 0;
+
+  if (inode.indirect != 0) {
+    i32 old = inode.indirect;
+    numFixed += bfsCheckSlot(fs, ck, &inode.indirect, seen);
+    if (inode.indirect != 0) {              // in range: check what it maps
+      i16 buf16[I16SPERBLOCK];
+      memcpy(buf16, ck->image + old * BYTESPERBLOCK, BYTESPERBLOCK);
+      i32 fixed = 0;
+      for (i32 i = 0; i < I16SPERBLOCK; ++i) {
+        fixed += bfsCheckSlot(fs, ck, &buf16[i], seen);
+      }
+      if (fixed > 0) bfsWriteIndirect(fs, inode.indirect, buf16);
+      numFixed += fixed;
+    }
+  }
+
+  if (numFixed > 0) bfsWriteInode(fs, inum, &inode);
+  return numFixed;
 }
 
 
 
 // ============================================================================
-// Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
-// if not yet mapped
+// Check the mounted volume, and fill in 'report' with what is wrong.  The
+// blocks each file maps are counted by CHECKTHREADS workers, against an
+// image of the indirect blocks read beforehand in runs of CHECKRUN blocks.
+// Those counts are then held up against the free-space bitmap and, if the
+// volume shares blocks, the RefTable.  With FSCKREPAIR in 'flags', the
+// bitmap and RefTable are rewritten to match, pointers out of range are
+// cleared, and blocks mapped twice on a volume that does not share are
+// copied, so each file has its own.  The caller holds the volume lock.
+// Return the # of problems found
 // ============================================================================
-i32 bfsFbnToDbn(i32 inum, i32 fbn) {
+i32 bfsCheck(BFS* fs, i32 flags, FsckReport* report) {
+
+  if (report == NULL) FATAL(ENULLPTR);
+  memset(report, 0, sizeof(FsckReport));
+
+  bfsReclaimNow(fs);                          // queued blocks are neither
+
+  Super sb;
+  memcpy(&sb, fs->meta[DBNSUPER], sizeof(Super));
+  Dir*   dir    = (Dir*)fs->meta[DBNDIR];
+  Inode* inodes = (Inode*)fs->meta[DBNINODES];
+
+  Check ck = {0};
+  ck.fs     = fs;
+  ck.end    = bfsLayout(&sb, sb.features);
+  ck.image  = calloc(BLOCKSPERDISK, BYTESPERBLOCK);
+  ck.owners = calloc(BLOCKSPERDISK, sizeof(i32));
+  u8* want  = calloc(BLOCKSPERDISK, sizeof(u8));
+  if (ck.image == NULL || ck.owners == NULL || want == NULL) FATAL(ENOMEM);
+
+  // Read every run of CHECKRUN blocks that holds an indirect block
+
+  for (i32 inum = 0; inum < NUMINODES; ++inum) {
+    Inode* inode = &inodes[inum];
+    if (strlen(dir->fname[inum]) == 0)  continue;
+    if (inode->flags & INODEINLINE)     continue;
+    if (bfsCheckRange(&ck, inode->indirect)) want[inode->indirect] = 1;
+  }
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; dbn += CHECKRUN) {
+    i32 num = (BLOCKSPERDISK - dbn < CHECKRUN) ? BLOCKSPERDISK - dbn : CHECKRUN;
+    if (memchr(want + dbn, 1, num) == NULL) continue;
+    bioReadRun(fs, dbn, num, ck.image + dbn * BYTESPERBLOCK);
+  }
+
+  pthread_t workers[CHECKTHREADS];
+  for (i32 t = 0; t < CHECKTHREADS; ++t) {
+    if (pthread_create(&workers[t], NULL, bfsCheckWorker, &ck) != 0) {
+      FATAL(ENOMEM);
+    }
+  }
+  for (i32 t = 0; t < CHECKTHREADS; ++t) pthread_join(workers[t], NULL);
+
+  report->numFiles   = ck.numFiles;
+  report->numBadDbns = ck.numBadDbns;
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+    i32  owners = ck.owners[dbn];
+    bool used   = dbn < ck.end || owners > 0;
+    if (owners > 0) ++report->numOwned;
+    if ( used && !bfsInUse(fs, dbn)) ++report->numLost;
+    if (!used &&  bfsInUse(fs, dbn)) ++report->numLeaked;
+    if (fs->dbnRefs == 0 && owners > 1) ++report->numDoubled;
+    if (fs->dbnRefs != 0 && dbn >= ck.end
+     && fs->refs.refs[dbn] != (owners < 255 ? owners : 255)) {
+      ++report->numBadRefs;
+    }
+  }
+
+  i32 numProblems = report->numLost + report->numLeaked + report->numDoubled
+                  + report->numBadRefs + report->numBadDbns;
+
+  if ((flags & FSCKREPAIR) && numProblems > 0) {
+    for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {   // bitmap first, so
+      bool used = dbn < ck.end || ck.owners[dbn] > 0; // copies land on
+      if (used == bfsInUse(fs, dbn)) continue;            // free blocks
+      bfsSetInUse(fs, dbn, used);
+      ++report->numRepaired;
+    }
+    fs->freeHint = MINDBN;
+    bfsSaveFreeMap(fs);
+
+    u8* seen = want;                        // reuse: first owner of each DBN
+    memset(seen, 0, BLOCKSPERDISK);
+    for (i32 inum = 0; inum < NUMINODES; ++inum) {
+      if (strlen(dir->fname[inum]) == 0) continue;
+      report->numRepaired += bfsCheckFix(fs, &ck, inum, seen);
+    }
+
+    if (fs->dbnRefs != 0) {
+      for (i32 dbn = ck.end; dbn < BLOCKSPERDISK; ++dbn) {
+        i32 owners = ck.owners[dbn];
+        u8  refs   = owners < 255 ? owners : 255;
+        if (fs->refs.refs[dbn] == refs) continue;
+        fs->refs.refs[dbn] = refs;
+        if (refs == 0) fs->refs.fps[dbn] = 0;
+        fs->refsDirty = true;
+        ++report->numRepaired;
+      }
+    }
+    bfsFlush(fs);
+  }
+
+  free(want);
+  free(ck.owners);
+  free(ck.image);
+  return numProblems;
+}
+
+
+
+// ============================================================================
+// Create file 'fname' as a clone of file 'inum': a new Inode mapping the same
+// data blocks, each of which gains a reference.  Only the indirect block is
+// copied.  Needs a RefTable.  Writes to either file later copy-on-write.
+// On success, return the new file's inum.  On failure, abort
+// ============================================================================
+i32 bfsCloneFile(BFS* fs, i32 inum, str fname) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+  if (fs->dbnRefs == 0) FATAL(ENOSHARE);
 
   Inode inode;
-  
-  bfsReadInode(inum, &inode);
+  bfsReadInode(fs, inum, &inode);
 
-  if (fbn < NUMDIRECT) {            // in direct[] array?
-    i32 dbn = inode.direct[fbn];
-    return (dbn == 0) ? ENODBN : dbn;
+  i32 dstInum = bfsCreateFile(fs, fname, inode.flags & INODELZ);
+
+  if ((inode.flags & INODEINLINE) == 0) {
+    i32 numMapped = NUMDIRECT;
+    i16 buf16[I16SPERBLOCK] = {0};
+    i16* dbns[NUMDIRECT + I16SPERBLOCK];    // every mapped slot, to share
+
+    for (i32 d = 0; d < NUMDIRECT; ++d) dbns[d] = &inode.direct[d];
+
+    if (inode.indirect != 0) {
+      bfsReadIndirect(fs, inode.indirect, buf16);
+      inode.indirect = bfsFindFreeBlock(fs);
+      for (i32 i = 0; i < I16SPERBLOCK; ++i) dbns[numMapped++] = &buf16[i];
+    }
+
+    i8 block[BYTESPERBLOCK];
+    for (i32 i = 0; i < numMapped; ++i) {
+      i32 dbn = *dbns[i];
+      if (dbn == 0) continue;
+      if (fs->refs.refs[dbn] < 255) {
+        ++fs->refs.refs[dbn];
+      } else {                              // count saturated: copy instead
+        *dbns[i] = bfsFindFreeBlock(fs);
+        bioRead(fs, dbn, block);
+        bioWrite(fs, *dbns[i], block);
+      }
+    }
+    fs->refsDirty = true;
+
+    if (inode.indirect != 0) bfsWriteIndirect(fs, inode.indirect, buf16);
   }
 
-  // fbn is not in direct, so check indirect block.  If it doesn't exist,
-  // then allocate an empty indirect block.  But return ENODBN for the
-  // caller to handle grabing a new data block.
+  bfsWriteInode(fs, dstInum, &inode);
+  return dstInum;
+}
+
+
+
+// ============================================================================
+// Close volume 'fs', opened by bfsOpen, and free it.  Its reclaimer, if
+// started, is stopped once its queue is empty, and tracing is stopped.  The
+// volume itself should already be unmounted: nothing more is written to it
+// here.  No View may still be open
+// ============================================================================
+void bfsClose(BFS* fs) {
+  if (fs->mapRefs != 0) FATAL(EBADFLAGS);   // View still open
+
+  if (fs->rclStarted) {
+    pthread_mutex_lock(&fs->rclLock);
+    fs->rclStop = true;
+    pthread_cond_signal(&fs->rclWork);
+    pthread_mutex_unlock(&fs->rclLock);
+    pthread_join(fs->rclThread, NULL);
+  }
+  traceStop(&fs->trace);
+  bioClose(fs);
+
+  pthread_mutex_destroy(&fs->trace.lock);
+  pthread_mutex_destroy(&fs->volLock);
+  pthread_mutex_destroy(&fs->rclLock);
+  pthread_cond_destroy(&fs->rclWork);
+  pthread_cond_destroy(&fs->rclIdle);
+  free(fs->rclQueue);
+  free(fs->path);
+  free(fs);
+}
+
+
+
+// ============================================================================
+// Create file 'fname'.  Find a free inum; ie, free slot in the Directory.
+// Leave the size of the file as zero, until the user performs a write, or a
+// seek into the file.  A new file starts out inline: its data lives in the
+// Inode until it outgrows INLINESIZE.  'flags' are any further INODE* flags
+// the file keeps for life, such as INODELZ.  On success, return the file's
+// inum.  On failure, abort
+// ============================================================================
+i32 bfsCreateFile(BFS* fs, str fname, i32 flags) {
+
+  if (fname == NULL) FATAL(ENULLPTR);
+
+  if (strlen(fname) > FNAMESIZE - 1) FATAL(EBIGFNAME);  // fname too big
+
+  i8 buf[BYTESPERBLOCK] = {0};
+
+  bfsGetMeta(fs, DBNDIR, buf);
+
+  Dir* dir = (Dir*)buf;
+
+  for (int inum = 0; inum < NUMINODES; ++inum) {        // search Directory
+    if (strlen(dir->fname[inum]) == 0) {                // free slot
+      strcpy(dir->fname[inum], fname);
+      bfsPutMeta(fs, DBNDIR, dir);
+      Inode inode = {0};
+      inode.flags = INODEINLINE | flags;
+      bfsWriteInode(fs, inum, &inode);
+      bfsRefOFT(fs, inum);
+      return inum;
+    }
+  }
+
+  FATAL(EDIRFULL);                                      // Directory full
+  return 0;                                             // pacify compiler
+}
+
+
+
+// ============================================================================
+// Delete file 'fname'.  Its Directory slot and Inode are cleared at once, and
+// any OFT entry for it dropped, so the name can be reused straight away.  Its
+// data and indirect blocks are handed to the reclaimer (see bfsReclaim) to
+// be freed in the background.  On success, return 0.  If there is no such
+// file, return EFNF.  On failure, abort
+// ============================================================================
+i32 bfsDeleteFile(BFS* fs, str fname) {
+
+  if (fname == NULL) FATAL(ENULLPTR);
+
+  i8 buf[BYTESPERBLOCK] = {0};
+  bfsGetMeta(fs, DBNDIR, buf);
+  Dir* dir = (Dir*)buf;
+
+  i32 inum = 0;
+  while (inum < NUMINODES && strcmp(fname, dir->fname[inum]) != 0) ++inum;
+  if (inum == NUMINODES || strlen(fname) == 0) return EFNF;
+
+  Inode inode;
+  bfsReadInode(fs, inum, &inode);
+  if ((inode.flags & INODEINLINE) == 0) bfsReleaseFrom(fs, &inode, 0);
+
+  memset(dir->fname[inum], 0, FNAMESIZE);
+  bfsPutMeta(fs, DBNDIR, dir);
+
+  Inode empty = {0};
+  bfsWriteInode(fs, inum, &empty);
 
-  if (inode.indirect == 0) {      // no indirect block yet allocated
-    i32 dbn = bfsFindFreeBlock();
-    inode.indirect = dbn;
-    bfsWriteInode(inum, &inode);
-    return ENODBN;
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
+    if (fs->oft[i].inum != inum) continue;
+    fs->oft[i].inum = -1;
+    fs->oft[i].curs = 0;
+    fs->oft[i].refs = 0;
   }
+  return 0;
+}
 
-  // Check the indirect block
 
-  i16 buf[NUMINDIRECT] = {0};
-  bioRead(inode.indirect, buf);
 
-  i32 dbn = buf[fbn - NUMDIRECT];
-  return (dbn == 0) ? ENODBN : dbn;
+// ============================================================================
+// Dereference file with Inode number 'inum' in the Open File Table.  If
+// refcount reaches 0, free up that entry in the OFT
+// ============================================================================
+i32 bfsDerefOFT(BFS* fs, i32 inum) {
+  i32 ofte = bfsFindOFTE(fs, inum);
+  --fs->oft[ofte].refs;
+  if (fs->oft[ofte].refs == 0) {
+    fs->oft[ofte].inum = -1;
+    fs->oft[ofte].curs = 0;
+  }
+  return 0;
 }
 
 
@@ -173,18 +694,18 @@ i32 bfsFdToInum(i32 fd) {
 // Find 'inum' in the Open File Table (OFT).  If not found, create an entry.
 // Return the index within the OFT.  On failure, EOFTFULL
 // ============================================================================
-i32 bfsFindOFTE(i32 inum) {
+i32 bfsFindOFTE(BFS* fs, i32 inum) {
   for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == inum) return i;
+    if (fs->oft[i].inum == inum) return i;
   }
   
   // Not found, so look for an empty OFTE
 
   for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == -1) {
-      g_oft[i].inum = inum;
-      g_oft[i].curs = 0;
-      g_oft[i].refs = 1;
+    if (fs->oft[i].inum == -1) {
+      fs->oft[i].inum = inum;
+      fs->oft[i].curs = 0;
+      fs->oft[i].refs = 1;
       return i;
     }
   }
@@ -195,99 +716,212 @@ i32 bfsFindOFTE(i32 inum) {
 
 
 // ============================================================================
-// Allocate the next free block from the Freelist.  Adjust Freelist
-// accordingly.  On success, return DBN.  FATAL otherwise
+// Find 'inum' in the Open File Table (OFT), as bfsFindOFTE does, but never
+// create an entry: the file must already be open.  The caller holds the
+// volume lock.  Return the index within the OFT.  On failure, ENOTOPEN
 // ============================================================================
-i32 bfsFindFreeBlock() {
-  i8 buf8[BYTESPERBLOCK] = {0};
-  bioRead(DBNSUPER, buf8);
-  Super* super = (Super*)buf8;
-
-  i32 dbn = super->firstFree;
-  if (dbn == 0) FATAL(EDISKFULL);
+i32 bfsGetOFTE(BFS* fs, i32 inum) {
+  for (int i = 0; i < NUMOFTENTRIES; ++i) {
+    if (fs->oft[i].inum == inum) return i;
+  }
+  FATAL(ENOTOPEN);      // no-return
+  return 0;             // pacify compiler
+}
 
-  i16 buf16[I16SPERBLOCK] = {0};      // for next free block
-  bioRead(dbn, buf16);
 
-  super->firstFree = buf16[0];        // new head of Freelist
 
-  bioWrite(DBNSUPER, buf8);           // update SuperBlock
+// ============================================================================
+// Allocate the lowest-numbered free block, and mark it in use in the bitmap.
+// On success, return DBN.  FATAL otherwise
+// ============================================================================
+i32 bfsFindFreeBlock(BFS* fs) {
+  i32 dbn = bfsNextFree(fs, fs->freeHint);
+  if (dbn == 0) {
+    bfsReclaimNow(fs);
+    dbn = bfsNextFree(fs, fs->freeHint);
+  }
+  if (dbn == 0) FATAL(EDISKFULL);
 
+  bfsClaim(fs, dbn);
+  fs->freeHint = dbn + 1;
+  bfsSaveFreeMap(fs);
   return dbn;
 }
 
 
+
 // ============================================================================
-// Initialize the Freelist
+// Write the RefTable, and then the checksum table, back to disk if they have
+// changed.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsInitFreeList() {
-  i16 buf[I16SPERBLOCK] = {0};
-  i32 ret = 0;
-
-  for (int dbn = NUMMETA; dbn < BLOCKSPERDISK - 1; ++dbn) {
-    buf[0] = dbn + 1;
-    bioWrite(dbn, (i8*)buf);
+i32 bfsFlush(BFS* fs) {
+  if (fs->dbnRefs != 0 && fs->refsDirty) {
+    i8 buf[BYTESPERBLOCK] = {0};
+    memcpy(buf, &fs->refs, sizeof(RefTable));
+    bioWrite(fs, fs->dbnRefs, buf);
+    fs->refsDirty = false;
   }
+  return bioFlush(fs);
+}
 
-  buf[0] = 0;
-  bioWrite(BLOCKSPERDISK - 1, (i8*)buf);      // end of Freelist
 
-  return ret;
+// ============================================================================
+// Mark block 'dbn' free, and discard its contents on the host (see
+// bioDiscard).  If the volume shares blocks, just drop one reference to
+// 'dbn', and only free it once none are left.  On success, return 0.  On
+// failure, abort
+// ============================================================================
+i32 bfsFreeBlock(BFS* fs, i32 dbn) {
+  i16 dbns[1] = {dbn};
+  return bfsFreeRun(fs, dbns, 1);
 }
 
 
 
 // ============================================================================
-// Write the initial Dir block, of all zeroes, into DBN 2
+// Mark the 'count' blocks in 'dbns' free together, writing the bitmap once,
+// and discard their contents on the host, one bioDiscard per run of
+// consecutive DBNs.  If the volume shares blocks, each just loses one
+// reference, and only those left with none are freed.  'dbns' is reordered.
+// On success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsInitDir(FILE* fp) {
-  if (fp == NULL) FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNDIR, buf);
+i32 bfsFreeRun(BFS* fs, i16* dbns, i32 count) {
+
+  if (dbns == NULL) FATAL(ENULLPTR);
+
+  i32 numFree = 0;
+  for (i32 i = 0; i < count; ++i) {
+    i32 dbn = dbns[i];
+    if (dbn < MINDBN)         FATAL(EBADDBN);
+    if (dbn >= BLOCKSPERDISK) FATAL(EBADDBN);
+    if (!bfsInUse(fs, dbn))       FATAL(EBADDBN);   // freed twice
+    if (fs->dbnRefs != 0) {
+      fs->refsDirty = true;
+      if (fs->refs.refs[dbn] > 1) {
+        --fs->refs.refs[dbn];
+        continue;
+      }
+      fs->refs.refs[dbn] = 0;
+      fs->refs.fps[dbn]  = 0;
+    }
+    bfsSetInUse(fs, dbn, false);
+    dbns[numFree++] = dbn;
+  }
+  if (numFree == 0) return 0;
+  STATADD(fs, frees, numFree);
+
+  for (i32 i = 1; i < numFree; ++i) {       // insertion sort: batches are small
+    i16 dbn = dbns[i];
+    i32 j = i;
+    for (; j > 0 && dbns[j - 1] > dbn; --j) dbns[j] = dbns[j - 1];
+    dbns[j] = dbn;
+  }
+  if (dbns[0] < fs->freeHint) fs->freeHint = dbns[0];
+
+  bfsSaveFreeMap(fs);
+
+  for (i32 i = 0; i < numFree; ) {
+    i32 run = 1;
+    while (i + run < numFree && dbns[i + run] == dbns[i] + run) ++run;
+    bioDiscard(fs, dbns[i], run);
+    i += run;
+  }
+  return 0;
 }
 
 
 
 // ============================================================================
-// Write the initial Inodes block, of all zeroes, into DBN 1
+// Return 1 if the volume keeps a RefTable, so that data blocks may be shared
+// and must be written with bfsWriteShared.  Otherwise, return 0
 // ============================================================================
-i32 bfsInitInodes(FILE* fp) {
-  if (fp == NULL) FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNINODES, buf);
-}
+i32 bfsHasRefs(BFS* fs) { return fs->dbnRefs != 0; }
 
 
 
 // ============================================================================
 // Initialize the Open File Table to all zeroes
 // ============================================================================
-i32 bfsInitOFT() {
+i32 bfsInitOFT(BFS* fs) {
   for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
-    g_oft[i].inum = -1;
-    g_oft[i].curs = 0;
-    g_oft[i].refs = 0;
+    fs->oft[i].inum = -1;
+    fs->oft[i].curs = 0;
+    fs->oft[i].refs = 0;
   }
   return 0;
 }
 
 
 // ============================================================================
-// Write the initial Super block into DBN 0
+// Fill in SuperBlock 'sb' for a volume with 'features': geometry, and where
+// each table lives.  The layout follows from 'features' alone, so a mounted
+// SuperBlock can be checked against the one this builds.  Return the first
+// DBN after the metadata
 // ============================================================================
-i32 bfsInitSuper(FILE* fp) {
+static i32 bfsLayout(Super* sb, i32 features) {
+  memset(sb, 0, sizeof(Super));
+  sb->magic     = BFSMAGIC;
+  sb->version   = BFSVERSION;
+  sb->numBlocks = BLOCKSPERDISK;          // eg: 100
+  sb->numInodes = NUMINODES;              // eg: 8
+  sb->dbnFree   = NUMMETA;                // eg: 3
+  sb->features  = features;
+
+  i32 next = sb->dbnFree + NUMFREEMAP;    // next DBN to give a table
+  if (features & FEATCSUM)  sb->dbnCsum = next++;
+  if (features & (FEATDEDUP | FEATSHARE)) sb->dbnRefs = next++;
+  return next;
+}
 
-  if (fp == NULL) FATAL(ENULLPTR);
 
-  Super sb;
-  sb.numBlocks = BLOCKSPERDISK;           // eg: 100
-  sb.numInodes = NUMINODES;               // eg: 8
-  sb.firstFree = NUMMETA;                 // eg: 3
 
-  i8 buf[BYTESPERBLOCK] = {0};
+// ============================================================================
+// Lay out and write the metadata of a new volume: the SuperBlock in DBN 0,
+// the Inodes and Dir blocks, all zeroes, in DBNs 1 and 2, and the free-space
+// bitmap from DBN 3.  The volume is left mounted, so the SuperBlock is not
+// marked SUPERCLEAN until fsUnmount.  With FEATCSUM in 'features', the
+// first block after the bitmap holds the checksum table, and checksums are
+// kept from here on.  With FEATDEDUP or FEATSHARE, the next one holds the
+// RefTable.  A disk too big for either table to fit its block is refused,
+// with EBIGDISK.  All of this is one run of blocks from DBN 0, written in a
+// single bioWriteRun; free blocks, and bitmap blocks with no bit set, are
+// not written at all.  Only the checksum table, which covers the run, is
+// left for bfsFlush.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsInitVolume(BFS* fs, i32 features) {
+
+  Super sb;
+  i32 next = bfsLayout(&sb, features);    // mounted, so not SUPERCLEAN
+  sb.stripeWidth = fs->stripe.width;
+  sb.stripeUnit  = fs->stripe.unit;
+  sb.stripeId    = fs->stripe.id;
+  bioCsumInit(fs, sb.dbnCsum);
+  bfsRefsInit(fs, sb.dbnRefs, features);
+
+  fs->dbnFree  = sb.dbnFree;                // blocks up to 'next' are in use
+  fs->freeHint = next;
+  fs->dbnData  = next;
+  statsLayout(fs, next);
+  memset(fs->freeMap, 0, sizeof(fs->freeMap));
+  for (i32 dbn = 0; dbn < next; ++dbn) bfsSetInUse(fs, dbn, true);
+  fs->freeDirtyLo = NUMFREEMAP;             // written below, with the rest
+  fs->freeDirtyHi = -1;
+
+  //Only bitmap blocks holding a set bit need writing: the rest are holes
+  i32 numMap    = (next - 1) / BITSPERBLOCK + 1;
+  i32 numBlocks = sb.dbnFree + numMap;
+  if (sb.dbnCsum != 0 || sb.dbnRefs != 0) numBlocks = next;
+
+  i8* buf = calloc(numBlocks, BYTESPERBLOCK);
+  if (buf == NULL) FATAL(ENOMEM);
   memcpy(buf, &sb, sizeof(Super));
+  memcpy(buf + sb.dbnFree * BYTESPERBLOCK, fs->freeMap, numMap * BYTESPERBLOCK);
+  memcpy(fs->meta, buf, sizeof(fs->meta));
+  i32 ret = bioWriteRun(fs, DBNSUPER, numBlocks, buf);
+  free(buf);
 
-  return bioWrite(DBNSUPER, buf);
+  bfsRefsClean(fs);                         // all zeroes, as just written
+  return ret;
 }
 
 
@@ -302,19 +936,20 @@ i32 bfsInumToFd(i32 inum) { return inum + INUMTOFD; }
 // Lookup 'fname' in the Directory.  If found, return its inum.  If not,
 // return EFNF
 // ============================================================================
-i32 bfsLookupFile(str fname) {
+i32 bfsLookupFile(BFS* fs, str fname) {
 
   if (fname == NULL) FATAL(ENULLPTR);
 
   i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNDIR, buf);
+  bfsGetMeta(fs, DBNDIR, buf);
+  STATADD(fs, lookups, 1);
 
   Dir* dir = (Dir*)buf;
 
   for (int inum = 0; inum < NUMINODES; ++inum) {
     if (strcmp(fname, dir->fname[inum]) == 0) {
-      bfsRefOFT(inum);
+      bfsRefOFT(fs, inum);
       return inum;
     }
   }
@@ -326,27 +961,514 @@ i32 bfsLookupFile(str fname) {
 
 
 // ============================================================================
-// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'
+// Rebuild the free-space bitmap, and the reference counts of the RefTable,
+// from the Inodes: a block is in use if it is metadata or some file maps it.
+// Used when mounting a volume that was not unmounted cleanly, so that blocks
+// queued for the reclaimer, or references never flushed, are not lost.
+// 'end' is the first DBN after the metadata
 // ============================================================================
-i32 bfsRead(i32 inum, i32 fbn, i8* buf) {
+static void bfsRecover(BFS* fs, i32 end) {
+  bioCsumRebuild(fs);                       // so indirect blocks read cleanly
+
+  memset(fs->freeMap, 0, sizeof(fs->freeMap));
+  for (i32 dbn = 0; dbn < end; ++dbn) bfsSetInUse(fs, dbn, true);
+  fs->freeDirtyLo = 0;                      // write back every bitmap block
+  fs->freeDirtyHi = NUMFREEMAP - 1;
+
+  u8 refs[BLOCKSPERDISK] = {0};
+  Dir* dir = (Dir*)fs->meta[DBNDIR];
+  Inode* inodes = (Inode*)fs->meta[DBNINODES];
+
+  for (i32 inum = 0; inum < NUMINODES; ++inum) {
+    Inode* inode = &inodes[inum];
+    if (strlen(dir->fname[inum]) == 0) continue;
+    if (inode->flags & INODEINLINE)    continue;
+
+    i16 dbns[NUMDIRECT + I16SPERBLOCK + 1];
+    i32 count = NUMDIRECT + I16SPERBLOCK;
+    bfsMapRange(fs, inode, 0, count, dbns);
+    if (inode->indirect != 0) dbns[count++] = inode->indirect;
+
+    for (i32 i = 0; i < count; ++i) {
+      i32 dbn = dbns[i];
+      if (dbn < end || dbn >= BLOCKSPERDISK) continue;  // for fsck to find
+      bfsSetInUse(fs, dbn, true);
+      if (refs[dbn] < 255) ++refs[dbn];
+    }
+  }
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+  if (fs->dbnRefs != 0) {
+    for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) {
+      fs->refs.refs[dbn] = refs[dbn];
+      if (refs[dbn] == 0) fs->refs.fps[dbn] = 0;
+    }
+    fs->refsDirty = true;
+  }
+
+  bfsSaveFreeMap(fs);
+}
+
+
+
+// ============================================================================
+// Mount the volume in fs->path.  The SuperBlock, Inodes, Dir, free-space
+// bitmap and tables are read in a single bioReadRun, and kept in memory.
+// The SuperBlock must carry BFSMAGIC and BFSVERSION, and match the compiled
+// geometry and the layout for its features, and be striped just as bio
+// found the disk to be (see stripeOpen); if not, abort with EBADSUPER.  A
+// volume marked SUPERCLEAN is taken as it stands, checking each metadata
+// block against its checksum if it has them.  Any other volume was not
+// unmounted, so its checksums, bitmap and RefTable are rebuilt (see
+// bfsRecover).  Either way, the SuperBlock is then rewritten without
+// SUPERCLEAN, until bfsUnmountVolume.  On success, return 0
+// ============================================================================
+i32 bfsMountVolume(BFS* fs) {
+
+  i32 numRead = NUMMETA + NUMFREEMAP + 2;   // room for both tables
+  if (numRead > BLOCKSPERDISK) numRead = BLOCKSPERDISK;
+
+  i8* buf = malloc(numRead * BYTESPERBLOCK);
+  if (buf == NULL) FATAL(ENOMEM);
+
+  bioCsumInit(fs, 0);                           // nothing to check against yet
+  bioReadRun(fs, DBNSUPER, numRead, buf);
+
+  Super sb;
+  memcpy(&sb, buf, sizeof(Super));
+  Super want;
+  i32 end = bfsLayout(&want, sb.features);
+  bool clean = (sb.state & SUPERCLEAN) != 0;
+
+  if (sb.magic     != want.magic     || sb.version   != want.version
+   || sb.numBlocks != want.numBlocks || sb.numInodes != want.numInodes
+   || sb.dbnFree   != want.dbnFree   || sb.dbnCsum   != want.dbnCsum
+   || sb.dbnRefs   != want.dbnRefs   || end > numRead
+   || sb.stripeWidth != fs->stripe.width || sb.stripeUnit != fs->stripe.unit
+   || sb.stripeId    != fs->stripe.id
+   || (sb.state & ~SUPERCLEAN) != 0
+   || (sb.features & ~(FEATCSUM | FEATDEDUP | FEATSHARE)) != 0) {
+    free(buf);
+    FATAL(EBADSUPER);
+  }
+
+  if (sb.dbnCsum != 0) {
+    bioCsumLoad(fs, sb.dbnCsum, buf + sb.dbnCsum * BYTESPERBLOCK);
+    for (i32 dbn = 0; clean && dbn < end; ++dbn) {
+      if (dbn != sb.dbnCsum) bioCsumCheck(fs, dbn, buf + dbn * BYTESPERBLOCK);
+    }
+  }
+
+  memcpy(fs->meta, buf, sizeof(fs->meta));
+
+  fs->dbnFree  = sb.dbnFree;
+  fs->freeHint = MINDBN;
+  fs->freeDirtyLo = NUMFREEMAP;
+  fs->freeDirtyHi = -1;
+  memcpy(fs->freeMap, buf + sb.dbnFree * BYTESPERBLOCK, sizeof(fs->freeMap));
+
+  bfsRefsInit(fs, sb.dbnRefs, sb.features);
+  if (sb.dbnRefs != 0) {
+    memcpy(&fs->refs, buf + sb.dbnRefs * BYTESPERBLOCK, sizeof(RefTable));
+    fs->refsDirty = false;
+  }
+  free(buf);
+
+  fs->dbnData = end;
+  statsLayout(fs, end);
+  if (!clean) bfsRecover(fs, end);
+
+  sb.state = 0;                             // mounted: dirty until unmount
+  memcpy(fs->meta[DBNSUPER], &sb, sizeof(Super));
+  bfsSaveMeta(fs, DBNSUPER);
+  return bfsFlush(fs);
+}
+
+
+
+// ============================================================================
+// Open a new volume handle on the disk in the file 'path', with its blocks in
+// 'backend' (see bioSetBackend).  'path' is NULL for BIOSTRIPE, which takes
+// a bioSetStripe next.  Every piece of state the volume needs lives in the
+// handle, so any number may be open at once.  Nothing is read yet: the
+// caller goes on to format or mount it.  On success, return the handle, for
+// bfsClose to free.  On failure, abort
+// ============================================================================
+BFS* bfsOpen(str path, i32 backend) {
+  if (path == NULL && (backend == BIOFILE || backend == BIOLOG)) {
+    FATAL(ENULLPTR);
+  }
+
+  BFS* fs = calloc(1, sizeof(BFS));
+  if (fs == NULL) FATAL(ENOMEM);
+  if (path != NULL) {
+    fs->path = strdup(path);
+    if (fs->path == NULL) FATAL(ENOMEM);
+  }
+
+  pthread_mutex_init(&fs->volLock, NULL);
+  pthread_mutex_init(&fs->rclLock, NULL);
+  pthread_cond_init(&fs->rclWork, NULL);
+  pthread_cond_init(&fs->rclIdle, NULL);
+  traceInit(&fs->trace);
+
+  fs->freeHint    = MINDBN;
+  fs->freeDirtyLo = NUMFREEMAP;             // nothing to write back
+  fs->freeDirtyHi = -1;
+  fs->dbnData     = NUMMETA;
+  fs->statEnd     = NUMMETA;
+  bfsInitOFT(fs);
+  bioSetBackend(fs, backend);
+  return fs;
+}
+
+
+
+// ============================================================================
+// Take the volume lock.  Every fs call that changes the volume holds it, as
+// does the reclaimer while it frees a batch, so that the two never update the
+// free-space bitmap, RefTable or checksum table at the same time.  Calls
+// that read hold it too: fsRead and fsReadView read Inodes and block maps
+// that writers change, may add an OFT entry or move a cursor, and mark
+// blocks checked in the checksum state that bio keeps
+// ============================================================================
+void bfsLock(BFS* fs)   { pthread_mutex_lock(&fs->volLock); }
+void bfsUnlock(BFS* fs) { pthread_mutex_unlock(&fs->volLock); }
 
-  i32 dbn = bfsFbnToDbn(inum, fbn);
 
-  bioRead(dbn, buf);
+
+// ============================================================================
+// The reclaimer: a background thread that frees queued DBNs, RECLAIMBATCH at
+// a time, taking the volume lock for each batch only.  The tables are
+// flushed once the queue runs dry.  One per volume, 'arg'.  Exits once
+// told to stop by bfsClose and the queue is empty
+// ============================================================================
+static void* bfsReclaimer(void* arg) {
+  BFS* fs = (BFS*)arg;
+  i16 batch[RECLAIMBATCH];
+
+  for (;;) {
+    pthread_mutex_lock(&fs->rclLock);
+    while (fs->rclLen == 0 && !fs->rclStop) {
+      pthread_cond_wait(&fs->rclWork, &fs->rclLock);
+    }
+    bool stop = (fs->rclLen == 0);
+    pthread_mutex_unlock(&fs->rclLock);
+    if (stop) break;
+
+    //Take the batch only once holding the volume lock, so that an allocator
+    //holding it can be sure no batch is in flight (see bfsReclaimNow)
+    bfsLock(fs);
+    pthread_mutex_lock(&fs->rclLock);
+    i32 count = (fs->rclLen < RECLAIMBATCH) ? fs->rclLen : RECLAIMBATCH;
+    fs->rclLen -= count;
+    memcpy(batch, fs->rclQueue + fs->rclLen, count * sizeof(i16));
+    fs->rclBusy = true;
+    bool last = (fs->rclLen == 0);
+    pthread_mutex_unlock(&fs->rclLock);
+
+    if (count > 0) bfsFreeRun(fs, batch, count);
+    if (last) bfsFlush(fs);
+    bfsUnlock(fs);
+
+    pthread_mutex_lock(&fs->rclLock);
+    fs->rclBusy = false;
+    if (fs->rclLen == 0) pthread_cond_broadcast(&fs->rclIdle);
+    pthread_mutex_unlock(&fs->rclLock);
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Queue the 'count' DBNs in 'dbns' for the reclaimer to free, starting it if
+// need be.  Returns without waiting for them to be freed; see
+// bfsReclaimWait.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsReclaim(BFS* fs, i16* dbns, i32 count) {
+
+  if (dbns == NULL) FATAL(ENULLPTR);
+  if (count <= 0) return 0;
+
+  pthread_mutex_lock(&fs->rclLock);
+
+  if (fs->rclLen + count > fs->rclCap) {
+    i32 cap = (fs->rclCap == 0) ? BLOCKSPERDISK : fs->rclCap;
+    while (cap < fs->rclLen + count) cap *= 2;
+    i16* queue = realloc(fs->rclQueue, cap * sizeof(i16));
+    if (queue == NULL) FATAL(ENOMEM);
+    fs->rclQueue = queue;
+    fs->rclCap   = cap;
+  }
+  memcpy(fs->rclQueue + fs->rclLen, dbns, count * sizeof(i16));
+  fs->rclLen += count;
+
+  if (!fs->rclStarted) {                    // joined by bfsClose
+    if (pthread_create(&fs->rclThread, NULL, bfsReclaimer, fs) != 0) {
+      FATAL(ENOMEM);
+    }
+    fs->rclStarted = true;
+  }
+  pthread_cond_signal(&fs->rclWork);
+
+  pthread_mutex_unlock(&fs->rclLock);
   return 0;
 }
 
 
+
+// ============================================================================
+// Wait until every DBN queued with bfsReclaim is free again, and the tables
+// describing them are flushed.  Must not be called holding the volume lock
+// ============================================================================
+void bfsReclaimWait(BFS* fs) {
+  pthread_mutex_lock(&fs->rclLock);
+  while (fs->rclLen > 0 || fs->rclBusy) {
+    pthread_cond_wait(&fs->rclIdle, &fs->rclLock);
+  }
+  pthread_mutex_unlock(&fs->rclLock);
+}
+
+
+
+// ============================================================================
+// Unmap every FBN from 'fbn' onward of 'inode', and queue the blocks that
+// backed them for the reclaimer.  The indirect block goes too, once no FBN
+// it maps is left.  'inode' is updated in memory; the caller is left to
+// bfsWriteInode it.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsReleaseFrom(BFS* fs, Inode* inode, i32 fbn) {
+
+  if (inode == NULL) FATAL(ENULLPTR);
+  if (fbn < 0) FATAL(EBADFBN);
+  if (inode->flags & INODEINLINE) return 0;
+  if (fbn >= NUMDIRECT + I16SPERBLOCK) return 0;
+
+  i32 count = NUMDIRECT + I16SPERBLOCK - fbn;
+  i16 dbns[NUMDIRECT + I16SPERBLOCK + 1];
+  bfsMapRange(fs, inode, fbn, count, dbns);
+
+  i32 numGone = 0;
+  for (i32 i = 0; i < count; ++i) {
+    if (dbns[i] != 0) dbns[numGone++] = dbns[i];
+  }
+
+  for (i32 f = fbn; f < NUMDIRECT; ++f) inode->direct[f] = 0;
+
+  if (inode->indirect != 0) {
+    if (fbn <= NUMDIRECT) {                 // nothing left for it to map
+      dbns[numGone++] = inode->indirect;
+      inode->indirect = 0;
+    } else if (numGone > 0) {
+      i16 buf16[I16SPERBLOCK];
+      bfsReadIndirect(fs, inode->indirect, buf16);
+      memset(buf16 + (fbn - NUMDIRECT), 0, count * sizeof(i16));
+      bfsWriteIndirect(fs, inode->indirect, buf16);
+    }
+  }
+
+  return bfsReclaim(fs, dbns, numGone);
+}
+
+
+
+// ============================================================================
+// Map 'count' consecutive FBNs, starting at 'fbn', of the in-memory 'inode'
+// to their DBNs in 'dbns'.  Reads the indirect block at most once.  FBNs not
+// yet mapped come back as 0.  Never allocates
+// ============================================================================
+i32 bfsMapRange(BFS* fs, Inode* inode, i32 fbn, i32 count, i16* dbns) {
+
+  if (inode == NULL)  FATAL(ENULLPTR);
+  if (dbns == NULL)   FATAL(ENULLPTR);
+  if (fbn < 0 || count < 0)                   FATAL(EBADFBN);
+  if (fbn + count > NUMDIRECT + I16SPERBLOCK) FATAL(EBADFBN);
+
+  if (inode->flags & INODEINLINE) {         // no blocks, only data
+    memset(dbns, 0, count * sizeof(i16));
+    return 0;
+  }
+
+  i16 buf16[I16SPERBLOCK];
+  bool haveIndirect = false;
+
+  for (i32 i = 0; i < count; ++i) {
+    i32 f = fbn + i;
+    if (f < NUMDIRECT) {
+      dbns[i] = inode->direct[f];
+    } else if (inode->indirect == 0) {
+      dbns[i] = 0;
+    } else {
+      if (!haveIndirect) {
+        bfsReadIndirect(fs, inode->indirect, buf16);
+        haveIndirect = true;
+      }
+      dbns[i] = buf16[f - NUMDIRECT];
+    }
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Unmap FBNs 'fbn' .. 'fbn' + 'count' - 1 of 'inode', freeing (or, if the
+// volume shares blocks, dropping a reference to) each block that backed
+// them, so that they read as a hole.  'inode' is updated in memory; the
+// caller is left to bfsWriteInode it.  On success, return 0.  On failure,
+// abort
+// ============================================================================
+i32 bfsPunchRange(BFS* fs, Inode* inode, i32 fbn, i32 count) {
+
+  if (inode == NULL) FATAL(ENULLPTR);
+  if (count <= 0) return 0;
+
+  i16 dbns[NUMDIRECT + I16SPERBLOCK];
+  bfsMapRange(fs, inode, fbn, count, dbns);
+
+  bool any = false;
+  for (i32 i = 0; i < count; ++i) {
+    if (dbns[i] == 0) continue;
+    bfsFreeBlock(fs, dbns[i]);
+    dbns[i] = 0;
+    any = true;
+  }
+  if (!any) return 0;
+
+  return bfsSetMapRange(fs, inode, fbn, count, dbns);
+}
+
+
+
+// ============================================================================
+// Store DBNs 'dbns' as the mapping for 'count' consecutive FBNs, starting at
+// 'fbn', of the in-memory 'inode'.  Entries in the indirect block are
+// written back at once, allocating that block if needed; the caller is left
+// to bfsWriteInode 'inode' itself.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsSetMapRange(BFS* fs, Inode* inode, i32 fbn, i32 count, i16* dbns) {
+
+  if (inode == NULL) FATAL(ENULLPTR);
+  if (dbns  == NULL) FATAL(ENULLPTR);
+  if (fbn < 0 || count < 0)                   FATAL(EBADFBN);
+  if (fbn + count > NUMDIRECT + I16SPERBLOCK) FATAL(EBADFBN);
+
+  i32 i = 0;
+  for (; i < count && fbn + i < NUMDIRECT; ++i) {
+    inode->direct[fbn + i] = dbns[i];
+  }
+  if (i == count) return 0;
+
+  i16 buf16[I16SPERBLOCK] = {0};
+  if (inode->indirect == 0) {
+    inode->indirect = bfsFindFreeBlock(fs);
+  } else {
+    bfsReadIndirect(fs, inode->indirect, buf16);
+  }
+
+  for (; i < count; ++i) {
+    buf16[fbn + i - NUMDIRECT] = dbns[i];
+  }
+  bfsWriteIndirect(fs, inode->indirect, buf16);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make FBNs 'dstFbn' .. 'dstFbn' + 'count' - 1 of 'dst' share the blocks that
+// back FBNs 'srcFbn' onward of 'src', each of which gains a reference (a
+// saturated block is copied instead).  Holes in 'src' become holes in 'dst',
+// and the blocks 'dst' held there lose a reference.  'src' and 'dst' may be
+// the same Inode, provided the two ranges do not overlap.  'dst' is updated
+// in memory; the caller is left to bfsWriteInode it.  Needs a RefTable.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsShareRange(BFS* fs, Inode* src, i32 srcFbn, Inode* dst, i32 dstFbn,
+                  i32 count) {
+
+  if (src == NULL)    FATAL(ENULLPTR);
+  if (dst == NULL)    FATAL(ENULLPTR);
+  if (fs->dbnRefs == 0) FATAL(ENOSHARE);
+  if (count <= 0) return 0;
+
+  i16 srcDbns[NUMDIRECT + I16SPERBLOCK];
+  i16 dstDbns[NUMDIRECT + I16SPERBLOCK];
+  bfsMapRange(fs, src, srcFbn, count, srcDbns);
+  bfsMapRange(fs, dst, dstFbn, count, dstDbns);
+
+  i8 block[BYTESPERBLOCK];
+  for (i32 i = 0; i < count; ++i) {
+    i32 dbn = srcDbns[i];
+    if (dbn == dstDbns[i]) continue;
+    if (dbn != 0 && fs->refs.refs[dbn] < 255) {
+      ++fs->refs.refs[dbn];
+    } else if (dbn != 0) {                  // count saturated: copy instead
+      bioRead(fs, dbn, block);
+      dbn = bfsFindFreeBlock(fs);
+      bioWrite(fs, dbn, block);
+      fs->refs.fps[dbn] = fs->refs.fps[srcDbns[i]];
+    }
+    if (dstDbns[i] != 0) bfsFreeBlock(fs, dstDbns[i]);
+    dstDbns[i] = dbn;
+  }
+  fs->refsDirty = true;
+
+  return bfsSetMapRange(fs, dst, dstFbn, count, dstDbns);
+}
+
+
+
+// ============================================================================
+// Read chunk 'chunk' of compressed file 'inode' into 'buf', which holds
+// CHUNKSIZE bytes.  A chunk owns FBNs [chunk * CHUNKBLOCKS, + CHUNKBLOCKS).
+// How many of those are mapped says how it is stored: none, a hole; all
+// CHUNKBLOCKS, raw; fewer, compressed, with its length in the first 2 bytes.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsReadChunk(BFS* fs, Inode* inode, i32 chunk, i8* buf) {
+
+  if (inode == NULL)                        FATAL(ENULLPTR);
+  if (buf == NULL)                          FATAL(ENULLPTR);
+  if (chunk < 0 || chunk >= NUMCHUNKS)      FATAL(EBADFBN);
+
+  i16 dbns[CHUNKBLOCKS];
+  bfsMapRange(fs, inode, chunk * CHUNKBLOCKS, CHUNKBLOCKS, dbns);
+
+  i32 k = 0;
+  while (k < CHUNKBLOCKS && dbns[k] != 0) ++k;
+
+  if (k == 0) {                             // hole
+    memset(buf, 0, CHUNKSIZE);
+    return 0;
+  }
+
+  if (k == CHUNKBLOCKS) {                   // stored raw
+    for (i32 b = 0; b < CHUNKBLOCKS; ++b) {
+      bioRead(fs, dbns[b], buf + b * BYTESPERBLOCK);
+    }
+    return 0;
+  }
+
+  i8 packed[CHUNKSIZE];
+  for (i32 b = 0; b < k; ++b) bioRead(fs, dbns[b], packed + b * BYTESPERBLOCK);
+
+  i16 clen;
+  memcpy(&clen, packed, sizeof(i16));
+  if (clen < 0 || clen > k * BYTESPERBLOCK - (i32)sizeof(i16)) FATAL(EBADREAD);
+
+  i32 n = lzDecompress(packed + sizeof(i16), clen, buf, CHUNKSIZE);
+  if (n != CHUNKSIZE) FATAL(EBADREAD);
+  return 0;
+}
+
+
+
 // ============================================================================
 // Read the Inodes block.  Extract and return the Inode whose number is 'inum'.
 // On success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsReadInode(i32 inum, Inode* inode) {
+i32 bfsReadInode(BFS* fs, i32 inum, Inode* inode) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
@@ -354,7 +1476,8 @@ i32 bfsReadInode(i32 inum, Inode* inode) {
 
   i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNINODES, buf);
+  bfsGetMeta(fs, DBNINODES, buf);
+  STATADD(fs, inodeReads, 1);
 
   Inode* inodes = (Inode*)buf;
 
@@ -367,25 +1490,74 @@ i32 bfsReadInode(i32 inum, Inode* inode) {
 // ============================================================================
 // Reference file with Inode number 'inum' in the Open File Table
 // ============================================================================
-i32 bfsRefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  ++g_oft[ofte].refs;
+i32 bfsRefOFT(BFS* fs, i32 inum) {
+  i32 ofte = bfsFindOFTE(fs, inum);
+  ++fs->oft[ofte].refs;
   return 0;
 }
 
 
 
 // ============================================================================
-// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
+// Start an empty RefTable at block 'dbnRefs', for a disk being formatted.
+// 'dbnRefs' == 0 means the volume does not share blocks
 // ============================================================================
-i32 bfsSetCursor(i32 inum, i32 newCurs) {
+i32 bfsRefsInit(BFS* fs, i32 dbnRefs, i32 features) {
+  if (dbnRefs != 0 && !REFSFIT) FATAL(EBIGDISK);
+  fs->dbnRefs   = dbnRefs;
+  fs->dedup     = (dbnRefs != 0) && (features & FEATDEDUP);
+  fs->refsDirty = (dbnRefs != 0);
+  memset(&fs->refs, 0, sizeof(RefTable));
+  return 0;
+}
 
-  if (inum < 0) FATAL(EBADINUM);
+
+
+// ============================================================================
+// Note that the RefTable on disk matches the one in memory, so bfsFlush need
+// not write it
+// ============================================================================
+void bfsRefsClean(BFS* fs) { fs->refsDirty = false; }
+
+
+
+// ============================================================================
+// Make file 'inum' durable: wait until its data blocks, its indirect block
+// and the Inodes block have all reached the backend (see bioSync).  With
+// 'meta', so do the Dir, and the free-space bitmap, RefTable and checksum
+// table, written back first; without it, they are left for recovery to
+// rebuild, should the volume not be unmounted.  'inum' < 0 makes the whole
+// volume durable.  The caller holds the volume lock.  On success, return 0
+// ============================================================================
+i32 bfsSync(BFS* fs, i32 inum, bool meta) {
   if (inum > MAXINUM) FATAL(EBADINUM);
 
-  i32 ofte = bfsFindOFTE(inum);
-  g_oft[ofte].curs = newCurs;
-  return 0;
+  if (meta) {
+    bfsSaveFreeMap(fs);
+    bfsFlush(fs);
+  }
+  if (inum < 0) return bioSync(fs, NULL);
+
+  bool want[BLOCKSPERDISK] = {false};
+  Inode inode;
+  bfsReadInode(fs, inum, &inode);
+  i16 dbns[NUMDIRECT + I16SPERBLOCK];
+  bfsMapRange(fs, &inode, 0, NUMDIRECT + I16SPERBLOCK, dbns);
+  for (i32 i = 0; i < NUMDIRECT + I16SPERBLOCK; ++i) {
+    if (dbns[i] > 0 && dbns[i] < BLOCKSPERDISK) want[dbns[i]] = true;
+  }
+  if (!(inode.flags & INODEINLINE) && inode.indirect > 0) {
+    want[inode.indirect] = true;
+  }
+  want[DBNINODES] = true;
+
+  if (meta) {
+    want[DBNDIR] = true;
+    for (i32 b = 0; b < NUMFREEMAP; ++b) want[fs->dbnFree + b] = true;
+    if (fs->dbnRefs != 0) want[fs->dbnRefs] = true;
+    if (fs->dbnCsum != 0) want[fs->dbnCsum] = true;
+  }
+  return bioSync(fs, want);
 }
 
 
@@ -393,10 +1565,10 @@ i32 bfsSetCursor(i32 inum, i32 newCurs) {
 // ============================================================================
 // Return the cursor position for the file open on File Descriptor 'fd'
 // ============================================================================
-i32 bfsTell(i32 fd) {
+i32 bfsTell(BFS* fs, i32 fd) {
   i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
-  return g_oft[ofte].curs;
+  i32 ofte = bfsFindOFTE(fs, inum);
+  return fs->oft[ofte].curs;
 }
 
 
@@ -404,13 +1576,13 @@ i32 bfsTell(i32 fd) {
 // ============================================================================
 // Return the size of the file whose Inode number is 'inum'
 // ============================================================================
-i32 bfsGetSize(i32 inum) {
+i32 bfsGetSize(BFS* fs, i32 inum) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
 
   Inode inode;
-  bfsReadInode(inum, &inode);
+  bfsReadInode(fs, inum, &inode);
 
   return inode.size;
 }
@@ -418,37 +1590,190 @@ i32 bfsGetSize(i32 inum) {
 
 
 // ============================================================================
-// Set size of file 'inum' to 'size
+// Move the contents of inline file 'inum' out of its Inode and into a real
+// data block, FBN 0.  Does nothing if the file is not inline
 // ============================================================================
-i32 bfsSetSize(i32 inum, i32 size) {
+i32 bfsUninline(BFS* fs, i32 inum) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
 
   Inode inode;
-  bfsReadInode(inum, &inode);
-  
-  inode.size = size;
-  bfsWriteInode(inum, &inode);
+  bfsReadInode(fs, inum, &inode);
+  if ((inode.flags & INODEINLINE) == 0) return 0;
+
+  i8 buf[BYTESPERBLOCK] = {0};
+  memcpy(buf, inode.data, INLINESIZE);
+
+  inode.flags &= ~INODEINLINE;
+  memset(inode.data, 0, INLINESIZE);        // now direct[] and indirect
+
+  if (inode.flags & INODELZ) {              // becomes chunk 0
+    i8 chunk[CHUNKSIZE] = {0};
+    memcpy(chunk, buf, INLINESIZE);
+    if (inode.size > 0) bfsWriteChunk(fs, &inode, 0, chunk);
+    bfsWriteInode(fs, inum, &inode);
+    return 0;
+  }
+
+  bfsWriteInode(fs, inum, &inode);
+
+  if (inode.size > 0) {
+    i32 dbn = bfsAllocBlock(fs, inum, 0);
+    bioWrite(fs, dbn, buf);
+  }
   return 0;
 }
 
 
 
+// ============================================================================
+// Unmount the volume: write back the RefTable and checksum table, then mark
+// the SuperBlock SUPERCLEAN, so that the next bfsMountVolume can trust what
+// it reads.  The bitmap, Inodes and Dir are written through already.  The
+// caller holds the volume lock, and has waited out the reclaimer.  On
+// success, return 0
+// ============================================================================
+i32 bfsUnmountVolume(BFS* fs) {
+  bfsSaveFreeMap(fs);
+  bfsFlush(fs);
+
+  Super* sb = (Super*)fs->meta[DBNSUPER];
+  sb->state |= SUPERCLEAN;
+  bfsSaveMeta(fs, DBNSUPER);
+  return bioFlush(fs);                        // SuperBlock's new checksum
+}
+
+
+
+// ============================================================================
+// Store CHUNKSIZE bytes from 'buf' as chunk 'chunk' of compressed file
+// 'inode' (see bfsReadChunk for the layout).  An all-zero chunk becomes a
+// hole; one that does not shrink by at least a block is stored raw.  Blocks
+// the chunk already had are reused, and any it no longer needs are freed.
+// 'inode' is updated in memory; the caller is left to bfsWriteInode it.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsWriteChunk(BFS* fs, Inode* inode, i32 chunk, i8* buf) {
+
+  if (inode == NULL)                        FATAL(ENULLPTR);
+  if (buf == NULL)                          FATAL(ENULLPTR);
+  if (chunk < 0 || chunk >= NUMCHUNKS)      FATAL(EBADFBN);
+
+  i8  packed[CHUNKSIZE] = {0};
+  i8* payload = packed;
+  i32 need;
+
+  i32 nz = 0;
+  while (nz < CHUNKSIZE && buf[nz] == 0) ++nz;
+
+  if (nz == CHUNKSIZE) {
+    need = 0;                               // hole
+  } else {
+    i32 cap  = (CHUNKBLOCKS - 1) * BYTESPERBLOCK - sizeof(i16);
+    i16 clen = lzCompress(buf, CHUNKSIZE, packed + sizeof(i16), cap);
+    if (clen < 0) {
+      need    = CHUNKBLOCKS;                // raw
+      payload = buf;
+    } else {
+      memcpy(packed, &clen, sizeof(i16));
+      need = (clen + sizeof(i16) + BYTESPERBLOCK - 1) / BYTESPERBLOCK;
+    }
+  }
+
+  i16 dbns[CHUNKBLOCKS];
+  bfsMapRange(fs, inode, chunk * CHUNKBLOCKS, CHUNKBLOCKS, dbns);
+
+  bool remap = false;
+  for (i32 b = 0; b < CHUNKBLOCKS; ++b) {
+    if (b < need && dbns[b] != 0 && fs->dbnRefs != 0
+        && fs->refs.refs[dbns[b]] > 1) {      // shared: copy-on-write
+      bfsFreeBlock(fs, dbns[b]);
+      dbns[b] = 0;
+    }
+    if (b < need && dbns[b] == 0) {
+      dbns[b] = bfsFindFreeBlock(fs);
+      remap   = true;
+    }
+    if (b >= need && dbns[b] != 0) {
+      bfsFreeBlock(fs, dbns[b]);
+      dbns[b] = 0;
+      remap   = true;
+    }
+    if (b < need) bioWrite(fs, dbns[b], payload + b * BYTESPERBLOCK);
+  }
+
+  if (remap) bfsSetMapRange(fs, inode, chunk * CHUNKBLOCKS, CHUNKBLOCKS, dbns);
+  return 0;
+}
+
+
+
+// ============================================================================
+// On a volume with a RefTable, write the block 'buf' as the new contents of
+// the FBN now mapped to '*dbn' (0 => not yet mapped).  With FEATDEDUP, and
+// 'full' set (the caller is writing the whole block), first look for a block
+// that already holds the same bytes, and share it.  A block that is shared
+// is never written in place: the FBN gets a fresh copy (copy-on-write).
+// '*dbn' is updated to the DBN now holding the data.  Return true if it
+// changed, so the caller must store the new mapping.  On failure, abort
+// ============================================================================
+i32 bfsWriteShared(BFS* fs, i16* dbn, i8* buf, bool full) {
+
+  if (dbn == NULL)     FATAL(ENULLPTR);
+  if (buf == NULL)     FATAL(ENULLPTR);
+  if (fs->dbnRefs == 0)  FATAL(ENULLPTR);
+
+  u32 fp = crcCompute(buf, BYTESPERBLOCK);
+  if (fp == 0) fp = 1;                      // 0 means "unknown"
+
+  if (full && fs->dedup) {
+    i8 other[BYTESPERBLOCK];
+    for (i32 d = MINDBN; d < BLOCKSPERDISK; ++d) {
+      if (fs->refs.fps[d] != fp || fs->refs.refs[d] == 0) continue;
+      if (fs->refs.refs[d] == 255 && d != *dbn)  continue;    // saturated
+      bioRead(fs, d, other);
+      if (memcmp(other, buf, BYTESPERBLOCK) != 0) continue;
+      if (d == *dbn) return false;          // already holds these bytes
+      ++fs->refs.refs[d];
+      if (*dbn != 0) bfsFreeBlock(fs, *dbn);
+      *dbn = d;
+      fs->refsDirty = true;
+      return true;
+    }
+  }
+
+  bool changed = false;
+  if (*dbn == 0 || fs->refs.refs[*dbn] > 1) {  // unmapped, or shared: new block
+    i32 old = *dbn;
+    *dbn = bfsFindFreeBlock(fs);
+    if (old != 0) bfsFreeBlock(fs, old);
+    changed = true;
+  }
+
+  bioWrite(fs, *dbn, buf);
+  fs->refs.fps[*dbn] = fp;
+  fs->refsDirty = true;
+  return changed;
+}
+
+
+
 // ============================================================================
 // Update the Inodes block on disk with the info in 'inode'
 // ============================================================================
-i32 bfsWriteInode(i32 inum, Inode* inode) {
+i32 bfsWriteInode(BFS* fs, i32 inum, Inode* inode) {
 
   if (inum < 0)       FATAL(EBADINUM);
   if (inum > MAXINUM) FATAL(EBADINUM);
   if (inode == NULL)  FATAL(ENULLPTR);
 
   i8 buf[BYTESPERBLOCK];
-  bioRead(DBNINODES, buf);
+  bfsGetMeta(fs, DBNINODES, buf);
   Inode* inodes = (Inode*)buf;
   memcpy(&inodes[inum], inode, sizeof(Inode));
-  bioWrite(DBNINODES, buf);
+  bfsPutMeta(fs, DBNINODES, buf);
+  STATADD(fs, inodeWrites, 1);
 
   return 0;
 }
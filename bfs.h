@@ -5,13 +5,23 @@
 // bfs.h - API to Bothell File System
 // ===================================================================
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "alias.h"
 #include "bio.h"
+#include "elev.h"
 #include "errors.h"
+#include "fs.h"
+#include "lfs.h"
+#include "stats.h"
+#include "stripe.h"
+#include "tier.h"
+#include "trace.h"
+#include "wback.h"
 
 #define BYTESPERBLOCK 512
 #define I16SPERBLOCK  256
@@ -19,9 +29,11 @@
 #define BYTESPERDISK  (BLOCKSPERDISK * BYTESPERBLOCK)
 #define NUMINODES     8
 #define MAXINUM       NUMINODES - 1
+#define INODESIZE     (BYTESPERBLOCK / NUMINODES)
+#define INLINESIZE    (INODESIZE - 6)
 #define NUMMETA       3
 #define MINDBN        3
-#define BFSDISK       "BFSDISK"
+#define BFSDISK       "BFSDISK"   // default disk, for main and the tools
 #define NUMDIRECT     5
 #define NUMINDIRECT   BYTESPERBLOCK / sizeof(i16)
 #define MAXFBN        NUMDIRECT + NUMINDIRECT
@@ -35,19 +47,58 @@
 
 #define NUMOFTENTRIES 20
 
+#define INODEINLINE   0x0001      // file contents live in Inode.data
+#define INODELZ       0x0002      // file is stored as compressed chunks
+
+#define BFSMAGIC      0x31534642  // "BFS1": first 4 bytes of a BFS volume
+#define BFSVERSION    1           // layout of the metadata blocks
+#define SUPERCLEAN    0x0001      // Super.state: unmounted with fsUnmount
+
+#define BITSPERBLOCK  (BYTESPERBLOCK * 8)
+#define NUMFREEMAP    ((BLOCKSPERDISK + BITSPERBLOCK - 1) / BITSPERBLOCK)
+
+#define CHUNKBLOCKS   4           // FBNs per compressed chunk
+#define CHUNKSIZE     (CHUNKBLOCKS * BYTESPERBLOCK)
+#define NUMCHUNKS     ((NUMDIRECT + I16SPERBLOCK) / CHUNKBLOCKS)
+
 
 typedef struct {          // SuperBlock
+  i32 magic;              // BFSMAGIC
+  i16 version;            // BFSVERSION
+  i16 state;              // SUPERCLEAN, or 0 while mounted
   i16 numBlocks;          // total # of blocks in BFSDISK = 1,000
   i16 numInodes;          // total # of inodes = 8
-  i16 firstFree;          // DBN of first free block
+  i16 dbnFree;            // DBN of free-space bitmap
+  i16 features;           // FEAT* options chosen at fsFormat
+  i16 dbnCsum;            // DBN of checksum table, if FEATCSUM
+  i16 dbnRefs;            // DBN of RefTable, if FEATDEDUP or FEATSHARE
+  i16 stripeWidth;        // # member files, if striped.  0 => one file
+  i16 stripeUnit;         // blocks per stripe unit, if striped
+  u32 stripeId;           // id in the StripeLabel of every member
 } Super;
 
 
 
-typedef struct {          // Inode
-  i32 size;               // # of bytes in file
-  i16 direct[NUMDIRECT];  // DBNs for first 5 FBNs
-  i16 indirect;           // DBN of the indirect table
+typedef struct {                // RefTable: how data blocks are shared
+  u32 fps[BLOCKSPERDISK];       // CRC32C of DBN's contents.  0 => unknown
+  u8  refs[BLOCKSPERDISK];      // # FBNs mapped to DBN.  0 => free
+} RefTable;
+
+#define REFSFIT (BLOCKSPERDISK * 5 <= BYTESPERBLOCK)  // RefTable fits a block:
+                                                      // else, EBIGDISK
+
+
+
+typedef struct {              // Inode (8 per block, so 64 bytes each)
+  i32 size;                   // # of bytes in file
+  i16 flags;                  // INODEINLINE, etc
+  union {
+    struct {
+      i16 direct[NUMDIRECT];  // DBNs for first 5 FBNs
+      i16 indirect;           // DBN of the indirect table
+    };
+    i8 data[INLINESIZE];      // contents of a small file, if INODEINLINE
+  };
 } Inode;
 
 
@@ -63,30 +114,103 @@ typedef struct {          // Open File Table Entry
   i32 curs;               // cursor into file
 } OFTE;
 
-OFTE g_oft[NUMOFTENTRIES];
-
-i32 bfsAllocBlock(i32 inum, i32 fbn);
-i32 bfsCreateFile(str fname);
-i32 bfsDerefOFT(i32 inum);
-i32 bfsExtend(i32 inum, i32 fbn);
-i32 bfsFbnToDbn(i32 inum,   i32 fbn);
+struct BFS {              // BFS: one volume, from fsMount to fsUnmount.  All
+                          // of its state lives here, so volumes share nothing
+  str  path;              // host file holding the disk.  NULL => in memory
+
+  i8*  mem;               // bio: the disk, with the BIOMEM backend
+  i8*  map;               // bio: read-only mapping of the disk
+  i32  mapRefs;           // bio: # bioMap calls not yet bioUnmap'd
+  i32  dbnCsum;           // bio: DBN of checksum table.  0 => none
+  bool csumDirty;         // bio: table changed since last bioFlush
+  u32  csumZero;          // bio: CRC32C of a block of zeroes
+  u32  csums[BYTESPERBLOCK / sizeof(u32)];  // bio: CRC32C of each DBN
+  u8   csumMem[BLOCKSPERDISK];  // bio: with BIOMEM, each block's CSUM* state
+  Stripe stripe;          // bio: member files, with BIOSTRIPE
+  Tier   tier;            // bio: hottest blocks, in RAM (see bioSetTier)
+  WBack  wback;           // bio: blocks not yet written (see bioSetWriteBack)
+  Elevator elev;          // bio: queue for the backend (see bioSetElevator)
+  Lfs    lfs;             // bio: the log, with BIOLOG (see lfs.h)
+
+  i8   meta[NUMMETA][BYTESPERBLOCK];        // SuperBlock, Inodes and Dir
+
+  i32  dbnFree;           // DBN of the free-space bitmap
+  i32  freeHint;          // no DBN below this is free
+  i32  dbnData;           // first DBN after the metadata
+  u8   freeMap[NUMFREEMAP * BYTESPERBLOCK]; // bit set => DBN in use
+  i32  freeDirtyLo;       // bitmap blocks changed since bfsSaveFreeMap,
+  i32  freeDirtyHi;       // lowest & highest
+
+  i32      dbnRefs;       // DBN of RefTable.  0 => none
+  bool     dedup;         // FEATDEDUP: share identical blocks
+  bool     refsDirty;     // RefTable changed since bfsFlush
+  RefTable refs;          // in-memory copy of the RefTable
+
+  OFTE oft[NUMOFTENTRIES];    // Open File Table
+
+  pthread_mutex_t volLock;    // see bfsLock
+
+  pthread_mutex_t rclLock;    // guards rcl*
+  pthread_cond_t  rclWork;    // queue filled, or rclStop set
+  pthread_cond_t  rclIdle;    // queue drained
+  pthread_t rclThread;        // the reclaimer, once rclStarted
+  i16* rclQueue;              // DBNs waiting to be freed
+  i32  rclLen;                // # DBNs in rclQueue
+  i32  rclCap;                // # DBNs rclQueue has room for
+  bool rclBusy;               // reclaimer is freeing a batch
+  bool rclStarted;            // reclaimer thread is running
+  bool rclStop;               // reclaimer should exit, once idle
+
+  Stats stats;                // I/O counters (see fsStats)
+  i32   statEnd;              // first DBN after the metadata, for stats
+  Trace trace;                // block request tracing (see fsTrace)
+};
+
+i32 bfsAllocBlock(BFS* fs, i32 inum, i32 fbn);
+i32 bfsAllocContig(BFS* fs, i32 count, i16* dbns);
+i32 bfsAllocRun(BFS* fs, i32 count, i16* dbns);
+i32 bfsCheck(BFS* fs, i32 flags, FsckReport* report);
+i32 bfsCloneFile(BFS* fs, i32 inum, str fname);
+void bfsClose(BFS* fs);
+i32 bfsCreateFile(BFS* fs, str fname, i32 flags);
+i32 bfsDeleteFile(BFS* fs, str fname);
+i32 bfsDerefOFT(BFS* fs, i32 inum);
 i32 bfsFdToInum(i32 fd);
-i32 bfsFindFreeBlock();
-i32 bfsFindOFTE(i32 inum);
-i32 bfsGetSize(i32 inum);
-i32 bfsInitDir();
-i32 bfsInitFreeList();
-i32 bfsInitInodes();
-i32 bfsInitOFT();
-i32 bfsInitSuper(FILE* fp);
+i32 bfsFindFreeBlock(BFS* fs);
+i32 bfsFindOFTE(BFS* fs, i32 inum);
+i32 bfsFlush(BFS* fs);
+i32 bfsFreeBlock(BFS* fs, i32 dbn);
+i32 bfsFreeRun(BFS* fs, i16* dbns, i32 count);
+i32 bfsGetOFTE(BFS* fs, i32 inum);
+i32 bfsGetSize(BFS* fs, i32 inum);
+i32 bfsHasRefs(BFS* fs);
+i32 bfsInitOFT(BFS* fs);
+i32 bfsInitVolume(BFS* fs, i32 features);
 i32 bfsInumToFd(i32 inum);
-i32 bfsLookupFile(str fname);
-i32 bfsRead(i32 inum, i32 fbn, i8* buf);
-i32 bfsReadInode(i32 inum, Inode* inode);
-i32 bfsRefOFT(i32 inum);
-i32 bfsSetCursor(i32 inum, i32 newCurs);
-i32 bfsSetSize(i32 inum, i32 size);
-i32 bfsTell(i32 fd);
-i32 bfsWriteInode(i32 inum, Inode* inode);
+void bfsLock(BFS* fs);
+i32 bfsLookupFile(BFS* fs, str fname);
+i32 bfsMountVolume(BFS* fs);
+BFS* bfsOpen(str path, i32 backend);
+i32 bfsMapRange(BFS* fs, Inode* inode, i32 fbn, i32 count, i16* dbns);
+i32 bfsPunchRange(BFS* fs, Inode* inode, i32 fbn, i32 count);
+i32 bfsReadChunk(BFS* fs, Inode* inode, i32 chunk, i8* buf);
+i32 bfsReadInode(BFS* fs, i32 inum, Inode* inode);
+i32 bfsReclaim(BFS* fs, i16* dbns, i32 count);
+void bfsReclaimWait(BFS* fs);
+i32 bfsRefOFT(BFS* fs, i32 inum);
+i32 bfsReleaseFrom(BFS* fs, Inode* inode, i32 fbn);
+void bfsRefsClean(BFS* fs);
+i32 bfsRefsInit(BFS* fs, i32 dbnRefs, i32 features);
+i32 bfsSetMapRange(BFS* fs, Inode* inode, i32 fbn, i32 count, i16* dbns);
+i32 bfsShareRange(BFS* fs, Inode* src, i32 srcFbn, Inode* dst, i32 dstFbn,
+                  i32 count);
+i32 bfsSync(BFS* fs, i32 inum, bool meta);
+i32 bfsTell(BFS* fs, i32 fd);
+void bfsUnlock(BFS* fs);
+i32 bfsUninline(BFS* fs, i32 inum);
+i32 bfsUnmountVolume(BFS* fs);
+i32 bfsWriteChunk(BFS* fs, Inode* inode, i32 chunk, i8* buf);
+i32 bfsWriteInode(BFS* fs, i32 inum, Inode* inode);
+i32 bfsWriteShared(BFS* fs, i16* dbn, i8* buf, bool full);
 
 #endif
\ No newline at end of file
@@ -2,48 +2,612 @@
 // bio.c - low level Block IO functions
 // ============================================================================
 
+#define _GNU_SOURCE                 // fallocate
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <stdbool.h>
+
 #include "bfs.h"
 #include "bio.h"
+#include "crc.h"
+#include "lfs.h"
+#include "stats.h"
+#include "stripe.h"
+#include "tier.h"
+#include "trace.h"
+#include "wback.h"
+
+#define CSUMSLOT  (BYTESPERBLOCK / sizeof(u32) - 1)   // table's own CRC
+
+#define CSUMFIT   (BLOCKSPERDISK <= CSUMSLOT)   // disk fits a table: else,
+                                                // EBIGDISK (see fsFormat)
+#define CSUMRUN   64                            // blocks per read, rebuilding
+
+#define CSUMCHECK 0       // csumMem: check the block when next read
+#define CSUMOK    1       // csumMem: checked since last written
+#define CSUMLATE  2       // csumMem: written, but not yet summed
+
+
 
 // ============================================================================
-// Read 512 bytes from block number 'dbn' in the BFS disk into buffer 'buf'
+// Check the contents of block 'dbn', held in 'buf', against its checksum.
+// Does nothing if the disk has no checksum table.  An in-memory disk
+// (BIOMEM) changes only when bio writes it, so each of its blocks is checked
+// once, and not again until it is next written, as a host trusts its page
+// cache once a block is read in; one bio wrote itself, and has yet to sum, is
+// not checked at all (see bioCsumSet).  On success, return 0.  On a
+// mismatch, abort with ECSUM
+// ============================================================================
+i32 bioCsumCheck(BFS* fs, i32 dbn, void* buf) {
+  if (fs->dbnCsum == 0 || dbn == fs->dbnCsum) return 0;
+  if (fs->csumMem[dbn] != CSUMCHECK) return 0;
+  if (crcCompute(buf, BYTESPERBLOCK) != fs->csums[dbn]) FATAL(ECSUM);
+  if (fs->mem != NULL) fs->csumMem[dbn] = CSUMOK;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Start keeping checksums in a new table at block 'dbnCsum', for a disk being
+// formatted.  Every block starts out as a hole, so the table starts out with
+// the checksum of a block of zeroes throughout.  'dbnCsum' == 0 turns
+// checksums off
+// ============================================================================
+i32 bioCsumInit(BFS* fs, i32 dbnCsum) {
+  if (dbnCsum != 0 && !CSUMFIT) FATAL(EBIGDISK);
+  fs->dbnCsum = dbnCsum;
+  memset(fs->csums, 0, sizeof(fs->csums));
+  memset(fs->csumMem, CSUMCHECK, sizeof(fs->csumMem));
+  if (dbnCsum != 0) {
+    i8 zeroes[BYTESPERBLOCK] = {0};
+    fs->csumZero = crcCompute(zeroes, BYTESPERBLOCK);
+    for (i32 dbn = 0; dbn < BLOCKSPERDISK; ++dbn) fs->csums[dbn] = fs->csumZero;
+  }
+  fs->csumDirty = (dbnCsum != 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Load the checksum table of a mounted disk, whose block 'dbnCsum' has
+// already been read into 'table', checking the table's own CRC, and start
+// verifying blocks against it
 // ============================================================================
-i32 bioRead(i32 dbn, void* buf) {
+i32 bioCsumLoad(BFS* fs, i32 dbnCsum, void* table) {
+  if (!CSUMFIT) FATAL(EBIGDISK);
+  if (table == NULL) FATAL(ENULLPTR);
+  memcpy(fs->csums, table, sizeof(fs->csums));
+  memset(fs->csumMem, CSUMCHECK, sizeof(fs->csumMem));
+  if (crcCompute(fs->csums, CSUMSLOT * sizeof(u32)) != fs->csums[CSUMSLOT]) {
+    FATAL(ECSUM);
+  }
+  i8 zeroes[BYTESPERBLOCK] = {0};
+  fs->csumZero  = crcCompute(zeroes, BYTESPERBLOCK);
+  fs->dbnCsum   = dbnCsum;
+  fs->csumDirty = false;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Recompute the checksum of every block from what is on disk now.  Used when
+// mounting a volume that was not unmounted cleanly, whose table may be older
+// than the blocks it covers.  Reads the whole disk, in runs
+// ============================================================================
+i32 bioCsumRebuild(BFS* fs) {
+  if (fs->dbnCsum == 0) return 0;
+
+  i8* buf = malloc(CSUMRUN * BYTESPERBLOCK);
+  if (buf == NULL) FATAL(ENOMEM);
+
+  i32 dbnCsum = fs->dbnCsum;
+  fs->dbnCsum = 0;                              // don't check what we rebuild
+  for (i32 dbn = 0; dbn < BLOCKSPERDISK; dbn += CSUMRUN) {
+    i32 num = (BLOCKSPERDISK - dbn < CSUMRUN) ? BLOCKSPERDISK - dbn : CSUMRUN;
+    bioReadRun(fs, dbn, num, buf);
+    for (i32 b = 0; b < num; ++b) {
+      if (dbn + b == dbnCsum) continue;
+      fs->csums[dbn + b] = crcCompute(buf + b * BYTESPERBLOCK, BYTESPERBLOCK);
+    }
+  }
+  free(buf);
+
+  memset(fs->csumMem, CSUMCHECK, sizeof(fs->csumMem));
+  fs->dbnCsum   = dbnCsum;
+  fs->csumDirty = true;
+  return 0;
+}
 
-  if (dbn < 0)             FATAL(EBADDBN);
-  if (dbn > BLOCKSPERDISK) FATAL(EBADDBN);
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
 
+// ============================================================================
+// Record the checksum of block 'dbn', about to be written from 'buf'.  On an
+// in-memory disk (BIOMEM), the block is only marked CSUMLATE, and summed by
+// bioFlush, from the disk itself, before the table is written: a block
+// written again and again in between is summed once
+// ============================================================================
+static void bioCsumSet(BFS* fs, i32 dbn, void* buf) {
+  if (fs->dbnCsum == 0 || dbn == fs->dbnCsum) return;
+  fs->csumDirty = true;
+  if (fs->mem != NULL) {
+    fs->csumMem[dbn] = CSUMLATE;
+    return;
+  }
+  fs->csums[dbn] = crcCompute(buf, BYTESPERBLOCK);
+}
+
+
+
+// ============================================================================
+// Return whether bioMap must read the disk into a copy, rather than map
+// fs->path: its blocks are striped over member files (BIOSTRIPE), or
+// scattered through a log (BIOLOG)
+// ============================================================================
+static bool bioCopyMap(BFS* fs) {
+  return fs->stripe.width > 0 || fs->lfs.on;
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from DBN 'dbn', to or from 'buf', on
+// the backend itself: in memory (BIOMEM), across the member files
+// (BIOSTRIPE), in the log (BIOLOG), or in fs->path.  This is the elevator's
+// TierIO.  On success, return 0.  On failure, abort
+// ============================================================================
+static i32 bioDiskIO(BFS* fs, bool write, i32 dbn, i32 numBlocks, void* buf) {
   i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret  = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+  i32 len  = numBlocks * BYTESPERBLOCK;
+
+  if (fs->mem != NULL) {
+    if (write) memcpy(fs->mem + boff, buf, len);
+    else       memcpy(buf, fs->mem + boff, len);
+  } else if (fs->stripe.width > 0) {
+    stripeIO(&fs->stripe, write, dbn, numBlocks, buf);
+  } else if (fs->lfs.on) {
+    lfsIO(&fs->lfs, write, dbn, numBlocks, buf);
+  } else {
+    FILE* fp = fopen(fs->path, write ? "rb+" : "rb");
+    if (fp == NULL) FATAL(ENODISK);
+
+    i32 ret = fseek(fp, boff, SEEK_SET);
+    if (ret != 0) { fclose(fp); FATAL(ret); }
+
+    i32 numb = write ? fwrite(buf, 1, len, fp) : fread(buf, 1, len, fp);
+    if (numb != len) { fclose(fp); FATAL(write ? EBADWRITE : EBADREAD); }
+
+    fclose(fp);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from DBN 'dbn', to or from 'buf',
+// below the RAM tier: queued in the elevator, if there is one, or else on
+// the backend itself.  With a RAM tier, this is the tier's TierIO, and
+// reached only for blocks not in it.  On success, return 0.  On failure,
+// abort
+// ============================================================================
+static i32 bioDevIO(BFS* fs, bool write, i32 dbn, i32 numBlocks, void* buf) {
+  if (fs->elev.on) return elevIO(&fs->elev, write, dbn, numBlocks, buf);
+  return bioDiskIO(fs, write, dbn, numBlocks, buf);
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from DBN 'dbn', to or from 'buf',
+// below the write-back buffer: through the RAM tier, if there is one, or
+// else on the backend itself.  This is the write-back buffer's TierIO.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+static i32 bioTierIO(BFS* fs, bool write, i32 dbn, i32 numBlocks, void* buf) {
+  if (fs->tier.cap > 0) return tierIO(&fs->tier, write, dbn, numBlocks, buf);
+  return bioDevIO(fs, write, dbn, numBlocks, buf);
+}
+
+
 
-  i32 numb = fread(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADREAD); }
+// ============================================================================
+// Tell the host that blocks 'dbn' .. 'dbn' + 'numBlocks' - 1 are free, by
+// punching a hole over them in fs->path.  The host gives the space back, and
+// the blocks read as zeroes from then on.  Where the host has no hole punch,
+// zeroes are written over them instead.  An in-memory disk (BIOMEM) just
+// zeroes them; a striped one (BIOSTRIPE) punches a hole in each member; a
+// log (BIOLOG) forgets them, for its cleaner to reclaim.  Any of them still
+// in the write-back buffer, or in the RAM tier, are dropped from it first,
+// so that neither can write its copy back over the hole.  The hole goes
+// straight to the backend, below any elevator, once no write to the blocks
+// is queued there or being sent, so none queued ahead of the hole can land
+// after it.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bioDiscard(BFS* fs, i32 dbn, i32 numBlocks) {
+
+  if (dbn < 0 || numBlocks <= 0)       FATAL(EBADDBN);
+  if (dbn + numBlocks > BLOCKSPERDISK) FATAL(EBADDBN);
+  STATADD(fs, discards, numBlocks);
+  TRACEIO(fs, TRACEDISCARD, dbn, numBlocks);
+
+  i32 ret = 0;
+  if (fs->wback.cap > 0) wbDiscard(&fs->wback, dbn, numBlocks);
+  if (fs->tier.cap > 0)  tierDiscard(&fs->tier, dbn, numBlocks);
+  if (fs->elev.on)       elevDrain(&fs->elev, dbn, numBlocks);
+  if (fs->mem != NULL) {
+    memset(fs->mem + dbn * BYTESPERBLOCK, 0, numBlocks * BYTESPERBLOCK);
+  } else if (fs->stripe.width > 0) {
+    ret = stripeDiscard(&fs->stripe, dbn, numBlocks);
+  } else if (fs->lfs.on) {
+    ret = lfsDiscard(&fs->lfs, dbn, numBlocks);
+  } else {
+    FILE* fp = fopen(fs->path, "rb+");
+    if (fp == NULL) FATAL(ENODISK);
+#ifdef FALLOC_FL_PUNCH_HOLE
+    ret = fallocate(fileno(fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    (off_t)dbn * BYTESPERBLOCK,
+                    (off_t)numBlocks * BYTESPERBLOCK);
+#else
+    u8 zero[BYTESPERBLOCK] = {0};
+    if (fseek(fp, dbn * BYTESPERBLOCK, SEEK_SET) != 0) FATAL(EBADWRITE);
+    for (i32 b = 0; b < numBlocks; ++b) {
+      if (fwrite(zero, BYTESPERBLOCK, 1, fp) != 1)   FATAL(EBADWRITE);
+    }
+#endif
+    fclose(fp);
+  }
+
+  if (ret == 0 && bioCopyMap(fs) && fs->map != NULL) {      // bioMap's copy
+    memset(fs->map + dbn * BYTESPERBLOCK, 0, numBlocks * BYTESPERBLOCK);
+  }
+  if (ret == 0 && fs->dbnCsum != 0) {         // now they hold zeroes
+    for (i32 d = dbn; d < dbn + numBlocks; ++d) {
+      if (d != fs->dbnCsum) fs->csums[d] = fs->csumZero;
+      fs->csumMem[d] = CSUMCHECK;
+    }
+    fs->csumDirty = true;
+  } else if (ret != 0 && fs->dbnCsum != 0
+          && (fs->wback.cap > 0 || fs->tier.cap > 0)) {
+    i8 block[BYTESPERBLOCK];                  // writes dropped: they hold
+    for (i32 d = dbn; d < dbn + numBlocks; ++d) {   // what they did before
+      if (d == fs->dbnCsum) continue;
+      bioTierIO(fs, false, d, 1, block);
+      fs->csums[d] = crcCompute(block, BYTESPERBLOCK);
+    }
+    fs->csumDirty = true;
+  }
+
+  return 0;
+}
+
+
+
+// ============================================================================
+// Release what bio holds for volume 'fs': its write-back buffer and RAM
+// tier, once written back, its elevator, once drained, and an in-memory
+// disk, the member files of a striped one, and their workers, or a log, once
+// checkpointed.  No mapping may be left.  On success, return 0
+// ============================================================================
+i32 bioClose(BFS* fs) {
+  wbClose(&fs->wback);
+  tierClose(&fs->tier);
+  elevClose(&fs->elev);
+  lfsClose(&fs->lfs);
+  free(fs->mem);
+  fs->mem = NULL;
+  stripeClose(&fs->stripe);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the checksum table back to disk, if it has changed.  Checksums are
+// kept in memory as blocks are written, and only reach the disk here: the
+// fs layer calls this from fsCreate, fsDelete, fsClose and fsFormat.  Blocks
+// of an in-memory disk (BIOMEM) written since the last call are summed
+// first.
+// Then write back the dirty blocks of the RAM tier, if any, table included.
+// With a write-back buffer, the table is simply buffered, and nothing is
+// written back on the caller's thread: that is left to the flusher, and
+// bioSync
+// ============================================================================
+i32 bioFlush(BFS* fs) {
+  for (i32 dbn = 0; fs->mem != NULL && dbn < BLOCKSPERDISK; ++dbn) {
+    if (fs->csumMem[dbn] != CSUMLATE) continue;       // see bioCsumSet
+    fs->csums[dbn]   = crcCompute(fs->mem + dbn * BYTESPERBLOCK, BYTESPERBLOCK);
+    fs->csumMem[dbn] = CSUMCHECK;
+  }
+  if (fs->dbnCsum != 0 && fs->csumDirty) {
+    fs->csums[CSUMSLOT] = crcCompute(fs->csums, CSUMSLOT * sizeof(u32));
+    bioWrite(fs, fs->dbnCsum, fs->csums);
+    fs->csumDirty = false;
+  }
+  if (fs->tier.cap > 0 && fs->wback.cap == 0) tierFlush(&fs->tier);
+  return 0;
+}
 
+// ============================================================================
+// Map the whole BFS disk read-only into memory and return its base address
+// in '*base'.  Mappings are reference counted: the disk stays mapped, and
+// pointers into it stay valid, until every bioMap has been bioUnmap'd.
+// Blocks written with bioWrite show through the mapping.  An in-memory disk
+// (BIOMEM) needs no mapping: its own memory is handed out.  A striped disk
+// (BIOSTRIPE), or a log (BIOLOG), cannot be mapped in one piece, so is read
+// into a copy, which bioWriteRun keeps up to date while it is mapped.  A
+// write-back buffer and RAM tier are written back first, and write through
+// to the backend until the last bioUnmap.  The caller holds the volume lock,
+// as writers, the reclaimer included, do while they change the copy
+// ============================================================================
+i32 bioMap(BFS* fs, i8** base) {
+
+  if (base == NULL) FATAL(ENULLPTR);
+  if (fs->mapRefs == 0 && fs->wback.cap > 0) wbWriteThrough(&fs->wback, true);
+  if (fs->mapRefs == 0 && fs->tier.cap > 0) tierWriteThrough(&fs->tier, true);
+
+  if (fs->mapRefs == 0 && fs->mem != NULL) {
+    fs->map = fs->mem;                          // already in memory
+  } else if (fs->mapRefs == 0 && bioCopyMap(fs)) {
+    fs->map = malloc(BYTESPERDISK);
+    if (fs->map == NULL) FATAL(ENOMEM);
+    bioDiskIO(fs, false, 0, BLOCKSPERDISK, fs->map);
+  } else if (fs->mapRefs == 0) {
+    FILE* fp = fopen(fs->path, "rb");
+    if (fp == NULL) FATAL(ENODISK);
+
+    void* p = mmap(NULL, BYTESPERDISK, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    fclose(fp);
+    if (p == MAP_FAILED) FATAL(EBADREAD);
+
+    fs->map = (i8*)p;
+  }
+
+  ++fs->mapRefs;
+  *base = fs->map;
+  return 0;
+}
+
+
+// ============================================================================
+// Read 512 bytes from block number 'dbn' in the BFS disk into buffer 'buf'
+// ============================================================================
+i32 bioRead(BFS* fs, i32 dbn, void* buf) {
+  return bioReadRun(fs, dbn, 1, buf);
+}
+
+
+// ============================================================================
+// Read 'numBlocks' consecutive blocks of the BFS disk, starting at block
+// number 'dbn', into 'buf' with a single seek and read
+// ============================================================================
+i32 bioReadRun(BFS* fs, i32 dbn, i32 numBlocks, void* buf) {
+
+  if (dbn < 0)                          FATAL(EBADDBN);
+  if (dbn + numBlocks > BLOCKSPERDISK)  FATAL(EBADDBN);
+
+  TRACEIO(fs, TRACEREAD, dbn, numBlocks);
+  STATSTART(start);
+  if (fs->wback.cap > 0) wbIO(&fs->wback, false, dbn, numBlocks, buf);
+  else                   bioTierIO(fs, false, dbn, numBlocks, buf);
+
+  for (i32 b = 0; b < numBlocks; ++b) {
+    bioCsumCheck(fs, dbn + b, (i8*)buf + b * BYTESPERBLOCK);
+  }
+  STATBLOCKS(fs, false, dbn, numBlocks);
+  STATEND(fs, STATBIOREAD, start, numBlocks * BYTESPERBLOCK);
+  return 0;
+}
+
+
+// ============================================================================
+// Create a new, empty BFS disk, replacing any old one.  fs->path is given its
+// full size of BYTESPERDISK bytes by writing its last byte only, so the
+// blocks in between are left as a hole on the host, taking no space until
+// written.  An in-memory disk (BIOMEM) is simply zeroed.  A striped disk
+// (BIOSTRIPE) creates each of its member files instead (see stripeCreate),
+// and a log (BIOLOG) an empty log (see lfsCreate).  On success, return 0.
+// On failure, abort
+// ============================================================================
+i32 bioCreateDisk(BFS* fs) {
+  if (fs->mem != NULL) {
+    memset(fs->mem, 0, BYTESPERDISK);
+    return 0;
+  }
+  if (fs->stripe.width > 0) return stripeCreate(&fs->stripe);
+  if (fs->lfs.on)           return lfsCreate(&fs->lfs);
+
+  FILE* fp = fopen(fs->path, "w+b");
+  if (fp == NULL) FATAL(EDISKCREATE);
+  if (fseek(fp, BYTESPERDISK - 1, SEEK_SET) != 0) FATAL(EBADWRITE);
+  if (fputc(0, fp) == EOF)                          FATAL(EBADWRITE);
+  if (fclose(fp) != 0)                              FATAL(EBADWRITE);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Check that there is a BFS disk to mount, in fs->path.  If not, abort with
+// ENODISK.  An in-memory disk (BIOMEM) is loaded from it: the volume is then
+// a scratch copy, and fs->path is never written.  A striped disk
+// (BIOSTRIPE) opens and checks its member files instead (see stripeOpen),
+// and a log (BIOLOG) opens and rolls forward the log (see lfsOpen)
+// ============================================================================
+i32 bioCheckDisk(BFS* fs) {
+  if (fs->stripe.width > 0) return stripeOpen(&fs->stripe);
+  if (fs->lfs.on)           return lfsOpen(&fs->lfs);
+  if (fs->path == NULL) FATAL(ENODISK);
+  FILE* fp = fopen(fs->path, "rb");
+  if (fp == NULL) FATAL(ENODISK);           // fs->path not found
+  if (fs->mem != NULL && fread(fs->mem, BYTESPERBLOCK, BLOCKSPERDISK, fp)
+                         != BLOCKSPERDISK) {
+    FATAL(EBADREAD);
+  }
   fclose(fp);
   return 0;
 }
 
 
+
+// ============================================================================
+// Choose where the blocks of volume 'fs' live: BIOFILE, in the file at
+// fs->path (the default), or BIOMEM, in memory, until the volume is closed.
+// An in-memory disk starts out all zeroes, and must be formatted or loaded
+// by bioCheckDisk.  Switching back to BIOFILE discards it.  BIOSTRIPE waits
+// on bioSetStripe to say where.  BIOLOG keeps them in a log in fs->path (see
+// lfs.h), for good: it cannot be switched from.  On success, return 0.  On
+// failure, abort
+// ============================================================================
+i32 bioSetBackend(BFS* fs, i32 backend) {
+  if (backend < BIOFILE || backend > BIOLOG)    FATAL(EBADFLAGS);
+  if (fs->lfs.on)        FATAL(EBADFLAGS);    // log already set up
+  if (fs->mapRefs != 0)  FATAL(EBADFLAGS);    // View still open
+  if (fs->tier.cap != 0 || fs->wback.cap != 0 || fs->elev.on) {
+    FATAL(EBADFLAGS);                         // tier or buffer holds blocks
+  }
+
+  if (backend == BIOMEM && fs->mem == NULL) {
+    fs->mem = calloc(BLOCKSPERDISK, BYTESPERBLOCK);
+    if (fs->mem == NULL) FATAL(ENOMEM);
+  } else if (backend == BIOFILE && fs->mem != NULL) {
+    free(fs->mem);
+    fs->mem = NULL;
+  } else if (backend == BIOLOG) {
+    if (fs->mem != NULL) FATAL(EBADFLAGS);
+    lfsInit(&fs->lfs, fs);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Queue the requests volume 'fs' makes of its backend in an elevator, below
+// its RAM tier and write-back buffer, if any (see elev.h).  Requests made at
+// once, by the flusher, the promoter and callers of bio, go in DBN order,
+// merged, from then on, until bioClose.  'flags' is 0, or for
+// tools/elevbench, ELEVFIFO and ELEVMODEL.  On success, return 0.  On
+// failure, abort
+// ============================================================================
+i32 bioSetElevator(BFS* fs, i32 flags) {
+  if (fs->elev.on) FATAL(EBADFLAGS);
+  return elevInit(&fs->elev, fs, bioDiskIO, flags);
+}
+
+
+
+// ============================================================================
+// Stripe volume 'fs' over the 'width' member files in 'paths', 'unit' blocks
+// at a time, RAID-0 style (see stripe.h).  'unit' 0 takes it from the
+// members, once bioCheckDisk opens them.  The backend must be BIOSTRIPE.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 bioSetStripe(BFS* fs, str* paths, i32 width, i32 unit) {
+  if (fs->mem != NULL || fs->path != NULL) FATAL(EBADFLAGS);
+  if (fs->stripe.width > 0)                FATAL(EBADFLAGS);
+  return stripeInit(&fs->stripe, paths, width, unit);
+}
+
+
+
+// ============================================================================
+// Keep the 'capacity' hottest blocks of volume 'fs' in a RAM tier, above its
+// backend (see tier.h).  bio reads and writes through the tier from then on,
+// until bioClose.  An in-memory disk (BIOMEM) gains nothing from one.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 bioSetTier(BFS* fs, i32 capacity) {
+  if (fs->mem != NULL || fs->tier.cap != 0) FATAL(EBADFLAGS);
+  return tierInit(&fs->tier, fs, bioDevIO, capacity);
+}
+
+
+
+// ============================================================================
+// Hold the blocks written to volume 'fs' in a write-back buffer, above its
+// RAM tier, if any, and backend (see wback.h).  bioWrite and bioWriteRun
+// return once the blocks are buffered, and a flusher thread writes them on
+// down, until bioClose.  An in-memory disk (BIOMEM) gains nothing from one.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 bioSetWriteBack(BFS* fs) {
+  if (fs->mem != NULL || fs->wback.cap != 0) FATAL(EBADFLAGS);
+  return wbInit(&fs->wback, fs, bioTierIO);
+}
+
+
+
+// ============================================================================
+// Make sure the blocks whose DBNs are marked in 'dbns', or every block if
+// 'dbns' is NULL, have reached the backend: wait for the flusher to write
+// them back, if there is a write-back buffer, and then write back the RAM
+// tier, if there is one.  Otherwise, every block is there already.  A log
+// (BIOLOG) then writes out its head segment, and checkpoints.  On success,
+// return 0
+// ============================================================================
+i32 bioSync(BFS* fs, bool* dbns) {
+  if (fs->wback.cap > 0) wbSync(&fs->wback, dbns);
+  if (fs->tier.cap > 0)  tierFlush(&fs->tier);
+  if (fs->lfs.on)        lfsSync(&fs->lfs);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Drop one reference to the mapping made by bioMap.  The last one unmaps it.
+// The caller holds the volume lock
+// ============================================================================
+i32 bioUnmap(BFS* fs) {
+  if (fs->mapRefs <= 0) FATAL(ENULLPTR);
+  if (--fs->mapRefs == 0) {
+    if (bioCopyMap(fs))          free(fs->map);
+    else if (fs->map != fs->mem) munmap(fs->map, BYTESPERDISK);
+    fs->map = NULL;
+    if (fs->wback.cap > 0) wbWriteThrough(&fs->wback, false);
+    if (fs->tier.cap > 0)  tierWriteThrough(&fs->tier, false);
+  }
+  return 0;
+}
+
+
 // ============================================================================
 // Write 512 bytes from 'buf' into block number 'dbn' of the BFS disk
 // ============================================================================
-i32 bioWrite(i32 dbn, void* buf) {
+i32 bioWrite(BFS* fs, i32 dbn, void* buf) {
+  return bioWriteRun(fs, dbn, 1, buf);
+}
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret  = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
 
-  i32 numb = fwrite(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADWRITE); }
+// ============================================================================
+// Write 'numBlocks' blocks from 'buf' into consecutive blocks of the BFS
+// disk, starting at block number 'dbn', with a single seek and write
+// ============================================================================
+i32 bioWriteRun(BFS* fs, i32 dbn, i32 numBlocks, void* buf) {
 
-  fclose(fp);
+  if (dbn < 0)                          FATAL(EBADDBN);
+  if (dbn + numBlocks > BLOCKSPERDISK)  FATAL(EBADDBN);
+
+  TRACEIO(fs, TRACEWRITE, dbn, numBlocks);
+  STATSTART(start);
+  for (i32 b = 0; b < numBlocks; ++b) {
+    bioCsumSet(fs, dbn + b, (i8*)buf + b * BYTESPERBLOCK);
+  }
+
+  if (fs->wback.cap > 0) wbIO(&fs->wback, true, dbn, numBlocks, buf);
+  else                   bioTierIO(fs, true, dbn, numBlocks, buf);
+
+  if (bioCopyMap(fs) && fs->map != NULL) {            // bioMap's copy
+    memcpy(fs->map + dbn * BYTESPERBLOCK, buf, numBlocks * BYTESPERBLOCK);
+  }
 
+  STATBLOCKS(fs, true, dbn, numBlocks);
+  STATEND(fs, STATBIOWRITE, start, numBlocks * BYTESPERBLOCK);
   return 0;
 }
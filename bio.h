@@ -6,11 +6,48 @@
 // functions to the BFS disk
 // ===================================================================
 
+#include <stdbool.h>
 #include <stdio.h>
 
 #include "alias.h"
 
-i32 bioRead (i32 dbn, void* buf);
-i32 bioWrite(i32 dbn, void* buf);
+#define BIOFILE   0       // bioSetBackend: blocks live in the file fs->path
+#define BIOMEM    1       // bioSetBackend: blocks live in memory
+#define BIOSTRIPE 2       // bioSetBackend: blocks striped over member files
+#define BIOLOG    3       // bioSetBackend: blocks appended to a log, fs->path
+
+// ===================================================================
+// Checksums (FEATCSUM).  Every block bio reads from a file, a stripe
+// or a log is checked against its CRC, every time.  An in-memory
+// disk (BIOMEM) is checked once only: a block is summed by bioFlush,
+// from fs->mem itself, checked by the first read after that (or
+// after mount), and then trusted until it is next written.  Its CRC
+// is computed from the very memory it protects, so a check on every
+// read could only catch a stray store into fs->mem, and would cost a
+// CRC per block read.  So such a store is not caught, and neither is
+// a block read between being written and the next bioFlush
+// ===================================================================
+
+i32 bioCheckDisk(BFS* fs);
+i32 bioClose(BFS* fs);
+i32 bioCreateDisk(BFS* fs);
+i32 bioCsumCheck(BFS* fs, i32 dbn, void* buf);
+i32 bioCsumInit (BFS* fs, i32 dbnCsum);
+i32 bioCsumLoad (BFS* fs, i32 dbnCsum, void* table);
+i32 bioCsumRebuild(BFS* fs);
+i32 bioDiscard(BFS* fs, i32 dbn, i32 numBlocks);
+i32 bioFlush(BFS* fs);
+i32 bioMap  (BFS* fs, i8** base);
+i32 bioRead (BFS* fs, i32 dbn, void* buf);
+i32 bioReadRun(BFS* fs, i32 dbn, i32 numBlocks, void* buf);
+i32 bioSetBackend(BFS* fs, i32 backend);
+i32 bioSetElevator(BFS* fs, i32 flags);
+i32 bioSetStripe(BFS* fs, str* paths, i32 width, i32 unit);
+i32 bioSetTier(BFS* fs, i32 capacity);
+i32 bioSetWriteBack(BFS* fs);
+i32 bioSync (BFS* fs, bool* dbns);
+i32 bioUnmap(BFS* fs);
+i32 bioWrite(BFS* fs, i32 dbn, void* buf);
+i32 bioWriteRun(BFS* fs, i32 dbn, i32 numBlocks, void* buf);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,152 @@
+// ============================================================================
+// crc.c - CRC32C (Castagnoli) checksums.  Uses the SSE4.2 or ARMv8 CRC
+// instructions when the CPU has them, and a table-driven loop otherwise
+// ============================================================================
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRCPOLY 0x82F63B78              // CRC32C polynomial, bit-reversed
+#define CRCLANE 168                     // bytes per stream, 3 streams
+
+static u32  g_crcTable[256];
+static u32  g_crcShift[4][256];         // CRC register advanced CRCLANE zeroes
+static bool g_crcHard = false;          // CPU has a crc32c instruction
+
+static pthread_once_t g_crcOnce = PTHREAD_ONCE_INIT;
+
+
+
+// ============================================================================
+// Table-driven CRC32C, one byte at a time
+// ============================================================================
+static u32 crcSoft(u32 crc, const u8* p, i32 numb) {
+  while (numb-- > 0) crc = g_crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+
+
+// ============================================================================
+// Return CRC register 'crc' as it would be after running CRCLANE zero bytes
+// through it.  Lets three independent streams be stitched back together
+// ============================================================================
+static u32 crcShift(u32 crc) {
+  return g_crcShift[0][crc & 0xFF]         ^ g_crcShift[1][(crc >> 8) & 0xFF]
+       ^ g_crcShift[2][(crc >> 16) & 0xFF] ^ g_crcShift[3][crc >> 24];
+}
+
+
+
+#if defined(__x86_64__)
+#define CRC8BYTES(c, v) _mm_crc32_u64((c), (v))
+#define CRC1BYTE(c, v)  _mm_crc32_u8((c), (v))
+#define CRCTARGET       __attribute__((target("sse4.2")))
+
+static bool crcHaveHard() { return __builtin_cpu_supports("sse4.2"); }
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC8BYTES(c, v) __crc32cd((c), (v))
+#define CRC1BYTE(c, v)  __crc32cb((c), (v))
+#define CRCTARGET
+
+static bool crcHaveHard() { return true; }
+#endif
+
+
+
+#ifdef CRC8BYTES
+// ============================================================================
+// CRC32C using the CPU's crc32c instruction, 8 bytes at a time.  The crc32c
+// instruction has a latency of several cycles, so runs of 3 * CRCLANE bytes
+// are split into three streams that proceed in parallel
+// ============================================================================
+CRCTARGET
+static u32 crcHard(u32 crc, const u8* p, i32 numb) {
+  for (; numb >= 3 * CRCLANE; numb -= 3 * CRCLANE, p += 3 * CRCLANE) {
+    u64 c0 = crc, c1 = 0, c2 = 0;
+    for (i32 i = 0; i < CRCLANE; i += 8) {
+      u64 v0, v1, v2;
+      memcpy(&v0, p + i,               8);
+      memcpy(&v1, p + i + CRCLANE,     8);
+      memcpy(&v2, p + i + 2 * CRCLANE, 8);
+      c0 = CRC8BYTES(c0, v0);
+      c1 = CRC8BYTES(c1, v1);
+      c2 = CRC8BYTES(c2, v2);
+    }
+    crc = crcShift((u32)c0) ^ (u32)c1;
+    crc = crcShift(crc)     ^ (u32)c2;
+  }
+
+  u64 c = crc;
+  for (; numb >= 8; numb -= 8, p += 8) {
+    u64 v;
+    memcpy(&v, p, 8);
+    c = CRC8BYTES(c, v);
+  }
+  crc = (u32)c;
+  for (; numb > 0; --numb) crc = CRC1BYTE(crc, *p++);
+  return crc;
+}
+
+#else
+static u32  crcHard(u32 crc, const u8* p, i32 numb) { return crcSoft(crc, p, numb); }
+static bool crcHaveHard() { return false; }
+#endif
+
+
+
+// ============================================================================
+// Build the byte and shift tables, and probe the CPU.  Run once, by whichever
+// thread computes the first CRC
+// ============================================================================
+static void crcInit() {
+  for (u32 i = 0; i < 256; ++i) {
+    u32 c = i;
+    for (i32 k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ CRCPOLY : c >> 1;
+    g_crcTable[i] = c;
+  }
+
+  u8 zeroes[CRCLANE] = {0};
+  for (u32 k = 0; k < 4; ++k) {
+    for (u32 b = 0; b < 256; ++b) {
+      g_crcShift[k][b] = crcSoft(b << (8 * k), zeroes, CRCLANE);
+    }
+  }
+
+  g_crcHard = crcHaveHard();
+}
+
+
+
+// ============================================================================
+// Return the CRC32C of the 'numb' bytes at 'buf'
+// ============================================================================
+u32 crcCompute(const void* buf, i32 numb) {
+  return crcExtend(0, buf, numb);
+}
+
+
+
+// ============================================================================
+// Return the CRC32C of some bytes whose CRC32C is 'crc', followed by the
+// 'numb' bytes at 'buf'.  Lets a stream too big to hold be checksummed a
+// piece at a time, starting from 'crc' 0
+// ============================================================================
+u32 crcExtend(u32 crc, const void* buf, i32 numb) {
+  pthread_once(&g_crcOnce, crcInit);
+
+  crc = ~crc;
+  crc = g_crcHard ? crcHard(crc, (const u8*)buf, numb)
+             : crcSoft(crc, (const u8*)buf, numb);
+  return ~crc;
+}
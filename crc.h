@@ -0,0 +1,13 @@
+#ifndef CRC_H
+#define CRC_H
+
+// ============================================================================
+// crc.h - CRC32C (Castagnoli) checksums for BFS blocks
+// ============================================================================
+
+#include "alias.h"
+
+u32 crcCompute(const void* buf, i32 numb);
+u32 crcExtend (u32 crc, const void* buf, i32 numb);
+
+#endif
@@ -8,14 +8,14 @@
 // ============================================================================
 // Dump block DBN
 // ============================================================================
-i32 debDumpDbn(i32 dbn, i32 size) {
+i32 debDumpDbn(BFS* fs, i32 dbn, i32 size) {
   i8 buf[BYTESPERBLOCK] = {0};
 
   i8*  buf8  = (i8*) buf;
   i16* buf16 = (i16*)buf;
   i32* buf32 = (i32*)buf;
 
-  bioRead(dbn, buf);
+  bioRead(fs, dbn, buf);
 
   printf("\n");
   if (size == 1) {
@@ -52,9 +52,9 @@ i32 debDumpDbn(i32 dbn, i32 size) {
 // ============================================================================
 // Dump the Dir
 // ============================================================================
-i32 debDumpDir() {
+i32 debDumpDir(BFS* fs) {
   i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNDIR, buf);
+  bioRead(fs, DBNDIR, buf);
   Dir* dir = (Dir*)buf;
 
   printf("\n");
@@ -71,9 +71,9 @@ i32 debDumpDir() {
 // ============================================================================
 // Dump the Inodes
 // ============================================================================
-i32 debDumpInodes() {
+i32 debDumpInodes(BFS* fs) {
   i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNINODES, buf);
+  bioRead(fs, DBNINODES, buf);
 
   Inode* inodes = (Inode*) buf;
 
@@ -81,6 +81,10 @@ i32 debDumpInodes() {
   for (int inum = 0; inum < NUMINODES; ++inum) {
     Inode inode = inodes[inum];
     printf("[%d] size = %d \n", inum, inode.size);
+    if (inode.flags & INODEINLINE) {
+      printf("    [%d] inline \n", inum);
+      continue;
+    }
     for (i32 d = 0; d < NUMDIRECT; ++d) {
       printf("    [%d] direct[%d] = %d \n", inum, d, inode.direct[d]);
     }
@@ -95,17 +99,23 @@ i32 debDumpInodes() {
 // ============================================================================
 // Dump the Superblock
 // ============================================================================
-i32 debDumpSuper() {
+i32 debDumpSuper(BFS* fs) {
   i8 buf[BYTESPERBLOCK] = {0};
 
-  bioRead(DBNSUPER, buf);
+  bioRead(fs, DBNSUPER, buf);
 
   Super* super = (Super*)buf;
 
   printf("\n");
+  printf("Super.magic     = %08x \n", super->magic);
+  printf("Super.version   = %d \n", super->version);
+  printf("Super.state     = %04x \n", super->state);
   printf("Super.numBlocks = %d \n", super->numBlocks);
   printf("Super.numInodes = %d \n", super->numInodes);
-  printf("Super.firstFree = %d \n", super->firstFree);
+  printf("Super.dbnFree   = %d \n", super->dbnFree);
+  printf("Super.features  = %04x \n", super->features);
+  printf("Super.dbnCsum   = %d \n", super->dbnCsum);
+  printf("Super.dbnRefs   = %d \n", super->dbnRefs);
   printf("\n"); fflush(stdout);
 
   // Check that remainder of Superblock is all zeroes
@@ -120,3 +130,67 @@ i32 debDumpSuper() {
   return 0;
 }
 
+
+
+// ============================================================================
+// Return the upper bound, in microseconds, of the bucket of histogram 'hist'
+// that the 'pct' percentile of 'calls' falls in
+// ============================================================================
+static double debPercentile(u64* hist, u64 calls, i32 pct) {
+  u64 want = (calls * pct + 99) / 100;
+  u64 seen = 0;
+  for (i32 b = 0; b < STATBUCKETS; ++b) {
+    seen += hist[b];
+    if (seen >= want) return (double)((u64)2 << b) / 1000;
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Dump the I/O counters and latency histograms (see fsStats)
+// ============================================================================
+i32 debDumpStats(BFS* fs) {
+  static const str opNames[NUMSTATOPS] = {
+    "fsRead", "fsWrite", "fsOpen", "fsCreate", "fsClose", "fsDelete",
+    "bioRead", "bioWrite"
+  };
+  static const str kindNames[NUMSTATKINDS] = {
+    "super", "inode", "dir", "meta", "indirect", "data"
+  };
+
+  Stats stats;
+  fsStats(fs, &stats, 0);
+
+  printf("\n");
+  printf("%-9s %10s %12s %10s %10s %10s \n",
+         "call", "calls", "bytes", "avg us", "p50 <us", "p99 <us");
+  for (i32 op = 0; op < NUMSTATOPS; ++op) {
+    StatOp* so = &stats.ops[op];
+    if (so->calls == 0) continue;
+    printf("%-9s %10llu %12llu %10.1f %10.1f %10.1f \n", opNames[op],
+           (unsigned long long)so->calls, (unsigned long long)so->bytes,
+           (double)so->nanos / so->calls / 1000,
+           debPercentile(so->hist, so->calls, 50),
+           debPercentile(so->hist, so->calls, 99));
+  }
+
+  printf("\n%-9s %10s %10s \n", "block", "reads", "writes");
+  for (i32 k = 0; k < NUMSTATKINDS; ++k) {
+    printf("%-9s %10llu %10llu \n", kindNames[k],
+           (unsigned long long)stats.blockReads[k],
+           (unsigned long long)stats.blockWrites[k]);
+  }
+
+  printf("\nallocs = %llu, frees = %llu, discards = %llu \n",
+         (unsigned long long)stats.allocs, (unsigned long long)stats.frees,
+         (unsigned long long)stats.discards);
+  printf("inode reads = %llu, inode writes = %llu, lookups = %llu \n",
+         (unsigned long long)stats.inodeReads,
+         (unsigned long long)stats.inodeWrites,
+         (unsigned long long)stats.lookups);
+  fflush(stdout);
+
+  return 0;
+}
@@ -9,9 +9,10 @@
 #include <stdio.h>
 #include "alias.h"
 
-i32 debDumpDbn   (i32 dbn, i32 size);
-i32 debDumpDir   ();
-i32 debDumpInodes();
-i32 debDumpSuper ();
+i32 debDumpDbn   (BFS* fs, i32 dbn, i32 size);
+i32 debDumpDir   (BFS* fs);
+i32 debDumpInodes(BFS* fs);
+i32 debDumpStats (BFS* fs);
+i32 debDumpSuper (BFS* fs);
 
 #endif
\ No newline at end of file
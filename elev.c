@@ -0,0 +1,339 @@
+// ============================================================================
+// elev.c - elevator I/O scheduler for bio (see elev.h).  Each caller of
+// elevIO queues a request of its own, on its stack, and sleeps until the
+// dispatcher has sent it on.  Requests in the queue together are concurrent,
+// since none of their callers has returned, so the dispatcher may send them
+// in any order.  It drops the lock while it does, so more can queue up
+// ============================================================================
+
+#include <time.h>
+
+#include "bfs.h"
+#include "elev.h"
+#include "stats.h"
+
+#define ELEVMETA      0       // ElevReq classes, most urgent first
+#define ELEVREAD      1
+#define ELEVWRITE     2
+
+#define ELEVMERGE     16      // most requests merged into one
+
+struct ElevReq {          // ElevReq: one caller's request, while queued
+  ElevReq* next;          // next in arrival order
+  bool    write;          // write, rather than read
+  i32     dbn;            // first DBN
+  i32     numBlocks;      // # blocks
+  i8*     buf;            // the caller's buffer
+  i32     cls;            // ELEVMETA, ELEVREAD or ELEVWRITE
+  u64     deadline;       // when it must go next, in ns
+  bool    done;           // sent on: the caller may return
+};
+
+
+
+// ============================================================================
+// Return a monotonic timestamp, in nanoseconds
+// ============================================================================
+static u64 elevNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Take request 'req' off the queue.  The caller holds the lock
+// ============================================================================
+static void elevUnlink(Elevator* el, ElevReq* req) {
+  ElevReq** pp = &el->queue;
+  while (*pp != req) pp = &(*pp)->next;
+  *pp = req->next;
+  --el->numQueued;
+}
+
+
+
+// ============================================================================
+// Return the queued request to send next.  The sweep under way goes on, to
+// the request of its class with the lowest DBN at or past el->pos, for up to
+// ELEVBATCH requests.  Otherwise a new sweep starts, C-LOOK, over the
+// requests past their deadline, if any, or else over those of the most
+// urgent class waiting: at the lowest DBN at or past el->pos, else at the
+// lowest DBN.  Ties go to the oldest.  The caller holds the lock, and the
+// queue is not empty
+// ============================================================================
+static ElevReq* elevNext(Elevator* el) {
+  ElevReq* ahead = NULL;                      // lowest DBN past the head
+  ElevReq* first = NULL;                      // lowest DBN of all
+
+  if (el->left > 0) {
+    for (ElevReq* r = el->queue; r != NULL; r = r->next) {
+      if (r->cls != el->cls || r->dbn < el->pos) continue;
+      if (ahead == NULL || r->dbn < ahead->dbn) ahead = r;
+    }
+    if (ahead != NULL) {
+      --el->left;
+      return ahead;
+    }
+  }
+
+  u64  now     = elevNow();
+  bool overdue = false;
+  i32  cls     = ELEVWRITE;
+  for (ElevReq* r = el->queue; r != NULL; r = r->next) {
+    if (r->deadline <= now) overdue = true;
+    if (r->cls < cls)       cls = r->cls;
+  }
+  for (ElevReq* r = el->queue; r != NULL; r = r->next) {
+    if (overdue ? r->deadline > now : r->cls != cls) continue;
+    if (first == NULL || r->dbn < first->dbn) first = r;
+    if (r->dbn >= el->pos && (ahead == NULL || r->dbn < ahead->dbn)) ahead = r;
+  }
+
+  ElevReq* pick = (ahead != NULL) ? ahead : first;
+  if (overdue) STATADD(el->fs, elevExpired, 1);
+  el->cls  = pick->cls;
+  el->left = ELEVBATCH - 1;
+  return pick;
+}
+
+
+
+// ============================================================================
+// Take the requests to send next off the queue, into 'batch', in DBN order,
+// and return how many.  With ELEVFIFO, that is the oldest, alone.
+// Otherwise it is elevNext's choice, along with every queued request in the
+// same direction that extends it, up to ELEVMERGE in all.  The caller holds
+// the lock, and the queue is not empty
+// ============================================================================
+static i32 elevPick(Elevator* el, ElevReq** batch) {
+  if (el->flags & ELEVFIFO) {
+    batch[0] = el->queue;
+    el->queue = el->queue->next;
+    --el->numQueued;
+    return 1;
+  }
+
+  ElevReq* pick = elevNext(el);
+  elevUnlink(el, pick);
+  batch[0] = pick;
+  i32 num = 1;
+  i32 lo  = pick->dbn;
+  i32 hi  = pick->dbn + pick->numBlocks;
+  ElevReq* r = el->queue;
+  while (r != NULL && num < ELEVMERGE) {      // rescan after each merge
+    bool next = r->dbn == hi || r->dbn + r->numBlocks == lo;
+    if (r->write != pick->write || !next) {
+      r = r->next;
+      continue;
+    }
+    if (r->dbn == hi) {
+      batch[num] = r;
+      hi += r->numBlocks;
+    } else {
+      memmove(batch + 1, batch, num * sizeof(ElevReq*));
+      batch[0] = r;
+      lo = r->dbn;
+    }
+    ++num;
+    elevUnlink(el, r);
+    STATADD(el->fs, elevMerges, 1);
+    r = el->queue;
+  }
+  return num;
+}
+
+
+
+// ============================================================================
+// Wait as long as a spinning disk would take to move its head from el->pos
+// to DBN 'dbn', and then transfer 'numBlocks' blocks: a seek that grows with
+// the distance, and half a turn on average to find the block, unless the
+// head is there already
+// ============================================================================
+static void elevModel(Elevator* el, i32 dbn, i32 numBlocks) {
+  i64 us = numBlocks * ELEVXFERUS;
+  if (dbn != el->pos) {
+    i32 dist = abs(dbn - el->pos);
+    us += ELEVSETTLEUS + ELEVROTUS
+        + (ELEVSEEKUS - ELEVSETTLEUS) * dist / BLOCKSPERDISK;
+  }
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+  while (nanosleep(&ts, &ts) != 0) {}
+}
+
+
+
+// ============================================================================
+// Send the 'num' requests in 'batch', in DBN order and each extending the
+// one before, to the backend, as one request.  Merged writes are gathered
+// into el->bounce first, and merged reads scattered from it after
+// ============================================================================
+static void elevRun(Elevator* el, ElevReq** batch, i32 num) {
+  bool write = batch[0]->write;
+  i32  dbn   = batch[0]->dbn;
+  i32  end   = batch[num - 1]->dbn + batch[num - 1]->numBlocks;
+
+  if (dbn != el->pos) {
+    STATADD(el->fs, elevSeeks, 1);
+    STATADD(el->fs, elevSeekDist, abs(dbn - el->pos));
+  }
+  if (el->flags & ELEVMODEL) elevModel(el, dbn, end - dbn);
+
+  if (num == 1) {
+    el->io(el->fs, write, dbn, end - dbn, batch[0]->buf);
+  } else {
+    for (i32 i = 0; write && i < num; ++i) {
+      i8* at = el->bounce + (batch[i]->dbn - dbn) * BYTESPERBLOCK;
+      memcpy(at, batch[i]->buf, batch[i]->numBlocks * BYTESPERBLOCK);
+    }
+    el->io(el->fs, write, dbn, end - dbn, el->bounce);
+    for (i32 i = 0; !write && i < num; ++i) {
+      i8* at = el->bounce + (batch[i]->dbn - dbn) * BYTESPERBLOCK;
+      memcpy(batch[i]->buf, at, batch[i]->numBlocks * BYTESPERBLOCK);
+    }
+  }
+  el->pos = end;
+}
+
+
+
+// ============================================================================
+// Body of the dispatcher thread.  'arg' is the Elevator.  Sends on queued
+// requests, a batch at a time, and wakes their callers.  Exits once told to
+// stop by elevClose, and the queue is empty
+// ============================================================================
+static void* elevDispatcher(void* arg) {
+  Elevator* el = (Elevator*)arg;
+  ElevReq* batch[ELEVMERGE];
+
+  pthread_mutex_lock(&el->lock);
+  for (;;) {
+    while (el->queue == NULL && !el->stop) {
+      pthread_cond_wait(&el->work, &el->lock);
+    }
+    if (el->queue == NULL) break;
+
+    i32 num = elevPick(el, batch);
+    el->runDbn   = batch[0]->dbn;
+    el->runEnd   = batch[num - 1]->dbn + batch[num - 1]->numBlocks;
+    el->runWrite = batch[0]->write;
+    pthread_mutex_unlock(&el->lock);
+    elevRun(el, batch, num);
+    pthread_mutex_lock(&el->lock);
+
+    el->runWrite = false;                       // none under way
+    for (i32 i = 0; i < num; ++i) batch[i]->done = true;
+    pthread_cond_broadcast(&el->done);
+  }
+  pthread_mutex_unlock(&el->lock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Stop the dispatcher, once it has sent on what is queued, and free the
+// queue.  Does nothing if 'el' is not on
+// ============================================================================
+void elevClose(Elevator* el) {
+  if (!el->on) return;
+
+  pthread_mutex_lock(&el->lock);
+  el->stop = true;
+  pthread_cond_signal(&el->work);
+  pthread_mutex_unlock(&el->lock);
+  if (el->started) pthread_join(el->thread, NULL);
+
+  free(el->bounce);
+  pthread_mutex_destroy(&el->lock);
+  pthread_cond_destroy(&el->work);
+  pthread_cond_destroy(&el->done);
+  memset(el, 0, sizeof(Elevator));
+}
+
+
+
+// ============================================================================
+// Wait until no write to any of DBNs 'dbn' .. 'dbn' + 'numBlocks' - 1 is
+// queued, or being sent.  bioDiscard calls this before it punches a hole
+// below the elevator, so no write queued ahead of the hole lands after it.
+// Does nothing if 'el' is not on
+// ============================================================================
+void elevDrain(Elevator* el, i32 dbn, i32 numBlocks) {
+  if (!el->on) return;
+
+  i32 end = dbn + numBlocks;
+  pthread_mutex_lock(&el->lock);
+  for (;;) {
+    bool busy = el->runWrite && el->runDbn < end && dbn < el->runEnd;
+    for (ElevReq* req = el->queue; !busy && req != NULL; req = req->next) {
+      busy = req->write && req->dbn < end && dbn < req->dbn + req->numBlocks;
+    }
+    if (!busy) break;
+    pthread_cond_wait(&el->done, &el->lock);
+  }
+  pthread_mutex_unlock(&el->lock);
+}
+
+
+
+// ============================================================================
+// Set up 'el' as an empty queue for volume 'fs', in front of the backend
+// reached through 'io', scheduled as 'flags' says (ELEVFIFO, ELEVMODEL), and
+// start its dispatcher.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 elevInit(Elevator* el, BFS* fs, TierIO* io, i32 flags) {
+  if (fs == NULL || io == NULL)           FATAL(ENULLPTR);
+  if (flags & ~(ELEVFIFO | ELEVMODEL))    FATAL(EBADFLAGS);
+
+  memset(el, 0, sizeof(Elevator));
+  el->on     = true;
+  el->flags  = flags;
+  el->fs     = fs;
+  el->io     = io;
+  el->bounce = malloc(BLOCKSPERDISK * BYTESPERBLOCK);
+  if (el->bounce == NULL) FATAL(ENOMEM);
+
+  pthread_mutex_init(&el->lock, NULL);
+  pthread_cond_init(&el->work, NULL);
+  pthread_cond_init(&el->done, NULL);
+  if (pthread_create(&el->thread, NULL, elevDispatcher, el) != 0) {
+    FATAL(ENOMEM);
+  }
+  el->started = true;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from DBN 'dbn', to or from 'buf':
+// queue the request, and wait for the dispatcher to send it on.  Blocks
+// below fs->dbnData are metadata, and go first.  On success, return 0.  On
+// failure, abort
+// ============================================================================
+i32 elevIO(Elevator* el, bool write, i32 dbn, i32 numBlocks, void* buf) {
+  ElevReq req;
+  req.next      = NULL;
+  req.write     = write;
+  req.dbn       = dbn;
+  req.numBlocks = numBlocks;
+  req.buf       = (i8*)buf;
+  req.cls       = (dbn < el->fs->dbnData) ? ELEVMETA
+                : write ? ELEVWRITE : ELEVREAD;
+  req.deadline  = elevNow()
+                + (u64)(write ? ELEVWRITEDL : ELEVREADDL) * 1000000;
+  req.done      = false;
+
+  pthread_mutex_lock(&el->lock);
+  ElevReq** pp = &el->queue;
+  while (*pp != NULL) pp = &(*pp)->next;
+  *pp = &req;
+  ++el->numQueued;
+  pthread_cond_signal(&el->work);
+  while (!req.done) pthread_cond_wait(&el->done, &el->lock);
+  pthread_mutex_unlock(&el->lock);
+  return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef ELEV_H
+#define ELEV_H
+
+// ============================================================================
+// elev.h - elevator I/O scheduler for bio.  Requests for the backend are
+// queued, and a dispatcher thread sends them on one at a time, in C-LOOK
+// order: the lowest DBN at or past where the last one ended, else back to
+// the lowest DBN queued.  Metadata goes before reads, and reads before
+// writes, but a sweep, once started, sends up to ELEVBATCH requests of its
+// class before it looks again, so that one class does not keep the head
+// from the other.  Queued neighbours in the same direction are merged into
+// one request.  Once any request has waited past its deadline, the next
+// sweep is over those that have, whatever their class, so none starves.
+// ELEVFIFO sends them in arrival order instead, unmerged, and ELEVMODEL adds
+// the latency of a spinning disk, for tools/elevbench to compare the two
+// ============================================================================
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "alias.h"
+#include "tier.h"
+
+#define ELEVFIFO      0x0001  // bioSetElevator: arrival order, no merging
+#define ELEVMODEL     0x0002  // bioSetElevator: model a spinning disk
+
+#define ELEVREADDL    50      // ms a read may wait before it goes next
+#define ELEVWRITEDL   250     // ms a write may wait before it goes next
+#define ELEVBATCH     16      // most requests sent in one sweep
+
+#define ELEVSEEKUS    2000    // ELEVMODEL: full-stroke seek, in us
+#define ELEVSETTLEUS  200     // ELEVMODEL: shortest seek, in us
+#define ELEVROTUS     1000    // ELEVMODEL: rotational delay after a seek
+#define ELEVXFERUS    20      // ELEVMODEL: transfer time per block
+
+typedef struct ElevReq ElevReq;
+
+typedef struct {          // Elevator: a volume's scheduler (BFS.elev)
+  bool    on;             // requests go through the queue
+  i32     flags;          // ELEVFIFO, ELEVMODEL
+  BFS*    fs;             // volume the queue belongs to
+  TierIO* io;             // reads and writes the backend itself
+  i8*     bounce;         // a whole disk: merged requests go through here
+  ElevReq* queue;         // requests waiting, in arrival order
+  i32     numQueued;      // # requests in 'queue'
+  i32     pos;            // DBN just past the last request sent
+  i32     cls;            // class of the sweep under way
+  i32     left;           // # requests it may still send
+  i32     runDbn;         // blocks of the batch being sent:
+  i32     runEnd;         //   'runDbn' .. 'runEnd' - 1
+  bool    runWrite;       // a batch of writes is being sent
+  pthread_mutex_t lock;   // guards the queue, and 'stop'
+  pthread_cond_t  work;   // queue filled, or 'stop' set
+  pthread_cond_t  done;   // some request finished
+  pthread_t thread;       // the dispatcher, once 'started'
+  bool    started;        // dispatcher thread is running
+  bool    stop;           // dispatcher should exit, once the queue is empty
+} Elevator;
+
+void elevClose(Elevator* el);
+void elevDrain(Elevator* el, i32 dbn, i32 numBlocks);
+i32  elevInit (Elevator* el, BFS* fs, TierIO* io, i32 flags);
+i32  elevIO   (Elevator* el, bool write, i32 dbn, i32 numBlocks, void* buf);
+
+#endif
@@ -63,6 +63,26 @@ void RepError(i32 e) {
       printf("\nERROR: Function Note Yet Implemented \n");     pause(); break;
     case EOFTFULL:
       printf("\nERROR: OpenFileTable is full \n");             pause(); break;
+    case ECSUM:
+      printf("\nERROR: Block checksum mismatch \n");           pause(); break;
+    case ENOVIEW:
+      printf("\nERROR: File cannot be viewed in place \n");    pause(); break;
+    case ENOSHARE:
+      printf("\nERROR: Volume cannot share blocks \n");        pause(); break;
+    case EBADFLAGS:
+      printf("\nERROR: Invalid combination of flags \n");      pause(); break;
+    case EBADSUPER:
+      printf("\nERROR: Not a BFS volume of this geometry \n"); pause(); break;
+    case EBADSTRIPE:
+      printf("\nERROR: Stripe member is missing or wrong \n"); pause(); break;
+    case EBADLOG:
+      printf("\nERROR: Log has no valid checkpoint \n");       pause(); break;
+    case EBADPACK:
+      printf("\nERROR: Not a packed image, or damaged \n");    pause(); break;
+    case EBIGDISK:
+      printf("\nERROR: Disk too big for a FEAT* table \n");    pause(); break;
+    case ENOTOPEN:
+      printf("\nERROR: File is not open \n");                 pause(); break;
     case EBADWHENCE:
       printf("\nERROR: Invalid 'whence' in fsSeek \n");        pause(); break;
     default:
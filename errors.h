@@ -29,6 +29,16 @@ void RepTest(int err, str file, int line);
 #define ENULLPTR    -19   // about to deref a NULL pointer
 #define ENYI        -20   // not yet implemented
 #define EOFTFULL    -21   // OpenFileTable is full
+#define ECSUM       -22   // block checksum mismatch - data is corrupt
+#define ENOVIEW     -23   // file cannot be viewed in place (compressed)
+#define ENOSHARE    -24   // volume was not formatted to share blocks
+#define EBADFLAGS   -25   // invalid combination of flags
+#define EBADSUPER   -26   // not a BFS volume, or not this geometry
+#define EBADSTRIPE  -27   // stripe member missing, misplaced or foreign
+#define EBADLOG     -28   // log volume has no valid checkpoint
+#define EBADPACK    -29   // not a packed image, or a damaged one
+#define EBIGDISK    -30   // disk too big for a FEAT* option's table
+#define ENOTOPEN    -31   // file is not open
 
 void pause();
 void RepError(i32 ret);
@@ -7,8 +7,8 @@ Project 5 - Filesystem (BFS)
 
 This C programs primary objective is to implement a Bothell
 File System (BFS) that has similar functions to an unix-like
-file system. We were responsible of implementing fsRead() and
-fsWrite() that incorporated 3 layers: fs, bfs, bio. 
+file system. We were responsible of implementing fsRead(fs) and
+fsWrite(fs) that incorporated 3 layers: fs, bfs, bio. 
 
 */
 
@@ -18,25 +18,180 @@ fsWrite() that incorporated 3 layers: fs, bfs, bio.
 
 #include "bfs.h"
 #include "fs.h"
+#include "trace.h"
 #include <stdbool.h>
+#include <stddef.h>
+
+#define COPYBATCH 32      // fsCopyRange moves data this many blocks at a time
+
+static i32 fsReadAt (BFS* fs, i32 inum, i32 offset, i32 numb, i8* dst);
+static i32 fsWriteAt(BFS* fs, i32 inum, i32 offset, i32 numb, i8* src);
+
+// ============================================================================
+// Check the volume for blocks leaked, lost, mapped twice or out of range,
+// and RefTable counts gone wrong (see bfsCheck), filling in 'report'.  With
+// FSCKREPAIR in 'flags', fix them too.  Return the # of problems found.  On
+// failure, abort
+// ============================================================================
+i32 fsCheck(BFS* fs, i32 flags, FsckReport* report) {
+  if (report == NULL) FATAL(ENULLPTR);
+  if (flags & ~FSCKREPAIR) FATAL(EBADFLAGS);
+
+  bfsLock(fs);
+  i32 ret = bfsCheck(fs, flags, report);
+  bfsUnlock(fs);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Create file 'dstName' as a copy of the file open on File Descriptor
+// 'srcFd', without copying any data: the new file shares every data block
+// with the original, and whichever file is written to later gets its own
+// copy of the blocks it changes.  The volume must have been formatted with
+// FEATSHARE or FEATDEDUP.  On success, return the new file's descriptor,
+// open.  If the volume cannot share blocks, return ENOSHARE.  On failure,
+// abort
+// ============================================================================
+i32 fsClone(BFS* fs, i32 srcFd, str dstName) {
+  if (!bfsHasRefs(fs)) return ENOSHARE;
+  bfsLock(fs);
+  i32 inum = bfsCloneFile(fs, bfsFdToInum(srcFd), dstName);
+  bfsFlush(fs);
+  bfsUnlock(fs);
+  return bfsInumToFd(inum);
+}
+
+
 
 // ============================================================================
 // Close the file currently open on file descriptor 'fd'.
 // ============================================================================
-i32 fsClose(i32 fd) { 
+i32 fsClose(BFS* fs, i32 fd) { 
+  STATSTART(start);
+  TRACEBEGIN(fs, STATFSCLOSE);
   i32 inum = bfsFdToInum(fd);
-  bfsDerefOFT(inum);
+  bfsLock(fs);
+  bfsDerefOFT(fs, inum);
+  bfsFlush(fs);
+  bfsUnlock(fs);
+  TRACEEND(fs);
+  STATEND(fs, STATFSCLOSE, start, 0);
   return 0; 
 }
 
 
 
+// ============================================================================
+// Copy 'len' bytes from byte 'srcOff' of the file open on 'srcFd' to byte
+// 'dstOff' of the file open on 'dstFd', inside the filesystem.  The copy
+// stops at the source's EOF; the destination grows as needed.  Where the
+// volume shares blocks and both offsets are block-aligned, whole blocks are
+// shared rather than copied (see bfsShareRange).  Everything else moves
+// through one internal buffer, COPYBATCH blocks at a time.  Neither cursor
+// moves.  The two ranges may lie in the same file, but must not overlap.  On
+// success, return the number of bytes copied.  On failure, abort
+// ============================================================================
+i32 fsCopyRange(BFS* fs, i32 srcFd, i32 srcOff, i32 dstFd, i32 dstOff,
+                i32 len) {
+  if (srcOff < 0 || dstOff < 0) FATAL(EBADCURS);
+  if (len < 0)                  FATAL(ENEGNUMB);
+
+  i32 srcInum = bfsFdToInum(srcFd);
+  i32 dstInum = bfsFdToInum(dstFd);
+  bfsLock(fs);
+  bfsGetOFTE(fs, srcInum);                      // both must be open
+  bfsGetOFTE(fs, dstInum);
+
+  i32 srcSize = bfsGetSize(fs, srcInum);
+  if (srcOff >= srcSize)            len = 0;
+  else if (srcOff + len > srcSize)  len = srcSize - srcOff;
+  if (len == 0) {
+    bfsUnlock(fs);
+    return 0;
+  }
+
+  if (dstOff + len > (NUMDIRECT + I16SPERBLOCK) * BYTESPERBLOCK) {
+    FATAL(EBIGNUMB);
+  }
+  if (srcInum == dstInum && srcOff < dstOff + len && dstOff < srcOff + len) {
+    FATAL(EBADCURS);
+  }
+
+  i32 done = 0;
+
+  //Share whole blocks, if we can
+  i32 numBlocks = len / BYTESPERBLOCK;
+  if (bfsHasRefs(fs) && numBlocks > 0
+      && srcOff % BYTESPERBLOCK == 0 && dstOff % BYTESPERBLOCK == 0) {
+    Inode src, dst;
+    bfsReadInode(fs, srcInum, &src);
+    bfsReadInode(fs, dstInum, &dst);
+    if ((dst.flags & INODEINLINE) && (dst.flags & INODELZ) == 0) {
+      bfsUninline(fs, dstInum);
+      bfsReadInode(fs, dstInum, &dst);
+    }
+    bool plain = ((src.flags | dst.flags) & (INODEINLINE | INODELZ)) == 0;
+    if (plain) {
+      Inode* from = (srcInum == dstInum) ? &dst : &src;
+      bfsShareRange(fs, from, srcOff / BYTESPERBLOCK,
+                    &dst, dstOff / BYTESPERBLOCK, numBlocks);
+      done = numBlocks * BYTESPERBLOCK;
+      if (dstOff + done > dst.size) dst.size = dstOff + done;
+      bfsWriteInode(fs, dstInum, &dst);
+    }
+  }
+
+  //Copy whatever is left
+  if (done < len) {
+    i32 batch = COPYBATCH * BYTESPERBLOCK;
+    if (batch > len - done) batch = len - done;
+    i8* buf = malloc(batch);
+    if (buf == NULL) FATAL(ENOMEM);
+    while (done < len) {
+      i32 numb = len - done;
+      if (numb > batch) numb = batch;
+      fsReadAt (fs, srcInum, srcOff + done, numb, buf);
+      fsWriteAt(fs, dstInum, dstOff + done, numb, buf);
+      done += numb;
+    }
+    free(buf);
+  }
+
+  bfsUnlock(fs);
+  return done;
+}
+
+
+
 // ============================================================================
 // Create the file called 'fname'.  Overwrite, if it already exsists.
 // On success, return its file descriptor.  On failure, EFNF
 // ============================================================================
-i32 fsCreate(str fname) {
-  i32 inum = bfsCreateFile(fname);
+i32 fsCreate(BFS* fs, str fname) {
+  return fsCreateOpts(fs, fname, 0);
+}
+
+
+
+// ============================================================================
+// Create the file called 'fname', as fsCreate does.  'opts' can include:
+//
+//  FSCOMPRESS : store the file as LZ-compressed chunks of CHUNKSIZE bytes
+//
+// On success, return its file descriptor.  On failure, EFNF
+// ============================================================================
+i32 fsCreateOpts(BFS* fs, str fname, i32 opts) {
+  STATSTART(start);
+  TRACEBEGIN(fs, STATFSCREATE);
+  i32 flags = (opts & FSCOMPRESS) ? INODELZ : 0;
+  bfsLock(fs);
+  i32 inum = bfsCreateFile(fs, fname, flags);
+  if (inum != EFNF) bfsFlush(fs);
+  bfsUnlock(fs);
+  TRACEEND(fs);
+  STATEND(fs, STATFSCREATE, start, 0);
   if (inum == EFNF) return EFNF;
   return bfsInumToFd(inum);
 }
@@ -44,38 +199,359 @@ i32 fsCreate(str fname) {
 
 
 // ============================================================================
-// Format the BFS disk by initializing the SuperBlock, Inodes, Directory and 
-// Freelist.  On succes, return 0.  On failure, abort
+// Delete the file called 'fname'.  The name is gone, and its Directory slot
+// free, on return; its blocks are freed in the background, by the reclaimer.
+// Any File Descriptor still open on the file becomes invalid.  fsWaitReclaim
+// waits for the space to come back.  On success, return 0.  If there is no
+// such file, return EFNF
 // ============================================================================
-i32 fsFormat() {
-  FILE* fp = fopen(BFSDISK, "w+b");
-  if (fp == NULL) FATAL(EDISKCREATE);
+i32 fsDelete(BFS* fs, str fname) {
+  STATSTART(start);
+  TRACEBEGIN(fs, STATFSDELETE);
+  bfsLock(fs);
+  i32 ret = bfsDeleteFile(fs, fname);
+  if (ret != EFNF) bfsFlush(fs);
+  bfsUnlock(fs);
+  TRACEEND(fs);
+  STATEND(fs, STATFSDELETE, start, 0);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Zero 'numb' bytes, starting 'boff' bytes in, of FBN 'fbn' of file 'inode'.
+// A hole is left alone.  If the new contents need a different block (the
+// volume shares blocks), 'inode' is updated in memory
+// ============================================================================
+static void fsZeroPart(BFS* fs, Inode* inode, i32 fbn, i32 boff, i32 numb) {
+  i16 dbn;
+  bfsMapRange(fs, inode, fbn, 1, &dbn);
+  if (dbn == 0) return;
+
+  i8 block[BYTESPERBLOCK];
+  bioRead(fs, dbn, block);
+  memset(block + boff, 0, numb);
+  if (!bfsHasRefs(fs)) {
+    bioWrite(fs, dbn, block);
+  } else if (bfsWriteShared(fs, &dbn, block, false)) {
+    bfsSetMapRange(fs, inode, fbn, 1, &dbn);
+  }
+}
+
+
+
+// ============================================================================
+// Manipulate the space behind bytes 'offset' .. 'offset' + 'len' - 1 of the
+// file open on File Descriptor 'fd'.  'flags' can include:
+//
+//  (none)      : reserve blocks for every FBN in the range not yet mapped,
+//                as contiguously as free space allows, and grow the file to
+//                cover the range.  The new blocks read as zeroes
+//  FSKEEPSIZE  : as above, but leave the file size alone.  Blocks reserved
+//                beyond EOF are used by later writes
+//  FSPUNCHHOLE : make the range read as zeroes, freeing the whole blocks
+//                inside it.  Never changes the file size
+//  FSZERORANGE : make the range read as zeroes, with every block in it
+//                freshly reserved.  Grows the file, unless FSKEEPSIZE
+//
+// Inline files only reserve once the range outgrows their Inode.  A
+// compressed file cannot reserve space, since its chunks are sized as they
+// are written; punching or zeroing one writes zeroes, which are stored as
+// holes.  'fd' must be open, and its cursor does not move.  On success,
+// return 0.  On failure (ENOTOPEN if 'fd' is not open), abort
+// ============================================================================
+i32 fsFallocate(BFS* fs, i32 fd, i32 offset, i32 len, i32 flags) {
+  if (offset < 0) FATAL(EBADCURS);
+  if (len < 0)    FATAL(ENEGNUMB);
+  if (flags & ~(FSKEEPSIZE | FSPUNCHHOLE | FSZERORANGE)) FATAL(EBADFLAGS);
+  if ((flags & FSPUNCHHOLE) && (flags & FSZERORANGE))    FATAL(EBADFLAGS);
+  if (offset + len > (NUMDIRECT + I16SPERBLOCK) * BYTESPERBLOCK) {
+    FATAL(EBIGNUMB);
+  }
+
+  i32 inum = bfsFdToInum(fd);
+  bfsLock(fs);
+  bfsGetOFTE(fs, inum);                         // must be open
+  if (len == 0) {
+    bfsUnlock(fs);
+    return 0;
+  }
+
+  i32  end     = offset + len;
+  bool zero    = (flags & (FSPUNCHHOLE | FSZERORANGE)) != 0;
+  bool reserve = (flags & FSPUNCHHOLE) == 0;
+
+  Inode inode;
+  bfsReadInode(fs, inum, &inode);
+
+  if (inode.flags & INODELZ) {
+    i32 stop = (end < inode.size) ? end : inode.size;
+    if (zero && offset < stop) {
+      i8* zeroes = calloc(stop - offset, 1);
+      if (zeroes == NULL) FATAL(ENOMEM);
+      fsWriteAt(fs, inum, offset, stop - offset, zeroes);
+      free(zeroes);
+      bfsReadInode(fs, inum, &inode);
+    }
+    if ((inode.flags & INODEINLINE) && reserve && end > INLINESIZE) {
+      bfsUninline(fs, inum);                // outgrows the Inode
+      bfsReadInode(fs, inum, &inode);
+    }
+  } else {
+    if (inode.flags & INODEINLINE) {
+      if (zero && offset < INLINESIZE) {
+        i32 stop = (end < INLINESIZE) ? end : INLINESIZE;
+        memset(inode.data + offset, 0, stop - offset);
+        bfsWriteInode(fs, inum, &inode);
+      }
+      if (reserve && end > INLINESIZE) {    // outgrows the Inode
+        bfsUninline(fs, inum);
+        bfsReadInode(fs, inum, &inode);
+      }
+    }
+
+    if (zero && (inode.flags & INODEINLINE) == 0) {
+      //Zero a partial head block in place, free the whole blocks, and zero
+      //a partial tail block in place
+      i32 fbn = offset / BYTESPERBLOCK;
+      i32 boff = offset % BYTESPERBLOCK;
+      if (boff != 0 || end < (fbn + 1) * BYTESPERBLOCK) {
+        i32 stop = (end < (fbn + 1) * BYTESPERBLOCK)
+                 ? end - fbn * BYTESPERBLOCK : BYTESPERBLOCK;
+        fsZeroPart(fs, &inode, fbn, boff, stop - boff);
+        ++fbn;
+      }
+      i32 lastFBN = end / BYTESPERBLOCK;    // 1st FBN not wholly in range
+      if (lastFBN >= fbn) {
+        bfsPunchRange(fs, &inode, fbn, lastFBN - fbn);
+        if (end % BYTESPERBLOCK != 0) {
+          fsZeroPart(fs, &inode, lastFBN, 0, end % BYTESPERBLOCK);
+        }
+      }
+    }
 
-  i32 ret = bfsInitSuper(fp);               // initialize Super block
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+    if (reserve && (inode.flags & INODEINLINE) == 0) {
+      //Map every FBN in the range, taking all the missing blocks at once
+      i32 firstFBN = offset / BYTESPERBLOCK;
+      i32 count    = (end - 1) / BYTESPERBLOCK - firstFBN + 1;
+      i16 dbns [NUMDIRECT + I16SPERBLOCK];
+      i16 fresh[NUMDIRECT + I16SPERBLOCK];
+      bfsMapRange(fs, &inode, firstFBN, count, dbns);
 
-  ret = bfsInitInodes(fp);                  // initialize Inodes block
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+      i32 numFresh = 0;
+      for (i32 i = 0; i < count; ++i) if (dbns[i] == 0) ++numFresh;
 
-  ret = bfsInitDir(fp);                     // initialize Dir block
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+      if (numFresh > 0) {
+        bfsAllocContig(fs, numFresh, fresh);
+        i8* zeroes = calloc(numFresh, BYTESPERBLOCK);
+        if (zeroes == NULL) FATAL(ENOMEM);
+        for (i32 f = 0; f < numFresh; ) {
+          i32 run = 1;
+          while (f + run < numFresh && fresh[f + run] == fresh[f] + run) ++run;
+          bioWriteRun(fs, fresh[f], run, zeroes);
+          f += run;
+        }
+        free(zeroes);
 
-  ret = bfsInitFreeList();                  // initialize Freelist
-  if (ret != 0) { fclose(fp); FATAL(ret); }
+        for (i32 i = 0, f = 0; i < count; ++i) {
+          if (dbns[i] == 0) dbns[i] = fresh[f++];
+        }
+        bfsSetMapRange(fs, &inode, firstFBN, count, dbns);
+      }
+    }
+  }
 
-  fclose(fp);
+  if (reserve && (flags & FSKEEPSIZE) == 0 && end > inode.size) {
+    inode.size = end;
+  }
+  bfsWriteInode(fs, inum, &inode);
+  bfsUnlock(fs);
   return 0;
 }
 
 
+
 // ============================================================================
-// Mount the BFS disk.  It must already exist
+// Make the data of the file open on File Descriptor 'fd' durable, as fsFsync
+// does, but without the volume's tables: just its data blocks, its indirect
+// block, and its Inode, which holds its size and block map.  BFS keeps no
+// timestamps, so that is all the metadata needed to read the data back; the
+// tables are rebuilt when a volume that was not unmounted is next mounted.
+// On success, return 0.  On failure, abort
 // ============================================================================
-i32 fsMount() {
-  FILE* fp = fopen(BFSDISK, "rb");
-  if (fp == NULL) FATAL(ENODISK);           // BFSDISK not found
-  fclose(fp);
-  return 0;
+i32 fsFdatasync(BFS* fs, i32 fd) {
+  i32 inum = bfsFdToInum(fd);
+  bfsLock(fs);
+  bfsGetOFTE(fs, inum);                         // must be open
+  i32 ret = bfsSync(fs, inum, false);
+  bfsUnlock(fs);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Return the bio backend fsFormat and fsMount keep a volume's blocks in, as
+// 'opts' says: in memory with FSMEMORY, which goes with no other option, in
+// a log with FSLOG, or else in the file itself
+// ============================================================================
+static i32 fsBackend(i32 opts) {
+  if (opts & ~(FSMEMORY | FSTIERED | FSWRITEBACK | FSELEVATOR | FSLOG)) {
+    FATAL(EBADFLAGS);
+  }
+  if ((opts & FSMEMORY) && opts != FSMEMORY)        FATAL(EBADFLAGS);
+  if (opts & FSMEMORY) return BIOMEM;
+  return (opts & FSLOG) ? BIOLOG : BIOFILE;
+}
+
+
+
+// ============================================================================
+// Format the disk of newly opened volume 'fs', for fsFormat and
+// fsFormatStriped, with an elevator if FSELEVATOR is in 'opts', and a RAM
+// tier if FSTIERED is.  With FSWRITEBACK, writes are buffered once the new
+// volume is on disk.  Return 'fs'
+// ============================================================================
+static BFS* fsFormatVolume(BFS* fs, i32 features, i32 opts) {
+  if (opts & FSELEVATOR) bioSetElevator(fs, 0);
+  if (opts & FSTIERED)   bioSetTier(fs, TIERBLOCKS);
+  bioCreateDisk(fs);                          // sparse: free blocks are holes
+
+  i32 ret = bfsInitVolume(fs, features);      // all metadata, in one write
+  if (ret != 0) FATAL(ret);
+
+  bfsFlush(fs);                               // tables, if any
+  if (opts & FSWRITEBACK) bioSetWriteBack(fs);
+  return fs;
+}
+
+
+
+// ============================================================================
+// Mount the disk of newly opened volume 'fs', for fsMount and
+// fsMountStriped, with an elevator if FSELEVATOR is in 'opts', and a RAM
+// tier if FSTIERED is.  With FSWRITEBACK, writes are buffered once the
+// SuperBlock on disk says the volume is mounted, so a crash from then on is
+// always recovered.  Return 'fs'
+// ============================================================================
+static BFS* fsMountVolume(BFS* fs, i32 opts) {
+  if (opts & FSELEVATOR) bioSetElevator(fs, 0);
+  if (opts & FSTIERED)   bioSetTier(fs, TIERBLOCKS);
+  bioCheckDisk(fs);
+
+  bfsLock(fs);
+  i32 ret = bfsMountVolume(fs);
+  bfsUnlock(fs);
+  if (ret != 0) FATAL(ret);
+  if (opts & FSWRITEBACK) bioSetWriteBack(fs);
+  return fs;
+}
+
+
+
+// ============================================================================
+// Format a new BFS disk in the file 'path' by initializing the SuperBlock,
+// Inodes, Directory and free-space bitmap.  Takes a fixed number of writes,
+// whatever the size of the disk: free blocks are left as holes.  'features'
+// is any combination of FEAT* options, or 0.  Each keeps its table in a
+// single block, so FEATCSUM needs a disk of at most BYTESPERBLOCK / 4 - 1
+// blocks, and FEATDEDUP and FEATSHARE one of at most BYTESPERBLOCK / 5; on
+// a bigger one, fsFormat aborts with EBIGDISK.  With FSMEMORY in 'opts', the
+// disk is kept in memory instead, and 'path' may be NULL.  With FSTIERED,
+// the TIERBLOCKS most used blocks are kept in a RAM tier too (see tier.h),
+// and changes to them reach 'path' at fsClose and fsUnmount.  With
+// FSWRITEBACK, fsWrite returns once its blocks are buffered, and a flusher
+// thread writes them to 'path' (see wback.h); only fsSync, fsFsync,
+// fsFdatasync and fsUnmount wait for them.  With FSELEVATOR, requests that
+// reach 'path' at once, from any of these, are sent in DBN order, metadata
+// first, and merged (see elev.h).  With FSLOG, 'path' holds a log instead
+// (see lfs.h): every block written is appended to it, and small random
+// writes reach the host as whole segments, in sequence; the volume must
+// then be mounted with FSLOG too.  The new volume is left mounted.
+// On success, return its handle, for every other fs call and finally
+// fsUnmount.  On failure, abort
+// ============================================================================
+BFS* fsFormat(str path, i32 features, i32 opts) {
+  BFS* fs = bfsOpen(path, fsBackend(opts));
+  return fsFormatVolume(fs, features, opts);
+}
+
+
+
+// ============================================================================
+// Format a new BFS disk striped over the 'numPaths' member files in 'paths',
+// 'unit' blocks at a time, RAID-0 style (see stripe.h), as fsFormat does a
+// disk in one file.  A run of blocks that spans several members is read or
+// written on all of them at once, so large transfers get the bandwidth of
+// every device the members live on.  The layout is kept in the SuperBlock,
+// and the same members, in the same order, must be passed to
+// fsMountStriped.  'opts' is any of FSTIERED, FSWRITEBACK and FSELEVATOR,
+// as for fsFormat, or 0.  On success, return the new volume's handle.  On
+// failure, abort
+// ============================================================================
+BFS* fsFormatStriped(str* paths, i32 numPaths, i32 unit, i32 features,
+                     i32 opts) {
+  if (opts & ~(FSTIERED | FSWRITEBACK | FSELEVATOR)) FATAL(EBADFLAGS);
+  if (unit <= 0)                                     FATAL(EBADFLAGS);
+  BFS* fs = bfsOpen(NULL, BIOSTRIPE);
+  bioSetStripe(fs, paths, numPaths, unit);
+  return fsFormatVolume(fs, features, opts);
+}
+
+
+// ============================================================================
+// Make the file open on File Descriptor 'fd' durable: return once all of its
+// data, its Inode and the Dir, and the volume's free-space bitmap, RefTable
+// and checksum table, have reached the disk, past any write-back buffer or
+// RAM tier.  Other files' blocks are written only if they share a block
+// with these.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsFsync(BFS* fs, i32 fd) {
+  i32 inum = bfsFdToInum(fd);
+  bfsLock(fs);
+  bfsGetOFTE(fs, inum);                         // must be open
+  i32 ret = bfsSync(fs, inum, true);
+  bfsUnlock(fs);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Mount the BFS disk in the file 'path'.  It must already exist, and be a
+// BFS volume of this geometry (see bfsMountVolume).  All of its metadata is
+// read in one go: the checksum table, if it was formatted with FEATCSUM, so
+// every block read is verified, and the RefTable, if it shares blocks
+// (FEATDEDUP or FEATSHARE).  A volume that was not fsUnmount'ed is recovered
+// first.  With FSMEMORY in 'opts', the disk is loaded into memory, and
+// changes to it are lost at fsUnmount.  With FSTIERED, its hottest blocks
+// are kept in a RAM tier too, with FSWRITEBACK, writes are left to a
+// flusher thread, and with FSELEVATOR, requests are queued in DBN order, as
+// for fsFormat.  FSLOG mounts a log made by fsFormat with FSLOG, rolled
+// forward past its last checkpoint.  Each mount is independent of every
+// other: volumes share no state and no locks, so several may be driven from
+// different threads at once.  On success, return its handle.  On failure, abort
+// ============================================================================
+BFS* fsMount(str path, i32 opts) {
+  BFS* fs = bfsOpen(path, fsBackend(opts));
+  return fsMountVolume(fs, opts);
+}
+
+
+
+// ============================================================================
+// Mount the BFS disk striped over the 'numPaths' member files in 'paths', as
+// made by fsFormatStriped.  They must be all of its members, in the order
+// they were formatted in; if not, abort with EBADSTRIPE.  Otherwise, as
+// fsMount.  'opts' is any of FSTIERED, FSWRITEBACK and FSELEVATOR, or 0.
+// On success, return its handle.  On failure, abort
+// ============================================================================
+BFS* fsMountStriped(str* paths, i32 numPaths, i32 opts) {
+  if (opts & ~(FSTIERED | FSWRITEBACK | FSELEVATOR)) FATAL(EBADFLAGS);
+  BFS* fs = bfsOpen(NULL, BIOSTRIPE);
+  bioSetStripe(fs, paths, numPaths, 0);     // unit: from the members
+  return fsMountVolume(fs, opts);
 }
 
 
@@ -84,8 +560,12 @@ i32 fsMount() {
 // Open the existing file called 'fname'.  On success, return its file 
 // descriptor.  On failure, return EFNF
 // ============================================================================
-i32 fsOpen(str fname) {
-  i32 inum = bfsLookupFile(fname);        // lookup 'fname' in Directory
+i32 fsOpen(BFS* fs, str fname) {
+  STATSTART(start);
+  TRACEBEGIN(fs, STATFSOPEN);
+  i32 inum = bfsLookupFile(fs, fname);        // lookup 'fname' in Directory
+  TRACEEND(fs);
+  STATEND(fs, STATFSOPEN, start, 0);
   if (inum == EFNF) return EFNF;
   return bfsInumToFd(inum);
 }
@@ -93,84 +573,214 @@ i32 fsOpen(str fname) {
 
 
 // ============================================================================
-// Read 'numb' bytes of data from the cursor in the file currently fsOpen'd on
-// File Descriptor 'fd' into 'buf'.  On success, return actual number of bytes
-// read (may be less than 'numb' if we hit EOF).  On failure, abort
-// ============================================================================
-i32 fsRead(i32 fd, i32 numb, void* buf) {
-  i32 size = fsSize(fd); //get the size of the fd
-  i32 inum = bfsFdToInum(fd); //turns the fd to an inum
-  i32 ofte = bfsFindOFTE(inum); //find ofte
-  i32 cursor = fsTell(fd);  //gets the current cursor
-
-  i32 startingFBN = cursor / BYTESPERBLOCK; //Calculates the startingFBN block
-  i32 lastFBN = size / BYTESPERBLOCK;   //Calculates the lastFBN block
-  i32 lastRequiredByte = cursor + numb;   //Calculates the last byte we will be reading
-
-  //If the lastByte is bigger than file(out of bound), than set it to size
-  if(size < lastRequiredByte){
-    lastRequiredByte = size;
-    numb = size - cursor;
+// Read 'numb' bytes of data from byte 'offset' of file 'inum' into 'dst'.
+// The FBN->DBN map for the whole read is resolved once.  An unaligned head
+// and tail go through a 1-block buffer; the whole blocks in between are read
+// straight into 'dst', a run of consecutive DBNs at a time.  Holes read as
+// zeroes.  Return the number of bytes read (less than 'numb' at EOF)
+// ============================================================================
+static i32 fsReadAt(BFS* fs, i32 inum, i32 offset, i32 numb, i8* dst) {
+  Inode inode;
+  bfsReadInode(fs, inum, &inode);
+
+  //Stop at EOF
+  if (offset >= inode.size)            numb = 0;
+  else if (offset + numb > inode.size) numb = inode.size - offset;
+  if (numb == 0) return 0;
+
+  i32 end = offset + numb;
+
+  if (inode.flags & INODEINLINE) {
+    memcpy(dst, inode.data + offset, numb);
+    return numb;
   }
-  //If lastRequiredFBN is more than the fbn of file, than set it to the last fbn
-  i32 lastRequiredFBN = lastRequiredByte / BYTESPERBLOCK;
-  if(lastFBN < lastRequiredFBN){
-    lastRequiredFBN = lastFBN;
+
+  //A compressed file is read a whole chunk at a time
+  if (inode.flags & INODELZ) {
+    i8 chunk[CHUNKSIZE];
+    for (i32 pos = offset; pos < end; ) {
+      i32 coff = pos % CHUNKSIZE;
+      i32 len  = CHUNKSIZE - coff;
+      if (len > end - pos) len = end - pos;
+      bfsReadChunk(fs, &inode, pos / CHUNKSIZE, chunk);
+      memcpy(dst + (pos - offset), chunk + coff, len);
+      pos += len;
+    }
+    return numb;
   }
 
-  i32 cursorIndex = cursor - (startingFBN * BYTESPERBLOCK);
+  i32 firstFBN = offset / BYTESPERBLOCK;
+  i32 lastFBN  = (end - 1) / BYTESPERBLOCK;
+  i16 dbns[NUMDIRECT + I16SPERBLOCK];
+  bfsMapRange(fs, &inode, firstFBN, lastFBN - firstFBN + 1, dbns);
+
   i8 bufferBlock[BYTESPERBLOCK];
-  //If we are requesting to read only the last block, than read last block only
-  if(startingFBN == lastRequiredFBN){
-    int ret = bfsRead(inum, startingFBN, bufferBlock);
-    if(ret != 0) FATAL(ENYI);
-    memcpy(buf, bufferBlock + cursorIndex, numb);
-    fsSeek(fd, numb, SEEK_CUR);
+  i32 pos = offset;
+  while (pos < end) {
+    i32 boff = pos % BYTESPERBLOCK;
+    i32 i    = pos / BYTESPERBLOCK - firstFBN;
+
+    if (boff == 0 && end - pos >= BYTESPERBLOCK) {
+      //Whole blocks: read a run of consecutive DBNs, or a hole, in one go
+      i32 run = 1;
+      if (dbns[i] == 0) {
+        while (end - pos >= (run + 1) * BYTESPERBLOCK
+               && dbns[i + run] == 0) ++run;
+        memset(dst + (pos - offset), 0, run * BYTESPERBLOCK);
+      } else {
+        while (end - pos >= (run + 1) * BYTESPERBLOCK
+               && dbns[i + run] == dbns[i] + run) ++run;
+        bioReadRun(fs, dbns[i], run, dst + (pos - offset));
+      }
+      pos += run * BYTESPERBLOCK;
+      continue;
+    }
+
+    //Unaligned head, or tail: go through 'bufferBlock'
+    i32 len = BYTESPERBLOCK - boff;
+    if (len > end - pos) len = end - pos;
+
+    if (dbns[i] == 0) memset(bufferBlock, 0, BYTESPERBLOCK);
+    else              bioRead(fs, dbns[i], bufferBlock);
+    memcpy(dst + (pos - offset), bufferBlock + boff, len);
+    pos += len;
+  }
+
+  return numb;
+}
+
+
+// ============================================================================
+// Read 'numb' bytes of data from the cursor in the file currently fsOpen'd on
+// File Descriptor 'fd' into 'buf', and advance the cursor past them.  On
+// success, return actual number of bytes read (may be less than 'numb' if we
+// hit EOF).  On failure, abort
+// ============================================================================
+i32 fsRead(BFS* fs, i32 fd, i32 numb, void* buf) {
+  if (numb < 0)    FATAL(ENEGNUMB);
+  if (buf == NULL) FATAL(ENULLPTR);
+
+  STATSTART(start);
+  TRACEBEGIN(fs, STATFSREAD);
+  i32 inum = bfsFdToInum(fd);
+  bfsLock(fs);
+  i32 ofte = bfsFindOFTE(fs, inum);
+  i32 n    = fsReadAt(fs, inum, fs->oft[ofte].curs, numb, (i8*)buf);
+  fs->oft[ofte].curs += n;
+  bfsUnlock(fs);
+  TRACEEND(fs);
+  STATEND(fs, STATFSREAD, start, n);
+  return n;
+}
+
+
+// ============================================================================
+// Return, in 'view', a read-only View of 'numb' bytes of the file open on
+// File Descriptor 'fd', starting at byte 'offset'.  Nothing is copied: each
+// span points straight into the mapped BFS disk, and consecutive DBNs are
+// merged into a single span.  Holes read as zeroes.  The cursor is not moved.
+// The View stays valid until passed to fsReleaseView.  On success, return
+// the number of bytes in the View (less than 'numb' if it hits EOF).  For a
+// compressed file, return ENOVIEW; use fsRead instead.  On failure, abort
+// ============================================================================
+i32 fsReadView(BFS* fs, i32 fd, i32 offset, i32 numb, View* view) {
+  static const i8 zeroBlock[BYTESPERBLOCK] = {0};
+
+  if (view == NULL) FATAL(ENULLPTR);
+  if (offset < 0)   FATAL(EBADCURS);
+  if (numb < 0)     FATAL(ENEGNUMB);
+
+  i32 inum = bfsFdToInum(fd);
+  bfsLock(fs);                                // the mapping, and its refs
+  Inode inode;
+  bfsReadInode(fs, inum, &inode);
+
+  if (inode.flags & INODELZ) {                //no plain bytes to point at
+    bfsUnlock(fs);
+    return ENOVIEW;
+  }
+
+  if (offset >= inode.size) numb = 0;
+  else if (offset + numb > inode.size) numb = inode.size - offset;
+
+  i8* base;
+  bioMap(fs, &base);
+
+  view->numb     = numb;
+  view->numSpans = 0;
+  view->spans    = NULL;
+  if (numb == 0) {
+    bfsUnlock(fs);
+    return 0;
+  }
+
+  if (inode.flags & INODEINLINE) {
+    view->spans = malloc(sizeof(struct iovec));
+    if (view->spans == NULL) FATAL(ENOMEM);
+    bioCsumCheck(fs, DBNINODES, base + DBNINODES * BYTESPERBLOCK);
+    view->spans[0].iov_base = base + DBNINODES * BYTESPERBLOCK
+      + inum * INODESIZE + offsetof(Inode, data) + offset;
+    view->spans[0].iov_len  = numb;
+    view->numSpans = 1;
+    bfsUnlock(fs);
     return numb;
   }
 
-  i32 currentOffset = 0;
-  i32 bufferBlockOffset = 0;
-  i32 sizeOfCopy = BYTESPERBLOCK;
-  i32 fbn = startingFBN;
-  //Go through each fbn to read
-  while(fbn <= lastRequiredFBN){
-    int ret = bfsRead(inum, fbn, bufferBlock);
-    if(ret != 0) FATAL(EBADREAD);
-
-    //If its the first block
-    if(fbn == startingFBN){
-      bufferBlockOffset = cursorIndex;
-      sizeOfCopy = BYTESPERBLOCK - cursorIndex;
-    }
+  i32 firstFBN = offset / BYTESPERBLOCK;
+  i32 lastFBN  = (offset + numb - 1) / BYTESPERBLOCK;
+  i32 count    = lastFBN - firstFBN + 1;
 
-    //If its the last block
-    if(fbn == lastRequiredFBN){
-      //Calculates the last few bytes that is in the last block to be read
-      sizeOfCopy = (numb - (BYTESPERBLOCK - cursorIndex)) % BYTESPERBLOCK;
-      //Of the sizeOfCopy is somehow 0, we subtract a FBN from the variable
-      if(sizeOfCopy == 0) lastRequiredFBN--;
-    }
+  i16* dbns = malloc(count * sizeof(i16));
+  view->spans = malloc(count * sizeof(struct iovec));
+  if (dbns == NULL || view->spans == NULL) FATAL(ENOMEM);
+
+  bfsMapRange(fs, &inode, firstFBN, count, dbns);
+
+  i32 done = 0;
+  for (i32 i = 0; i < count; ++i) {
+    i32 boff = (i == 0) ? offset % BYTESPERBLOCK : 0;
+    i32 len  = BYTESPERBLOCK - boff;
+    if (len > numb - done) len = numb - done;
 
-    //Copies data into buf + currentOffset
-    memcpy(buf + currentOffset, bufferBlock + bufferBlockOffset, sizeOfCopy);
-    //If it is the first block, than add sizeOfCopy to currentOffset
-    if(fbn == startingFBN){
-      currentOffset += sizeOfCopy;
+    i8* p = (dbns[i] == 0) ? (i8*)zeroBlock
+                           : base + dbns[i] * BYTESPERBLOCK + boff;
+    if (dbns[i] != 0) bioCsumCheck(fs, dbns[i], base + dbns[i] * BYTESPERBLOCK);
+
+    if (i > 0 && dbns[i] != 0 && dbns[i] == dbns[i - 1] + 1) {
+      view->spans[view->numSpans - 1].iov_len += len;   // contiguous DBNs
     } else {
-      //Otherwise we add 512 to currentOffset
-      currentOffset += BYTESPERBLOCK;
+      view->spans[view->numSpans].iov_base = p;
+      view->spans[view->numSpans].iov_len  = len;
+      ++view->numSpans;
     }
-    bufferBlockOffset = 0;
-    sizeOfCopy = BYTESPERBLOCK;
-    fbn++;  //increment fbn
+    done += len;
   }
 
-  fsSeek(fd, numb, SEEK_CUR);
+  free(dbns);
+  bfsUnlock(fs);
   return numb;
 }
 
 
+
+// ============================================================================
+// Release a View returned by fsReadView.  Its spans must not be used after
+// this.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsReleaseView(BFS* fs, View* view) {
+  if (view == NULL) FATAL(ENULLPTR);
+  free(view->spans);
+  view->numb     = 0;
+  view->numSpans = 0;
+  view->spans    = NULL;
+  bfsLock(fs);
+  bioUnmap(fs);
+  bfsUnlock(fs);
+  return 0;
+}
+
+
+
 // ============================================================================
 // Move the cursor for the file currently open on File Descriptor 'fd' to the
 // byte-offset 'offset'.  'whence' can be any of:
@@ -181,23 +791,23 @@ i32 fsRead(i32 fd, i32 numb, void* buf) {
 //
 // On success, return 0.  On failure, abort
 // ============================================================================
-i32 fsSeek(i32 fd, i32 offset, i32 whence) {
+i32 fsSeek(BFS* fs, i32 fd, i32 offset, i32 whence) {
 
   if (offset < 0) FATAL(EBADCURS);
  
   i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
+  i32 ofte = bfsFindOFTE(fs, inum);
   
   switch(whence) {
     case SEEK_SET:
-      g_oft[ofte].curs = offset;
+      fs->oft[ofte].curs = offset;
       break;
     case SEEK_CUR:
-      g_oft[ofte].curs += offset;
+      fs->oft[ofte].curs += offset;
       break;
     case SEEK_END: {
-        i32 end = fsSize(fd);
-        g_oft[ofte].curs = end + offset;
+        i32 end = fsSize(fs, fd);
+        fs->oft[ofte].curs = end + offset;
         break;
       }
     default:
@@ -208,11 +818,54 @@ i32 fsSeek(i32 fd, i32 offset, i32 whence) {
 
 
 
+// ============================================================================
+// Copy the I/O counters and latency histograms of every layer into 'stats'
+// (see stats.h), unless it is NULL.  With FSSTATSRESET in 'flags', zero them
+// as they are read, to start a new interval.  Built with BFSSTATS 0, 'stats'
+// just comes back all zeroes.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsStats(BFS* fs, Stats* stats, i32 flags) {
+  if (flags & ~FSSTATSRESET) FATAL(EBADFLAGS);
+  statsSnap(fs, stats, (flags & FSSTATSRESET) != 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make the whole volume durable: write back the free-space bitmap and the
+// tables, and return once every block written so far has reached the disk,
+// past any write-back buffer or RAM tier.  The volume stays mounted, and is
+// still recovered at the next fsMount if it is not unmounted.  On success,
+// return 0.  On failure, abort
+// ============================================================================
+i32 fsSync(BFS* fs) {
+  bfsLock(fs);
+  i32 ret = bfsSync(fs, -1, true);
+  bfsUnlock(fs);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Record every block request from now on into trace file 'path' (see
+// trace.h), a ring that keeps the last 'capacity' of them, for
+// tools/bfsreplay.  With 'path' NULL, stop recording and close the file.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsTrace(BFS* fs, str path, i32 capacity) {
+  if (path == NULL) return traceStop(&fs->trace);
+  return traceStart(&fs->trace, path, capacity);
+}
+
+
+
 // ============================================================================
 // Return the cursor position for the file open on File Descriptor 'fd'
 // ============================================================================
-i32 fsTell(i32 fd) {
-  return bfsTell(fd);
+i32 fsTell(BFS* fs, i32 fd) {
+  return bfsTell(fs, fd);
 }
 
 
@@ -222,81 +875,253 @@ i32 fsTell(i32 fd) {
 // written to the file, or the highest offset set with the fsSeek function.  On
 // success, return the file size.  On failure, abort
 // ============================================================================
-i32 fsSize(i32 fd) {
+i32 fsSize(BFS* fs, i32 fd) {
   i32 inum = bfsFdToInum(fd);
-  return bfsGetSize(inum);
+  return bfsGetSize(fs, inum);
 }
 
 
+
+
 // ============================================================================
-// Write 'numb' bytes of data from 'buf' into the file currently fsOpen'd on
-// filedescriptor 'fd'.  The write starts at the current file offset for the
-// destination file.  On success, return 0.  On failure, abort
-// ============================================================================
-i32 fsWrite(i32 fd, i32 numb, void* buf) {
-  i32 size = fsSize(fd); //get the size of the fd
-  i32 inum = bfsFdToInum(fd); //turns the fd to an inum
-  i32 ofte = bfsFindOFTE(inum); //find ofte
-  i32 cursor = fsTell(fd);  //gets the current cursor
-
-  i32 currentFBN = cursor / BYTESPERBLOCK;  //Gets the currentFBN block
-  i32 lastFBN = size / BYTESPERBLOCK;   //Gets the last FBN block
-
-  i32 bytesWritten = 0;   //Holds the number of bytes we have already written
-  i32 trailBytes = 0;     //Holds the number of bytes available for a block to be written
-  i32 bytesToWrite = 0;   //Holds the number of bytes we need to write
-  i32 cursorBlockIndex = 0;   //Holds the index of the cursor's block
-  i32 copyNumb = numb;    //Holds numb, this variable will be modified later
-
-  i8 temporaryBuffer[BYTESPERBLOCK];  //Will hold the current disk's data
-  i8 numberBytesToWrite[BYTESPERBLOCK]; //Will hold the buf's data
-
-  //If we need to write more than there is space in the existing file, extend the file
-    if(cursor + numb > size){
-      i32 totalSize = cursor + numb;
-      i32 addingBlocks = (totalSize / BYTESPERBLOCK) + 1;
-      bfsExtend(inum, addingBlocks);
-      bfsSetSize(inum, totalSize);
+// Set the size of the file open on File Descriptor 'fd' to 'size' bytes.  A
+// file that grows reads as zeroes past its old EOF.  A file that shrinks has
+// the tail of its new last block zeroed, and every block past that, including
+// any reserved with fsFallocate, is handed to the reclaimer.  The cursor does
+// not move.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsTruncate(BFS* fs, i32 fd, i32 size) {
+  if (size < 0) FATAL(EBADCURS);
+  if (size > (NUMDIRECT + I16SPERBLOCK) * BYTESPERBLOCK) FATAL(EBIGNUMB);
+
+  i32 inum = bfsFdToInum(fd);
+  bfsLock(fs);
+  bfsGetOFTE(fs, inum);                         // must be open
+  Inode inode;
+  bfsReadInode(fs, inum, &inode);
+
+  if (inode.flags & INODEINLINE) {
+    if (size < inode.size) {
+      memset(inode.data + size, 0, INLINESIZE - size);
+    } else if (size > INLINESIZE) {         // outgrows the Inode
+      bfsUninline(fs, inum);
+      bfsReadInode(fs, inum, &inode);
+    }
+  } else if (inode.flags & INODELZ) {
+    i32 coff = size % CHUNKSIZE;
+    if (size < inode.size && coff != 0) {
+      i8 chunk[CHUNKSIZE];
+      bfsReadChunk(fs, &inode, size / CHUNKSIZE, chunk);
+      memset(chunk + coff, 0, CHUNKSIZE - coff);
+      bfsWriteChunk(fs, &inode, size / CHUNKSIZE, chunk);
     }
+    i32 keep = (size + CHUNKSIZE - 1) / CHUNKSIZE * CHUNKBLOCKS;
+    bfsReleaseFrom(fs, &inode, keep);
+  } else {
+    i32 boff = size % BYTESPERBLOCK;
+    if (size < inode.size && boff != 0) {
+      fsZeroPart(fs, &inode, size / BYTESPERBLOCK, boff, BYTESPERBLOCK - boff);
+    }
+    bfsReleaseFrom(fs, &inode, (size + BYTESPERBLOCK - 1) / BYTESPERBLOCK);
+  }
+
+  inode.size = size;
+  bfsWriteInode(fs, inum, &inode);
+  bfsUnlock(fs);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Unmount volume 'fs': let the reclaimer finish, write back everything still
+// held in memory, and mark the volume clean, so that the next fsMount need
+// not recover it.  Blocks buffered are written back before the tables, so
+// the volume is not marked clean over blocks still in flight.  Then free the
+// handle, which must not be used again.  No other fs call may be made on the
+// volume meanwhile.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsUnmount(BFS* fs) {
+  bfsReclaimWait(fs);
+  bfsLock(fs);
+  bioSync(fs, NULL);
+  i32 ret = bfsUnmountVolume(fs);
+  bfsUnlock(fs);
+  bfsClose(fs);
+  return ret;
+}
+
+
+
+// ============================================================================
+// Wait until the blocks of every file deleted or truncated so far are free
+// again.  On success, return 0
+// ============================================================================
+i32 fsWaitReclaim(BFS* fs) {
+  bfsReclaimWait(fs);
+  return 0;
+}
+
+
+// ============================================================================
+// Write 'numb' bytes of data from 'src' into file 'inum', starting at byte
+// 'offset'.  Files no bigger than INLINESIZE are written into their Inode.
+// Otherwise, the FBN->DBN map for the whole write is resolved once, with any
+// missing blocks allocated together, block-aligned runs of whole blocks go
+// straight from 'src' to disk, and only a partial head or tail block is read
+// and merged.  Return the number of bytes written
+// ============================================================================
+static i32 fsWriteAt(BFS* fs, i32 inum, i32 offset, i32 numb, i8* src) {
+  i32 end = offset + numb;
+
+  if (numb == 0) return 0;
 
-  //We write one block at a time to the disk
-  //If the number of bytes we still need to write is 0, than we have finish writing everything, leave while loop
-  while(copyNumb != 0){
-    cursorBlockIndex = cursor - (currentFBN * BYTESPERBLOCK); //keep track of the cursor index
-    trailBytes = BYTESPERBLOCK - cursorBlockIndex;  //keep tracks of number of bytes left in block available to write
-    //Determines what bytesToWrite variable is set to
-    if(trailBytes > copyNumb){  //Goes into this if statement if there is less bytes to write than there is space
-      bytesToWrite = copyNumb;
+  //A small file keeps its data inside the Inode for as long as it fits there
+  Inode inode;
+  bfsReadInode(fs, inum, &inode);
+  if (inode.flags & INODEINLINE) {
+    if (end <= INLINESIZE) {
+      memcpy(inode.data + offset, src, numb);
+      if (end > inode.size) inode.size = end;
+      bfsWriteInode(fs, inum, &inode);
+      return numb;
     }
-    else{   //Goes into this if there is more bytes to be written than there is space in this block
-      bytesToWrite = trailBytes;
+    //Outgrown the Inode, so move the data out to FBN 0 and carry on below
+    bfsUninline(fs, inum);
+    bfsReadInode(fs, inum, &inode);
+  }
+
+  i32 size     = inode.size;
+
+  //A compressed file is rewritten a whole chunk at a time.  Chunks between
+  //the old EOF and the offset are left as holes
+  if (inode.flags & INODELZ) {
+    if ((end - 1) / CHUNKSIZE >= NUMCHUNKS) FATAL(EBIGNUMB);
+    i8 chunk[CHUNKSIZE];
+    for (i32 pos = offset; pos < end; ) {
+      i32 coff = pos % CHUNKSIZE;
+      i32 len  = CHUNKSIZE - coff;
+      if (len > end - pos) len = end - pos;
+
+      if (len == CHUNKSIZE) {
+        bfsWriteChunk(fs, &inode, pos / CHUNKSIZE, src + (pos - offset));
+      } else {
+        if (pos - coff < size) bfsReadChunk(fs, &inode, pos / CHUNKSIZE, chunk);
+        else                   memset(chunk, 0, CHUNKSIZE);
+        memcpy(chunk + coff, src + (pos - offset), len);
+        bfsWriteChunk(fs, &inode, pos / CHUNKSIZE, chunk);
+      }
+      pos += len;
+    }
+    if (end > size) inode.size = end;
+    bfsWriteInode(fs, inum, &inode);
+    return numb;
+  }
+
+  i32 firstFBN = offset / BYTESPERBLOCK;
+  i32 lastFBN  = (end - 1) / BYTESPERBLOCK;
+  i32 eofFBN   = (size + BYTESPERBLOCK - 1) / BYTESPERBLOCK;  //1st FBN past EOF
+
+  if (lastFBN >= NUMDIRECT + I16SPERBLOCK) FATAL(EBIGNUMB);
+
+  //Map every FBN we touch, plus any gap between the old EOF and the offset.
+  //Allocate whatever is not yet mapped, unless the volume shares blocks: then
+  //bfsWriteShared picks each DBN as the block is written
+  i32 mapFBN = (eofFBN < firstFBN) ? eofFBN : firstFBN;
+  i32 count  = lastFBN - mapFBN + 1;
+  i16 dbns[NUMDIRECT + I16SPERBLOCK];
+  bfsMapRange(fs, &inode, mapFBN, count, dbns);
+
+  bool shared = bfsHasRefs(fs);
+  bool remap  = false;
+  bool mapped[NUMDIRECT + I16SPERBLOCK];    // held data before this write
+  for (i32 i = 0; i < count; ++i) mapped[i] = (dbns[i] != 0);
+  if (!shared) {
+    i16 fresh[NUMDIRECT + I16SPERBLOCK];
+    i32 numFresh = 0;
+    for (i32 i = 0; i < count; ++i) if (dbns[i] == 0) ++numFresh;
+    bfsAllocRun(fs, numFresh, fresh);
+    for (i32 i = 0, f = 0; i < count; ++i) {
+      if (dbns[i] == 0) dbns[i] = fresh[f++];
+    }
+    remap = numFresh > 0;
+  }
+
+  i8 block[BYTESPERBLOCK];
+
+  //Blocks in the gap between the old EOF and the offset read as zeroes
+  for (i32 fbn = mapFBN; fbn < firstFBN; ++fbn) {
+    memset(block, 0, BYTESPERBLOCK);
+    if (shared) remap |= bfsWriteShared(fs, &dbns[fbn - mapFBN], block, true);
+    else        bioWrite(fs, dbns[fbn - mapFBN], block);
+  }
+
+  i32 pos = offset;
+  while (pos < end) {
+    i32 fbn  = pos / BYTESPERBLOCK;
+    i32 boff = pos % BYTESPERBLOCK;
+    i32 i    = fbn - mapFBN;
+
+    if (boff == 0 && end - pos >= BYTESPERBLOCK) {
+      if (shared) {
+        remap |= bfsWriteShared(fs, &dbns[i], src + (pos - offset), true);
+        pos += BYTESPERBLOCK;
+        continue;
+      }
+      //Whole blocks: write the longest run of contiguous DBNs straight from
+      //the caller's buffer, with no read beforehand
+      i32 run = 1;
+      while (end - pos >= (run + 1) * BYTESPERBLOCK
+             && dbns[i + run] == dbns[i] + run) ++run;
+      bioWriteRun(fs, dbns[i], run, src + (pos - offset));
+      pos += run * BYTESPERBLOCK;
+      continue;
     }
 
-    //Resets numberBytesToWrite to all null
-    memset(numberBytesToWrite, 0, sizeof(numberBytesToWrite));
-    //Reads current block into buffer
-    bfsRead(inum, currentFBN, temporaryBuffer);
-    //Copy the bytes to be written from buf into numberBytesToWrite
-    memcpy(numberBytesToWrite, (buf + bytesWritten), bytesToWrite);
-    //Copy the bytes to be written into another char buffer but add the cursorIndex
-    memcpy((temporaryBuffer + cursorBlockIndex), numberBytesToWrite, bytesToWrite);
-    //Moves the cursor a number of bytes forward
-    fsSeek(fd, bytesToWrite, SEEK_CUR);
-    cursor = fsTell(fd);
-
-    //Subtract the number of bytes we just wrote from numb
-    copyNumb = copyNumb - bytesToWrite;
-    //Add the number of bytes we just wrote to bytesWritten
-    bytesWritten = bytesWritten + bytesToWrite;
-
-    //Find the currentDBN on disk and write the temporaryBuffer into the actual block on disk
-    int currentDBN = bfsFbnToDbn(inum, currentFBN);
-    bioWrite(currentDBN, temporaryBuffer);
-
-    //Increment to the next fbn
-    currentFBN++;
+    //Partial head or tail block: merge with what is already there.  A block
+    //lying wholly beyond the old EOF, or just allocated to fill a hole,
+    //holds nothing worth reading
+    i32 len = BYTESPERBLOCK - boff;
+    if (len > end - pos) len = end - pos;
+
+    if (fbn < eofFBN && mapped[i]) bioRead(fs, dbns[i], block);
+    else                            memset(block, 0, BYTESPERBLOCK);
+    memcpy(block + boff, src + (pos - offset), len);
+    if (shared) remap |= bfsWriteShared(fs, &dbns[i], block, false);
+    else        bioWrite(fs, dbns[i], block);
+    pos += len;
   }
 
-  //FATAL(ENYI);                                  // Not Yet Implemented!
-  return bytesWritten;
+  if (remap) bfsSetMapRange(fs, &inode, mapFBN, count, dbns);
+  if (remap || end > size) {
+    if (end > size) inode.size = end;
+    bfsWriteInode(fs, inum, &inode);
+  }
+
+  return numb;
+}
+
+
+
+// ============================================================================
+// Write 'numb' bytes of data from 'buf' into the file currently fsOpen'd on
+// filedescriptor 'fd'.  The write starts at the current file offset for the
+// destination file, and advances it.  On success, return the number of bytes
+// written.  On failure, abort
+// ============================================================================
+i32 fsWrite(BFS* fs, i32 fd, i32 numb, void* buf) {
+  if (numb < 0)    FATAL(ENEGNUMB);
+  if (buf == NULL) FATAL(ENULLPTR);
+
+  STATSTART(start);
+  TRACEBEGIN(fs, STATFSWRITE);
+  i32 inum = bfsFdToInum(fd);
+  bfsLock(fs);
+  i32 ofte = bfsFindOFTE(fs, inum);
+  i32 n    = fsWriteAt(fs, inum, fs->oft[ofte].curs, numb, (i8*)buf);
+  fs->oft[ofte].curs += n;
+  bfsUnlock(fs);
+  TRACEEND(fs);
+  STATEND(fs, STATFSWRITE, start, n);
+  return n;
 }
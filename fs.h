@@ -6,18 +6,77 @@
 // ===================================================================
 
 #include <stdio.h>
+#include <sys/uio.h>
 #include "alias.h"
 #include "errors.h"
+#include "stats.h"
 
-i32 fsClose (i32 fd);
-i32 fsCreate(str name);
-i32 fsFormat();
-i32 fsMount();
-i32 fsOpen  (str fname);
-i32 fsRead  (i32 fd, i32 numb,   void* buf);
-i32 fsSeek  (i32 fd, i32 offset, i32   whence);
-i32 fsSize  (i32 fd);
-i32 fsTell  (i32 fd);
-i32 fsWrite (i32 fd, i32 numb,   void* buf);
+#define FEATCSUM   0x0001  // fsFormat: keep a CRC32C for every block
+#define FEATDEDUP  0x0002  // fsFormat: store identical data blocks once
+#define FEATSHARE  0x0004  // fsFormat: let fsClone share blocks (reflink)
+
+#define FSMEMORY   0x0001  // fsFormat, fsMount: keep the volume in memory
+#define FSTIERED   0x0002  // fsFormat, fsMount: keep hot blocks in a RAM tier
+#define FSWRITEBACK 0x0004 // fsFormat, fsMount: write blocks in the background
+#define FSELEVATOR 0x0008  // fsFormat, fsMount: queue requests in DBN order
+#define FSLOG      0x0010  // fsFormat, fsMount: append every block to a log
+
+#define FSCOMPRESS 0x0001  // fsCreateOpts: store file as compressed chunks
+
+#define FSKEEPSIZE  0x0001 // fsFallocate: reserve, but leave the size alone
+#define FSPUNCHHOLE 0x0002 // fsFallocate: free the range, so it reads zeroes
+#define FSZERORANGE 0x0004 // fsFallocate: zero the range with fresh blocks
+
+#define FSCKREPAIR  0x0001 // fsCheck: fix what is found, not just report it
+
+#define FSSTATSRESET 0x0001 // fsStats: zero the counters once read
+
+typedef struct {          // View: read-only, zero-copy window onto a file
+  i32 numb;               // # of bytes covered by the View
+  i32 numSpans;           // # of entries in 'spans'
+  struct iovec* spans;    // pointers into the mapped BFS disk, in file order
+} View;
+
+typedef struct {          // FsckReport: what fsCheck found
+  i32 numFiles;           // # files checked
+  i32 numOwned;           // # data blocks mapped by some file
+  i32 numLeaked;          // # blocks marked in use that nothing maps
+  i32 numLost;            // # blocks mapped, or metadata, but marked free
+  i32 numDoubled;         // # blocks mapped twice, on a volume not sharing
+  i32 numBadRefs;         // # RefTable counts that disagree with the maps
+  i32 numBadDbns;         // # block pointers outside the data blocks
+  i32 numRepaired;        // # fixes made, with FSCKREPAIR
+} FsckReport;
+
+i32 fsCheck (BFS* fs, i32 flags, FsckReport* report);
+i32 fsClone (BFS* fs, i32 srcFd, str dstName);
+i32 fsClose (BFS* fs, i32 fd);
+i32 fsCopyRange(BFS* fs, i32 srcFd, i32 srcOff, i32 dstFd, i32 dstOff,
+                i32 len);
+i32 fsCreate(BFS* fs, str name);
+i32 fsCreateOpts(BFS* fs, str name, i32 opts);
+i32 fsDelete(BFS* fs, str fname);
+i32 fsFallocate(BFS* fs, i32 fd, i32 offset, i32 len, i32 flags);
+i32 fsFdatasync(BFS* fs, i32 fd);
+BFS* fsFormat(str path, i32 features, i32 opts);
+BFS* fsFormatStriped(str* paths, i32 numPaths, i32 unit, i32 features,
+                     i32 opts);
+i32 fsFsync (BFS* fs, i32 fd);
+BFS* fsMount(str path, i32 opts);
+BFS* fsMountStriped(str* paths, i32 numPaths, i32 opts);
+i32 fsOpen  (BFS* fs, str fname);
+i32 fsRead  (BFS* fs, i32 fd, i32 numb,   void* buf);
+i32 fsReadView(BFS* fs, i32 fd, i32 offset, i32 numb, View* view);
+i32 fsReleaseView(BFS* fs, View* view);
+i32 fsSeek  (BFS* fs, i32 fd, i32 offset, i32   whence);
+i32 fsSize  (BFS* fs, i32 fd);
+i32 fsStats (BFS* fs, Stats* stats, i32 flags);
+i32 fsSync  (BFS* fs);
+i32 fsTell  (BFS* fs, i32 fd);
+i32 fsTrace (BFS* fs, str path, i32 capacity);
+i32 fsTruncate(BFS* fs, i32 fd, i32 size);
+i32 fsUnmount(BFS* fs);
+i32 fsWaitReclaim(BFS* fs);
+i32 fsWrite (BFS* fs, i32 fd, i32 numb,   void* buf);
 
 #endif
\ No newline at end of file
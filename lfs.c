@@ -0,0 +1,519 @@
+// ============================================================================
+// lfs.c - log-structured block backend for bio (see lfs.h).  Everything is
+// done under the log lock, I/O included, so the head segment, the block map
+// and the counts always change together.  The cleaner holds it for one
+// victim segment at a time.  A block already in the head, and not yet
+// written to fs->path, is simply overwritten there; once written, its next
+// copy is appended, so a segment never changes on disk once a checkpoint,
+// or roll forward, could point into it
+// ============================================================================
+
+#include <time.h>
+
+#include "bfs.h"
+#include "crc.h"
+#include "lfs.h"
+#include "stats.h"
+
+#define LFSSEG(at)    ((at) / LFSSEGBLOCKS)   // segment of a block map entry
+#define LFSSLOT(at)   ((at) % LFSSEGBLOCKS)   // and its slot in it
+
+
+
+// ============================================================================
+// Return a monotonic timestamp, in nanoseconds
+// ============================================================================
+static u64 lfsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from block 'blk' of fs->path, to or
+// from 'buf'.  On failure, abort
+// ============================================================================
+static void lfsXfer(Lfs* lf, bool write, i32 blk, i32 numBlocks, void* buf) {
+  if (fseek(lf->fp, (long)blk * BYTESPERBLOCK, SEEK_SET) != 0) {
+    FATAL(write ? EBADWRITE : EBADREAD);
+  }
+  size_t num = (size_t)numBlocks;
+  if (write) {
+    if (fwrite(buf, BYTESPERBLOCK, num, lf->fp) != num) FATAL(EBADWRITE);
+    if (fflush(lf->fp) != 0)                            FATAL(EBADWRITE);
+  } else if (fread(buf, BYTESPERBLOCK, num, lf->fp) != num) {
+    FATAL(EBADREAD);
+  }
+}
+
+
+
+// ============================================================================
+// Return the block of fs->path where segment 's' starts, with its summary
+// ============================================================================
+static i32 lfsSegBlock(i32 s) { return LFSCKPTS + s * LFSSEGBLOCKS; }
+
+
+
+// ============================================================================
+// Return whether segment 's' may be reused: it is not the head, neither the
+// block map nor the last checkpoint points into it, and it was not begun
+// since then, so roll forward from that checkpoint does not pass through it
+// ============================================================================
+static bool lfsIsFree(Lfs* lf, i32 s) {
+  return s != lf->head && lf->live[s] == 0 && lf->kept[s] == 0
+      && !(lf->fresh & (1u << s));
+}
+
+
+
+// ============================================================================
+// Return the number of segments that may be reused
+// ============================================================================
+static i32 lfsNumFree(Lfs* lf) {
+  i32 num = 0;
+  for (i32 s = 0; s < LFSSEGS; ++s) num += lfsIsFree(lf, s);
+  return num;
+}
+
+
+
+// ============================================================================
+// Write the head segment's summary and data blocks to fs->path, in one
+// sequential request, if any of them have not been yet
+// ============================================================================
+static void lfsWriteHead(Lfs* lf) {
+  LfsSummary* sum = (LfsSummary*)lf->seg;
+  if (sum->count == lf->flushed) return;
+
+  lfsXfer(lf, true, lfsSegBlock(lf->head), 1 + sum->count, lf->seg);
+  STATADD(lf->fs, lfsSegWrites, 1);
+  STATADD(lf->fs, lfsSegBlocks, sum->count - lf->flushed);
+  lf->flushed = sum->count;
+  lf->since   = 0;
+}
+
+
+
+// ============================================================================
+// Make free segment 's' the head, empty, with the next sequence number
+// ============================================================================
+static void lfsBegin(Lfs* lf, i32 s) {
+  memset(lf->seg, 0, BYTESPERBLOCK);
+  LfsSummary* sum = (LfsSummary*)lf->seg;
+  sum->magic  = LFSMAGIC;
+  sum->seq    = ++lf->seq;
+  lf->head    = s;
+  lf->fresh  |= 1u << s;
+  lf->flushed = 0;
+}
+
+
+
+// ============================================================================
+// Write out the full head segment, and begin the next free one after it.
+// If there is none, abort with EDISKFULL: the cleaner, and LFSRESERVE, keep
+// that from happening
+// ============================================================================
+static void lfsAdvance(Lfs* lf) {
+  lfsWriteHead(lf);
+  for (i32 i = 1; i <= LFSSEGS; ++i) {
+    i32 s = (lf->head + i) % LFSSEGS;
+    if (lfsIsFree(lf, s)) {
+      lfsBegin(lf, s);
+      return;
+    }
+  }
+  FATAL(EDISKFULL);
+}
+
+
+
+// ============================================================================
+// Make the block in 'buf' the latest copy of DBN 'dbn'.  If the current
+// copy is in the head, and not yet written out, it is overwritten there;
+// otherwise the block is appended, beginning a new head if this one is full
+// ============================================================================
+static void lfsAppend(Lfs* lf, i32 dbn, i8* buf) {
+  LfsSummary* sum = (LfsSummary*)lf->seg;     // stays put across lfsAdvance
+  u16 at = lf->map[dbn];
+  i32 slot;
+
+  if (at != LFSNONE && LFSSEG(at) == lf->head && LFSSLOT(at) > lf->flushed) {
+    slot = LFSSLOT(at);
+  } else {
+    if (sum->count == LFSSLOTS) lfsAdvance(lf);
+    slot = ++sum->count;
+    sum->dbn[slot - 1] = dbn;
+    if (at != LFSNONE) --lf->live[LFSSEG(at)];
+    ++lf->live[lf->head];
+    lf->map[dbn] = lf->head * LFSSEGBLOCKS + slot;
+  }
+
+  memcpy(lf->seg + slot * BYTESPERBLOCK, buf, BYTESPERBLOCK);
+  sum->crc[slot - 1] = crcCompute(buf, BYTESPERBLOCK);
+  if (lf->since == 0) lf->since = lfsNow();
+}
+
+
+
+// ============================================================================
+// Write out the head segment, then a checkpoint of the block map, into the
+// LfsCkpt block not used last time, so a torn one leaves the other intact.
+// Segments only the old checkpoint pointed into are now free
+// ============================================================================
+static void lfsCheckpoint(Lfs* lf) {
+  lfsWriteHead(lf);
+
+  i8 block[BYTESPERBLOCK] = {0};
+  LfsCkpt* ck = (LfsCkpt*)block;
+  ck->magic   = LFSMAGIC;
+  ck->seq     = ++lf->ckptSeq;
+  ck->headSeq = lf->seq;
+  ck->head    = lf->head;
+  ck->count   = lf->flushed;
+  memcpy(ck->map, lf->map, BLOCKSPERDISK * sizeof(u16));
+  ck->crc     = crcCompute(block, BYTESPERBLOCK);
+  lfsXfer(lf, true, ck->seq % LFSCKPTS, 1, block);
+
+  memcpy(lf->kept, lf->live, sizeof(lf->kept));
+  lf->fresh = 1u << lf->head;
+  STATADD(lf->fs, lfsCheckpoints, 1);
+  pthread_cond_broadcast(&lf->room);
+}
+
+
+
+// ============================================================================
+// Return the segment the cleaner should empty next: of those in use, but for
+// the head, the one with the fewest live blocks.  -1 => none would gain
+// ============================================================================
+static i32 lfsVictim(Lfs* lf) {
+  i32 victim = -1;
+  for (i32 s = 0; s < LFSSEGS; ++s) {
+    if (s == lf->head || lfsIsFree(lf, s) || lf->live[s] >= LFSSLOTS) continue;
+    if (victim < 0 || lf->live[s] < lf->live[victim]) victim = s;
+  }
+  return victim;
+}
+
+
+
+// ============================================================================
+// Empty segment 'victim': read it whole into 'buf', a segment long, and
+// append those of its blocks the block map still points to
+// ============================================================================
+static void lfsClean(Lfs* lf, i32 victim, i8* buf) {
+  lfsXfer(lf, false, lfsSegBlock(victim), LFSSEGBLOCKS, buf);
+  LfsSummary* sum = (LfsSummary*)buf;
+
+  for (i32 slot = 1; slot <= sum->count && slot <= LFSSLOTS; ++slot) {
+    i32 dbn = sum->dbn[slot - 1];
+    if (dbn < 0 || dbn >= BLOCKSPERDISK) continue;
+    if (lf->map[dbn] != victim * LFSSEGBLOCKS + slot) continue;
+    lfsAppend(lf, dbn, buf + slot * BYTESPERBLOCK);
+    STATADD(lf->fs, lfsCopies, 1);
+  }
+  STATADD(lf->fs, lfsCleaned, 1);
+}
+
+
+
+// ============================================================================
+// Body of the cleaner thread.  'arg' is the Lfs.  Empties segments while
+// fewer than LFSCLEAN are free, checkpointing after each so it can be
+// reused, and writes out the head once it has held unwritten blocks for
+// LFSEXPIRE ms, checking every LFSINTERVAL ms.  Exits once told to stop by
+// lfsClose
+// ============================================================================
+static void* lfsCleaner(void* arg) {
+  Lfs* lf = (Lfs*)arg;
+  i8* buf = malloc(LFSSEGBLOCKS * BYTESPERBLOCK);
+  if (buf == NULL) FATAL(ENOMEM);
+
+  pthread_mutex_lock(&lf->lock);
+  while (!lf->stop) {
+    i32 victim = (lfsNumFree(lf) < LFSCLEAN) ? lfsVictim(lf) : -1;
+    if (victim >= 0) {
+      lfsClean(lf, victim, buf);
+      lfsCheckpoint(lf);
+      continue;
+    }
+    if (lf->since != 0 && lfsNow() - lf->since >= LFSEXPIRE * 1000000ull) {
+      lfsWriteHead(lf);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += LFSINTERVAL * 1000000;
+    ts.tv_sec  += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&lf->work, &lf->lock, &ts);
+  }
+  pthread_mutex_unlock(&lf->lock);
+
+  free(buf);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Start the cleaner, once the log is open
+// ============================================================================
+static void lfsStart(Lfs* lf) {
+  if (pthread_create(&lf->thread, NULL, lfsCleaner, lf) != 0) FATAL(ENOMEM);
+  lf->started = true;
+}
+
+
+
+// ============================================================================
+// Set 'counts' to the number of blocks block map 'map' points to, in each
+// segment
+// ============================================================================
+static void lfsCount(u16* map, u16* counts) {
+  memset(counts, 0, LFSSEGS * sizeof(u16));
+  for (i32 d = 0; d < BLOCKSPERDISK; ++d) {
+    if (map[d] != LFSNONE) ++counts[LFSSEG(map[d])];
+  }
+}
+
+
+
+// ============================================================================
+// Stop the cleaner, checkpoint, and close fs->path.  Does nothing if 'lf' is
+// not on
+// ============================================================================
+void lfsClose(Lfs* lf) {
+  if (!lf->on) return;
+
+  pthread_mutex_lock(&lf->lock);
+  lf->stop = true;
+  pthread_cond_signal(&lf->work);
+  pthread_mutex_unlock(&lf->lock);
+  if (lf->started) pthread_join(lf->thread, NULL);
+
+  if (lf->fp != NULL) {
+    lfsCheckpoint(lf);
+    fclose(lf->fp);
+  }
+  free(lf->map);
+  free(lf->seg);
+  pthread_mutex_destroy(&lf->lock);
+  pthread_cond_destroy(&lf->work);
+  pthread_cond_destroy(&lf->room);
+  memset(lf, 0, sizeof(Lfs));
+}
+
+
+
+// ============================================================================
+// Create a new, empty log in fs->path, replacing any old file.  It is given
+// its full size as a hole, and a first checkpoint, with no block written.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 lfsCreate(Lfs* lf) {
+  lf->fp = fopen(lf->fs->path, "w+b");
+  if (lf->fp == NULL) FATAL(EDISKCREATE);
+  i32 end = lfsSegBlock(LFSSEGS) * BYTESPERBLOCK;
+  if (fseek(lf->fp, end - 1, SEEK_SET) != 0) FATAL(EBADWRITE);
+  if (fputc(0, lf->fp) == EOF)               FATAL(EBADWRITE);
+
+  pthread_mutex_lock(&lf->lock);
+  lfsBegin(lf, 0);
+  lfsCheckpoint(lf);
+  pthread_mutex_unlock(&lf->lock);
+  lfsStart(lf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Forget DBNs 'dbn' .. 'dbn' + 'numBlocks' - 1: they read as zeroes from now
+// on, and their copies in the log are dead, for the cleaner to reclaim.  A
+// checkpoint makes that stick, in its place among the writes around it.
+// Return 0
+// ============================================================================
+i32 lfsDiscard(Lfs* lf, i32 dbn, i32 numBlocks) {
+  pthread_mutex_lock(&lf->lock);
+  for (i32 d = dbn; d < dbn + numBlocks; ++d) {
+    if (lf->map[d] == LFSNONE) continue;
+    --lf->live[LFSSEG(lf->map[d])];
+    lf->map[d] = LFSNONE;
+  }
+  lfsCheckpoint(lf);
+  pthread_mutex_unlock(&lf->lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Set up 'lf' as the log of volume 'fs', kept in fs->path.  Nothing is opened
+// yet: see lfsCreate and lfsOpen.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 lfsInit(Lfs* lf, BFS* fs) {
+  if (fs == NULL || fs->path == NULL) FATAL(ENULLPTR);
+
+  memset(lf, 0, sizeof(Lfs));
+  lf->on  = true;
+  lf->fs  = fs;
+  lf->map = malloc(BLOCKSPERDISK * sizeof(u16));
+  lf->seg = calloc(LFSSEGBLOCKS, BYTESPERBLOCK);
+  if (lf->map == NULL || lf->seg == NULL) FATAL(ENOMEM);
+  memset(lf->map, 0xFF, BLOCKSPERDISK * sizeof(u16));   // all LFSNONE
+
+  pthread_condattr_t attr;                  // timed waits: monotonic
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&lf->lock, NULL);
+  pthread_cond_init(&lf->work, &attr);
+  pthread_cond_init(&lf->room, NULL);
+  pthread_condattr_destroy(&attr);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from DBN 'dbn', to or from 'buf'.
+// Writes are appended to the head, waiting for the cleaner if it is full and
+// only the reserve is free.  Reads come from the head, or fs->path, wherever
+// the block map says.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 lfsIO(Lfs* lf, bool write, i32 dbn, i32 numBlocks, void* buf) {
+  LfsSummary* sum = (LfsSummary*)lf->seg;
+  i8* p = (i8*)buf;
+
+  pthread_mutex_lock(&lf->lock);
+  for (i32 b = 0; b < numBlocks; ++b, p += BYTESPERBLOCK) {
+    u16 at = lf->map[dbn + b];
+    if (write) {
+      while (sum->count == LFSSLOTS && lfsNumFree(lf) <= LFSRESERVE) {
+        pthread_cond_signal(&lf->work);
+        pthread_cond_wait(&lf->room, &lf->lock);
+      }
+      lfsAppend(lf, dbn + b, p);
+      if (lfsNumFree(lf) < LFSCLEAN) pthread_cond_signal(&lf->work);
+    } else if (at == LFSNONE) {
+      memset(p, 0, BYTESPERBLOCK);
+    } else if (LFSSEG(at) == lf->head) {
+      memcpy(p, lf->seg + LFSSLOT(at) * BYTESPERBLOCK, BYTESPERBLOCK);
+    } else {
+      lfsXfer(lf, false, LFSCKPTS + at, 1, p);
+    }
+  }
+  pthread_mutex_unlock(&lf->lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Open the log in fs->path, load the newer valid checkpoint, and roll
+// forward: segment by segment, in sequence from the checkpoint's head, map
+// each block written after it, up to the first whose CRC32C does not match
+// its summary.  A new head is begun past every segment ever written, and
+// checkpointed, so nothing beyond the point rolled to is ever rolled again.
+// If fs->path is not found, abort with ENODISK; if it has no valid
+// checkpoint, with EBADLOG.  On success, return 0
+// ============================================================================
+i32 lfsOpen(Lfs* lf) {
+  lf->fp = fopen(lf->fs->path, "rb+");
+  if (lf->fp == NULL) FATAL(ENODISK);
+
+  i8 block[BYTESPERBLOCK];
+  i8 best[BYTESPERBLOCK];
+  LfsCkpt* ck = (LfsCkpt*)best;
+  ck->magic = 0;
+  for (i32 c = 0; c < LFSCKPTS; ++c) {
+    lfsXfer(lf, false, c, 1, block);
+    LfsCkpt* cand = (LfsCkpt*)block;
+    u32 crc = cand->crc;
+    cand->crc = 0;
+    if (cand->magic != LFSMAGIC || crc != crcCompute(block, BYTESPERBLOCK)) {
+      continue;
+    }
+    if (cand->head >= LFSSEGS || cand->count > LFSSLOTS) continue;
+    if (ck->magic == LFSMAGIC && cand->seq <= ck->seq)   continue;
+    memcpy(best, block, BYTESPERBLOCK);
+  }
+  if (ck->magic != LFSMAGIC) FATAL(EBADLOG);
+  for (i32 d = 0; d < BLOCKSPERDISK; ++d) {
+    u16 at = ck->map[d];
+    if (at != LFSNONE && (LFSSEG(at) >= LFSSEGS || LFSSLOT(at) == 0)) {
+      FATAL(EBADLOG);
+    }
+  }
+
+  pthread_mutex_lock(&lf->lock);
+  memcpy(lf->map, ck->map, BLOCKSPERDISK * sizeof(u16));
+  lf->ckptSeq = ck->seq;
+  lfsCount(lf->map, lf->kept);
+
+  LfsSummary sums[LFSSEGS];
+  lf->seq = ck->headSeq;
+  for (i32 s = 0; s < LFSSEGS; ++s) {
+    lfsXfer(lf, false, lfsSegBlock(s), 1, block);
+    memcpy(&sums[s], block, sizeof(LfsSummary));
+    if (sums[s].magic == LFSMAGIC && sums[s].seq > lf->seq) {
+      lf->seq = sums[s].seq;                  // new heads go past them all
+    }
+  }
+
+  i32  seg   = ck->head;
+  u32  seq   = ck->headSeq;
+  i32  from  = ck->count;                     // slots already mapped
+  bool torn  = false;
+  while (!torn) {
+    LfsSummary* sum = &sums[seg];
+    if (sum->magic != LFSMAGIC || sum->seq != seq) break;
+    for (i32 slot = from + 1; slot <= sum->count && slot <= LFSSLOTS; ++slot) {
+      i32 dbn = sum->dbn[slot - 1];
+      lfsXfer(lf, false, lfsSegBlock(seg) + slot, 1, block);
+      if (dbn < 0 || dbn >= BLOCKSPERDISK
+       || crcCompute(block, BYTESPERBLOCK) != sum->crc[slot - 1]) {
+        torn = true;
+        break;
+      }
+      lf->map[dbn] = seg * LFSSEGBLOCKS + slot;
+    }
+
+    i32 next = -1;                            // the segment begun after it
+    for (i32 s = 0; s < LFSSEGS; ++s) {
+      if (sums[s].magic == LFSMAGIC && sums[s].seq == seq + 1) next = s;
+    }
+    if (next < 0) break;
+    seg  = next;
+    seq += 1;
+    from = 0;
+  }
+
+  lfsCount(lf->map, lf->live);
+  lf->head = -1;
+  for (i32 s = 0; s < LFSSEGS && lf->head < 0; ++s) {
+    if (lfsIsFree(lf, s)) lfsBegin(lf, s);
+  }
+  if (lf->head < 0) FATAL(EDISKFULL);
+  lfsCheckpoint(lf);
+  pthread_mutex_unlock(&lf->lock);
+  lfsStart(lf);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make every block written so far durable: write out the head segment, and
+// checkpoint.  On success, return 0
+// ============================================================================
+i32 lfsSync(Lfs* lf) {
+  pthread_mutex_lock(&lf->lock);
+  lfsCheckpoint(lf);
+  pthread_mutex_unlock(&lf->lock);
+  return 0;
+}
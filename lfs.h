@@ -0,0 +1,89 @@
+#ifndef LFS_H
+#define LFS_H
+
+// ============================================================================
+// lfs.h - log-structured block backend for bio.  No block is written in
+// place: each is appended to the head segment, held in memory, and a whole
+// segment goes to fs->path in one sequential write, once full.  A block map
+// says where the latest copy of each DBN is.  Every Inode lives in one block,
+// DBNINODES, so the map is the inode map too.  Each segment starts with an
+// LfsSummary, naming and checksumming the blocks in it.  A checkpoint saves
+// the map, alternately in one of two LfsCkpt blocks at the start of the file.
+// At mount, the newer checkpoint is loaded, and the segments written after it
+// are rolled forward, block by block, up to the first torn one.  A cleaner
+// thread keeps LFSCLEAN segments free: it copies the live blocks of the
+// segments with fewest to the head, and checkpoints.  A segment is reused
+// only once no checkpoint on disk points into it, nor roll forward from it
+// would pass through it.  The file is laid out:
+//
+//   block 0, 1           LfsCkpt, written in turn
+//   block 2 + s * 16     segment 's': its LfsSummary, then 15 data blocks
+// ============================================================================
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "alias.h"
+
+#define LFSMAGIC      0x4C534642  // "BFSL": LfsCkpt and LfsSummary
+#define LFSCKPTS      2           // LfsCkpt blocks, at the start of the file
+#define LFSSEGBLOCKS  16          // blocks per segment: summary, then data
+#define LFSSEGS       16          // segments in the log
+#define LFSCLEAN      4           // free segments the cleaner keeps
+#define LFSRESERVE    2           // free segments only the cleaner may take
+#define LFSEXPIRE     100         // ms the head may hold unwritten blocks
+#define LFSINTERVAL   25          // ms between the cleaner's checks of age
+#define LFSNONE       0xFFFF      // block map: DBN never written, or discarded
+
+#define LFSSLOTS      (LFSSEGBLOCKS - 1)  // data blocks per segment
+
+typedef struct {          // LfsSummary: block 0 of each segment
+  u32 magic;              // LFSMAGIC
+  u32 seq;                // bumped for each segment begun, from 1
+  u16 count;              // # data blocks after it
+  i16 dbn[LFSSLOTS];      // DBN each of them holds
+  u32 crc[LFSSLOTS];      // CRC32C of each of them
+} LfsSummary;
+
+typedef struct {          // LfsCkpt: a checkpoint, in block 0 or 1
+  u32 magic;              // LFSMAGIC
+  u32 crc;                // CRC32C of the block, with 'crc' 0
+  u32 seq;                // bumped for each checkpoint.  Newest wins
+  u32 headSeq;            // LfsSummary.seq of the head segment
+  u16 head;               // head segment
+  u16 count;              // # data blocks in it
+  u16 map[];              // where each DBN is: segment * 16 + slot
+} LfsCkpt;
+
+typedef struct {          // Lfs: a volume's log (BFS.lfs)
+  bool    on;             // the backend is BIOLOG
+  BFS*    fs;             // volume the log belongs to
+  FILE*   fp;             // open on fs->path.  NULL => not open
+  u16*    map;            // where each DBN's latest copy is.  LFSNONE => none
+  u16     live[LFSSEGS];  // # blocks the map points to, in each segment
+  u16     kept[LFSSEGS];  // as many, by the map in the last checkpoint
+  u32     fresh;          // segments begun since it, as bits: roll forward
+  u32     seq;            // LfsSummary.seq of the head segment
+  u32     ckptSeq;        // LfsCkpt.seq of the last checkpoint
+  i32     head;           // segment blocks are appended to
+  i32     flushed;        // # of its data blocks written to fs->path
+  i8*     seg;            // the head segment: summary, then data
+  u64     since;          // when it first held unwritten blocks.  0 => none
+  pthread_mutex_t lock;   // guards all of the above
+  pthread_cond_t  work;   // cleaner has work, or 'stop' set
+  pthread_cond_t  room;   // segments freed
+  pthread_t thread;       // the cleaner, once 'started'
+  bool    started;        // cleaner thread is running
+  bool    stop;           // cleaner should exit
+} Lfs;
+
+void lfsClose  (Lfs* lf);
+i32  lfsCreate (Lfs* lf);
+i32  lfsDiscard(Lfs* lf, i32 dbn, i32 numBlocks);
+i32  lfsInit   (Lfs* lf, BFS* fs);
+i32  lfsIO     (Lfs* lf, bool write, i32 dbn, i32 numBlocks, void* buf);
+i32  lfsOpen   (Lfs* lf);
+i32  lfsSync   (Lfs* lf);
+
+#endif
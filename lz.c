@@ -0,0 +1,174 @@
+// ============================================================================
+// lz.c - small, fast LZ77-family codec used for compressed BFS files
+//
+// The output is a series of sequences.  Each one is:
+//
+//   token     : high nibble = # literals, low nibble = match length - 4.
+//               A nibble of 15 is followed by extra bytes, added on, until
+//               one of them is less than 255
+//   literals  : copied through as-is
+//   offset    : 2 bytes, little-endian, back from the current output position
+//
+// The last sequence has literals only, and ends the input
+// ============================================================================
+
+#include <string.h>
+
+#include "lz.h"
+
+#define LZMINMATCH  4
+#define LZHASHBITS  10
+#define LZMAXOFF    65535
+
+
+
+// ============================================================================
+// Hash the 4 bytes at 'p' into a slot of the match table
+// ============================================================================
+static u32 lzHash(const i8* p) {
+  u32 v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - LZHASHBITS);
+}
+
+
+
+// ============================================================================
+// Append a length 'n' beyond 15 as extra bytes at 'op'.  Return the new
+// output position, or NULL if it would pass 'oend'
+// ============================================================================
+static i8* lzPutLen(i8* op, i8* oend, i32 n) {
+  for (; n >= 255; n -= 255) {
+    if (op >= oend) return NULL;
+    *op++ = (i8)255;
+  }
+  if (op >= oend) return NULL;
+  *op++ = (i8)n;
+  return op;
+}
+
+
+
+// ============================================================================
+// Emit one sequence: 'nlit' literals from 'lit', then, if 'mlen' > 0, a match
+// of 'mlen' bytes at distance 'off'.  Return the new output position, or
+// NULL if it would pass 'oend'
+// ============================================================================
+static i8* lzPutSeq(i8* op, i8* oend, const i8* lit, i32 nlit,
+                    i32 off, i32 mlen) {
+  if (op >= oend) return NULL;
+  i32 ml = (mlen > 0) ? mlen - LZMINMATCH : 0;
+  i8* token = op++;
+  *token = (i8)(((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15));
+
+  if (nlit >= 15 && (op = lzPutLen(op, oend, nlit - 15)) == NULL) return NULL;
+  if (op + nlit > oend) return NULL;
+  memcpy(op, lit, nlit);
+  op += nlit;
+
+  if (mlen == 0) return op;
+
+  if (op + 2 > oend) return NULL;
+  *op++ = (i8)(off & 0xFF);
+  *op++ = (i8)(off >> 8);
+  if (ml >= 15 && (op = lzPutLen(op, oend, ml - 15)) == NULL) return NULL;
+  return op;
+}
+
+
+
+// ============================================================================
+// Compress 'numb' bytes from 'src' into 'dst', which holds 'cap' bytes.  On
+// success, return the compressed size.  If it will not fit in 'cap' bytes,
+// return -1
+// ============================================================================
+i32 lzCompress(const i8* src, i32 numb, i8* dst, i32 cap) {
+  i32 table[1 << LZHASHBITS];
+  memset(table, 0xFF, sizeof(table));               // all -1: no match yet
+
+  i8* op   = dst;
+  i8* oend = dst + cap;
+  i32 ip     = 0;
+  i32 anchor = 0;                                   // start of literals
+
+  while (ip + LZMINMATCH <= numb) {
+    u32 h   = lzHash(src + ip);
+    i32 ref = table[h];
+    table[h] = ip;
+
+    if (ref < 0 || ip - ref > LZMAXOFF
+        || memcmp(src + ref, src + ip, LZMINMATCH) != 0) {
+      ++ip;
+      continue;
+    }
+
+    i32 mlen = LZMINMATCH;
+    while (ip + mlen < numb && src[ref + mlen] == src[ip + mlen]) ++mlen;
+
+    op = lzPutSeq(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+    if (op == NULL) return -1;
+
+    ip    += mlen;
+    anchor = ip;
+  }
+
+  op = lzPutSeq(op, oend, src + anchor, numb - anchor, 0, 0);
+  if (op == NULL) return -1;
+  return op - dst;
+}
+
+
+
+// ============================================================================
+// Read a length nibble 'n' and, if it is 15, the extra bytes after it at
+// '*ip'.  Return the full length, or -1 if the input runs out
+// ============================================================================
+static i32 lzGetLen(const i8** ip, const i8* iend, i32 n) {
+  if (n < 15) return n;
+  u8 b;
+  do {
+    if (*ip >= iend) return -1;
+    b = (u8)*(*ip)++;
+    n += b;
+  } while (b == 255);
+  return n;
+}
+
+
+
+// ============================================================================
+// Decompress 'numb' bytes from 'src' into 'dst', which holds 'cap' bytes.  On
+// success, return the decompressed size.  If the input is malformed, or
+// would overflow 'dst', return -1
+// ============================================================================
+i32 lzDecompress(const i8* src, i32 numb, i8* dst, i32 cap) {
+  const i8* ip   = src;
+  const i8* iend = src + numb;
+  i8*       op   = dst;
+  i8*       oend = dst + cap;
+
+  while (ip < iend) {
+    u8  token = (u8)*ip++;
+    i32 nlit  = lzGetLen(&ip, iend, token >> 4);
+    if (nlit < 0 || ip + nlit > iend || op + nlit > oend) return -1;
+    memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+
+    if (ip == iend) break;                          // last sequence
+
+    if (ip + 2 > iend) return -1;
+    i32 off = (u8)ip[0] | ((u8)ip[1] << 8);
+    ip += 2;
+    i32 mlen = lzGetLen(&ip, iend, token & 0x0F);
+    if (mlen < 0) return -1;
+    mlen += LZMINMATCH;
+
+    if (off == 0 || off > op - dst || op + mlen > oend) return -1;
+    const i8* ref = op - off;
+    for (i32 i = 0; i < mlen; ++i) op[i] = ref[i];  // may overlap
+    op += mlen;
+  }
+
+  return op - dst;
+}
@@ -0,0 +1,13 @@
+#ifndef LZ_H
+#define LZ_H
+
+// ============================================================================
+// lz.h - small, fast LZ77-family codec used for compressed BFS files
+// ============================================================================
+
+#include "alias.h"
+
+i32 lzCompress  (const i8* src, i32 numb, i8* dst, i32 cap);
+i32 lzDecompress(const i8* src, i32 numb, i8* dst, i32 cap);
+
+#endif
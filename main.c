@@ -5,7 +5,8 @@
 #include "p5test.h"
 
 int main() {
-  bfsInitOFT();
-  p5test();
+  BFS* fs = fsMount(BFSDISK, 0);
+  p5test(fs);
+  fsUnmount(fs);
   return 0;
 }
\ No newline at end of file
@@ -14,11 +14,28 @@
 
 void check(i32 testnum, i8* buf, i32 start, i32 size, i32 val);
 void checkCursor(i32 testnum, i32 expected, i32 actual);
-void createP5();
-void test1(i32 fd);
-void test2(i32 fd);
-void test3(i32 fd);
-void test4(i32 fd);
-void p5test();
+void createP5(BFS* fs);
+void test1(BFS* fs, i32 fd);
+void test2(BFS* fs, i32 fd);
+void test3(BFS* fs, i32 fd);
+void test4(BFS* fs, i32 fd);
+void test7(BFS* fs);
+void test8(BFS* fs, i32 fd);
+void test9(BFS* fs);
+void test10(BFS* fs);
+void test11(BFS* fs);
+void test12(BFS* fs);
+void test13(BFS* fs);
+void test14(BFS* fs);
+void test15(BFS* fs);
+void test16(BFS* fs);
+void test17(BFS* fs);
+void test18(BFS* fs);
+void test19(BFS* fs);
+void test20(BFS* fs);
+void test21(BFS* fs);
+void test22(BFS* fs);
+void test23(BFS* fs);
+void p5test(BFS* fs);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,315 @@
+// ============================================================================
+// pack.c - read-only packed BFS images (see pack.h).  packBuild writes the
+// file data first, a file at a time, checksumming as it goes, and then goes
+// back to write the tables and PackSuper in front of it.  A mounted image
+// is only ever read through the mapping.  Anything read from it that a
+// lookup or read relies on is checked where it is used, so that a damaged
+// image aborts with EBADPACK rather than sending a pointer astray, without
+// packMount having to look at every entry
+// ============================================================================
+
+#include <sys/mman.h>
+
+#include "bfs.h"
+#include "crc.h"
+#include "pack.h"
+
+
+
+// ============================================================================
+// Order two entries of an array of pointers to names, by name, for qsort
+// ============================================================================
+static int packCmp(const void* a, const void* b) {
+  return strcmp(**(const str* const*)a, **(const str* const*)b);
+}
+
+
+
+// ============================================================================
+// Return the PackExtent of file 'file', checked to lie within the image.
+// If 'file' is out of range, abort with EBADINUM; if the extent is, with
+// EBADPACK
+// ============================================================================
+static const PackExtent* packExtent(Pack* pk, i32 file) {
+  const PackSuper* sb = pk->super;
+  if (file < 0 || (u32)file >= sb->numFiles) FATAL(EBADINUM);
+
+  const PackExtent* ex = &pk->extents[file];
+  if (ex->dbn < sb->dbnData)                             FATAL(EBADPACK);
+  if ((u64)ex->dbn + ex->numBlocks > sb->numBlocks)      FATAL(EBADPACK);
+  if (ex->size > (u64)ex->numBlocks * BYTESPERBLOCK)     FATAL(EBADPACK);
+  if (ex->size > 0x7FFFFFFF)                             FATAL(EBADPACK);
+  return ex;
+}
+
+
+
+// ============================================================================
+// Pack the 'numFiles' host files in 'hostPaths' into a new image in 'path',
+// replacing any old one, under the names in 'names', which must all differ.
+// The files are stored in the order given, so files read together should
+// be packed together.  If a name is empty, or PACKNAMESIZE bytes or longer,
+// abort with EBIGFNAME; if it is given twice, with EEXISTS; if a host file
+// is not found, with EFNF.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 packBuild(str path, str* names, str* hostPaths, i32 numFiles) {
+  if (path == NULL || names == NULL || hostPaths == NULL) FATAL(ENULLPTR);
+  if (numFiles < 0) FATAL(ENEGNUMB);
+
+  u32         num     = (u32)numFiles + 1;          // never 0
+  str**       sorted  = malloc(num * sizeof(str*));
+  PackExtent* extents = calloc(num, sizeof(PackExtent));
+  i8*         buf     = malloc(PACKCOPY * BYTESPERBLOCK);
+  if (sorted == NULL || extents == NULL || buf == NULL) FATAL(ENOMEM);
+
+  // Lay out the tables: name index, extents, then the names, sorted, with
+  // a NUL past the last, so any name within the tables ends within them
+
+  u64 numStrings = 0;
+  for (i32 f = 0; f < numFiles; ++f) {
+    if (names[f] == NULL || hostPaths[f] == NULL) FATAL(ENULLPTR);
+    size_t len = strlen(names[f]);
+    if (len == 0 || len >= PACKNAMESIZE) FATAL(EBIGFNAME);
+    numStrings += len + 1;
+    sorted[f] = &names[f];
+  }
+  qsort(sorted, numFiles, sizeof(str*), packCmp);
+  for (i32 i = 1; i < numFiles; ++i) {
+    if (strcmp(*sorted[i], *sorted[i - 1]) == 0) FATAL(EEXISTS);
+  }
+
+  PackSuper sb = {0};
+  sb.magic      = PACKMAGIC;
+  sb.version    = PACKVERSION;
+  sb.blockSize  = BYTESPERBLOCK;
+  sb.numFiles   = numFiles;
+  sb.offExtents = BYTESPERBLOCK + numFiles * sizeof(PackName);
+  sb.offStrings = sb.offExtents + numFiles * sizeof(PackExtent);
+  u64 tablesEnd = sb.offStrings + numStrings + 1;
+  sb.dbnData    = (tablesEnd + BYTESPERBLOCK - 1) / BYTESPERBLOCK;
+
+  // Write each file into its extent, from block dbnData on
+
+  FILE* out = fopen(path, "wb");
+  if (out == NULL) FATAL(EDISKCREATE);
+  if (fseek(out, (long)sb.dbnData * BYTESPERBLOCK, SEEK_SET) != 0) {
+    FATAL(EBADWRITE);
+  }
+
+  u32 dbn = sb.dbnData;
+  for (i32 f = 0; f < numFiles; ++f) {
+    FILE* in = fopen(hostPaths[f], "rb");
+    if (in == NULL) FATAL(EFNF);
+
+    PackExtent* ex = &extents[f];
+    ex->dbn = dbn;
+    size_t numb;
+    while ((numb = fread(buf, 1, PACKCOPY * BYTESPERBLOCK, in)) > 0) {
+      if ((u64)ex->size + numb > 0x7FFFFFFF) FATAL(EBIGNUMB);
+      ex->crc   = crcExtend(ex->crc, buf, numb);
+      ex->size += numb;
+      i32 numBlocks = (numb + BYTESPERBLOCK - 1) / BYTESPERBLOCK;
+      memset(buf + numb, 0, numBlocks * BYTESPERBLOCK - numb);
+      if (fwrite(buf, BYTESPERBLOCK, numBlocks, out) != (size_t)numBlocks) {
+        FATAL(EBADWRITE);
+      }
+      ex->numBlocks += numBlocks;
+    }
+    if (ferror(in)) FATAL(EBADREAD);
+    fclose(in);
+    dbn += ex->numBlocks;
+  }
+  sb.numBlocks = dbn;
+
+  // Then the tables and PackSuper, in front of it
+
+  u32 tablesLen = (sb.dbnData - 1) * BYTESPERBLOCK;
+  i8* tables = calloc(tablesLen, 1);
+  if (tables == NULL) FATAL(ENOMEM);
+  PackName* index   = (PackName*)tables;
+  char*     strings = (char*)tables + sb.offStrings - BYTESPERBLOCK;
+  u32 at = 0;
+  for (i32 i = 0; i < numFiles; ++i) {
+    index[i].name = at;
+    index[i].file = sorted[i] - names;
+    strcpy(strings + at, *sorted[i]);
+    at += strlen(*sorted[i]) + 1;
+  }
+  memcpy(tables + sb.offExtents - BYTESPERBLOCK, extents,
+         numFiles * sizeof(PackExtent));
+  sb.tablesCrc = crcCompute(tables, tablesLen);
+  sb.crc       = crcCompute(&sb, sizeof(PackSuper));
+
+  i8 block[BYTESPERBLOCK] = {0};
+  memcpy(block, &sb, sizeof(PackSuper));
+  if (fseek(out, 0, SEEK_SET) != 0)                      FATAL(EBADWRITE);
+  if (fwrite(block, BYTESPERBLOCK, 1, out) != 1)         FATAL(EBADWRITE);
+  if (fwrite(tables, 1, tablesLen, out) != tablesLen)    FATAL(EBADWRITE);
+  if (fclose(out) != 0)                                  FATAL(EBADWRITE);
+
+  free(tables);
+  free(buf);
+  free(extents);
+  free(sorted);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Look up 'name' in the name index of image 'pk': a binary search, in place.
+// If found, return its file number, for packRead, packSize and packView.
+// If not, return EFNF
+// ============================================================================
+i32 packLookup(Pack* pk, str name) {
+  if (name == NULL) FATAL(ENULLPTR);
+
+  i32 lo = 0;
+  i32 hi = (i32)pk->super->numFiles - 1;
+  while (lo <= hi) {
+    i32 mid = lo + (hi - lo) / 2;
+    const PackName* pn = &pk->names[mid];
+    if (pn->name >= (u64)(pk->end - pk->strings)) FATAL(EBADPACK);
+
+    i32 cmp = strcmp(name, pk->strings + pn->name);
+    if (cmp == 0) {
+      if (pn->file >= pk->super->numFiles) FATAL(EBADPACK);
+      return pn->file;
+    }
+    if (cmp < 0) hi = mid - 1;
+    else         lo = mid + 1;
+  }
+  return EFNF;
+}
+
+
+
+// ============================================================================
+// Mount the packed image in 'path': map it, read-only, and check its
+// PackSuper, and that the tables it describes fit in the image.  Nothing
+// else is read.  If 'path' is not found, abort with ENODISK; if it is not a
+// packed image of this block size, with EBADPACK.  On success, return its
+// handle, for packUnmount to free.  On failure, abort
+// ============================================================================
+Pack* packMount(str path) {
+  if (path == NULL) FATAL(ENULLPTR);
+
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) FATAL(ENODISK);
+  if (fseek(fp, 0, SEEK_END) != 0) FATAL(EBADREAD);
+  i64 size = ftell(fp);
+  if (size < BYTESPERBLOCK) FATAL(EBADPACK);
+
+  void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+  fclose(fp);
+  if (p == MAP_FAILED) FATAL(EBADREAD);
+
+  const PackSuper* sb = (const PackSuper*)p;
+  PackSuper copy = *sb;
+  copy.crc = 0;
+  if (sb->magic != PACKMAGIC || sb->version != PACKVERSION) FATAL(EBADPACK);
+  if (sb->blockSize != BYTESPERBLOCK)                       FATAL(EBADPACK);
+  if (crcCompute(&copy, sizeof(PackSuper)) != sb->crc)      FATAL(EBADPACK);
+
+  u64 numFiles  = sb->numFiles;
+  u64 tablesEnd = (u64)sb->dbnData * BYTESPERBLOCK;
+  if ((u64)sb->numBlocks * BYTESPERBLOCK != (u64)size)      FATAL(EBADPACK);
+  if (sb->dbnData < 2 || sb->dbnData > sb->numBlocks)       FATAL(EBADPACK);
+  if (sb->offExtents != BYTESPERBLOCK + numFiles * sizeof(PackName)
+   || sb->offStrings != sb->offExtents + numFiles * sizeof(PackExtent)
+   || sb->offStrings >= tablesEnd) {
+    FATAL(EBADPACK);
+  }
+  if (((const i8*)p)[tablesEnd - 1] != 0) FATAL(EBADPACK);   // names end
+
+  Pack* pk = malloc(sizeof(Pack));
+  if (pk == NULL) FATAL(ENOMEM);
+  pk->base    = (const i8*)p;
+  pk->size    = size;
+  pk->super   = sb;
+  pk->names   = (const PackName*)  (pk->base + BYTESPERBLOCK);
+  pk->extents = (const PackExtent*)(pk->base + sb->offExtents);
+  pk->strings = (const char*)pk->base + sb->offStrings;
+  pk->end     = (const char*)pk->base + tablesEnd;
+  return pk;
+}
+
+
+
+// ============================================================================
+// Copy 'numb' bytes of file 'file' of image 'pk', from byte 'offset', into
+// 'buf'.  Return the number of bytes copied (less than 'numb' at EOF).  On
+// failure, abort
+// ============================================================================
+i32 packRead(Pack* pk, i32 file, i32 offset, i32 numb, void* buf) {
+  if (buf == NULL) FATAL(ENULLPTR);
+  if (offset < 0)  FATAL(EBADCURS);
+  if (numb < 0)    FATAL(ENEGNUMB);
+
+  const PackExtent* ex = packExtent(pk, file);
+  i32 size = ex->size;
+  if (offset >= size)             numb = 0;
+  else if (numb > size - offset)  numb = size - offset;
+
+  memcpy(buf, pk->base + (i64)ex->dbn * BYTESPERBLOCK + offset, numb);
+  return numb;
+}
+
+
+
+// ============================================================================
+// Return the size, in bytes, of file 'file' of image 'pk'
+// ============================================================================
+i32 packSize(Pack* pk, i32 file) {
+  return packExtent(pk, file)->size;
+}
+
+
+
+// ============================================================================
+// Unmap image 'pk', mounted by packMount, and free it.  No pointer from
+// packView may be used after.  On success, return 0
+// ============================================================================
+i32 packUnmount(Pack* pk) {
+  if (pk == NULL) FATAL(ENULLPTR);
+  munmap((void*)pk->base, pk->size);
+  free(pk);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Check image 'pk' against its checksums: the tables, as a whole, and each
+// file.  Reads the whole image, so packMount leaves it to the caller.
+// Return the number that do not match: 0 => the image is intact
+// ============================================================================
+i32 packVerify(Pack* pk) {
+  const PackSuper* sb = pk->super;
+  i32 numBad = 0;
+
+  i32 tablesLen = (sb->dbnData - 1) * BYTESPERBLOCK;
+  if (crcCompute(pk->base + BYTESPERBLOCK, tablesLen) != sb->tablesCrc) {
+    ++numBad;
+  }
+  for (i32 f = 0; f < (i32)sb->numFiles; ++f) {
+    const PackExtent* ex = packExtent(pk, f);
+    const i8* data = pk->base + (i64)ex->dbn * BYTESPERBLOCK;
+    if (crcCompute(data, ex->size) != ex->crc) ++numBad;
+  }
+  return numBad;
+}
+
+
+
+// ============================================================================
+// Set '*data' to point at the bytes of file 'file' of image 'pk', in place
+// in the mapping, and return how many there are.  Nothing is copied, and
+// the pointer stays valid until packUnmount.  On failure, abort
+// ============================================================================
+i32 packView(Pack* pk, i32 file, const i8** data) {
+  if (data == NULL) FATAL(ENULLPTR);
+  const PackExtent* ex = packExtent(pk, file);
+  *data = pk->base + (i64)ex->dbn * BYTESPERBLOCK;
+  return ex->size;
+}
@@ -0,0 +1,74 @@
+#ifndef PACK_H
+#define PACK_H
+
+// ============================================================================
+// pack.h - read-only packed BFS images.  packBuild packs a set of host
+// files into one image, each file stored whole, in one contiguous extent of
+// blocks, in the order given.  A table of extents says where each file
+// starts, how many blocks it spans and how big it is, and a name index,
+// sorted, maps each name to its file.  packMount maps the image and checks
+// only its PackSuper, so mounting costs the same whatever the image holds.
+// From then on, nothing is read or copied: a lookup is a binary search of
+// the name index, in place, and a file's bytes are a pointer into the
+// mapping.  There are no Inodes, indirect blocks or free-space bitmap, and
+// nothing is ever written, so there is nothing to recover either.  The
+// image is laid out:
+//
+//   block 0              PackSuper
+//   block 1 ..           PackName table, PackExtent table, then the names,
+//                        each NUL-terminated, up to block 'dbnData'
+//   block dbnData ..     each file in turn, from a block boundary
+// ============================================================================
+
+#include "alias.h"
+
+#define PACKMAGIC     0x50534642  // "BFSP": first 4 bytes of a packed image
+#define PACKVERSION   1           // layout of the image
+#define PACKNAMESIZE  256         // longest name, with its NUL
+#define PACKCOPY      64          // blocks per read, packing a file
+
+typedef struct {          // PackSuper: block 0 of a packed image
+  u32 magic;              // PACKMAGIC
+  u16 version;            // PACKVERSION
+  u16 blockSize;          // BYTESPERBLOCK, when packed
+  u32 numFiles;           // # files
+  u32 numBlocks;          // # blocks in the image, this one included
+  u32 offExtents;         // byte offset of the PackExtent table
+  u32 offStrings;         // byte offset of the names
+  u32 dbnData;            // first block of file data
+  u32 tablesCrc;          // CRC32C of blocks 1 .. dbnData - 1
+  u32 crc;                // CRC32C of the PackSuper, with 'crc' 0
+} PackSuper;
+
+typedef struct {          // PackName: one entry of the name index
+  u32 name;               // offset of the name, from PackSuper.offStrings
+  u32 file;               // its PackExtent
+} PackName;
+
+typedef struct {          // PackExtent: where one file lies
+  u32 dbn;                // first block
+  u32 numBlocks;          // # blocks, the last one padded with zeroes
+  u32 size;               // # bytes
+  u32 crc;                // CRC32C of the bytes
+} PackExtent;
+
+typedef struct {          // Pack: an image, mounted by packMount
+  const i8* base;         // the whole image, mapped read-only
+  i64 size;               // # bytes mapped
+  const PackSuper*  super;
+  const PackName*   names;    // sorted by name, at block 1
+  const PackExtent* extents;  // in the order the files were packed
+  const char*       strings;  // the names
+  const char*       end;      // just past the names: where file data starts
+} Pack;
+
+i32   packBuild  (str path, str* names, str* hostPaths, i32 numFiles);
+i32   packLookup (Pack* pk, str name);
+Pack* packMount  (str path);
+i32   packRead   (Pack* pk, i32 file, i32 offset, i32 numb, void* buf);
+i32   packSize   (Pack* pk, i32 file);
+i32   packUnmount(Pack* pk);
+i32   packVerify (Pack* pk);
+i32   packView   (Pack* pk, i32 file, const i8** data);
+
+#endif
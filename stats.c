@@ -0,0 +1,99 @@
+// ============================================================================
+// stats.c - I/O counters and latency histograms (see stats.h).  Counters
+// are bumped with relaxed atomic adds, so any thread may count without a
+// lock, and a snapshot is a consistent count of each, if not of all at once
+// ============================================================================
+
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "stats.h"
+
+#if BFSSTATS
+
+__thread i32 g_statKind = STATDATA;
+
+
+
+// ============================================================================
+// Count the 'numBlocks' blocks from 'dbn' just read, or written if 'write',
+// on volume 'fs', by kind.  Blocks past the metadata are of kind g_statKind:
+// STATDATA, unless the caller says otherwise with STATKIND
+// ============================================================================
+void statsBlocks(BFS* fs, bool write, i32 dbn, i32 numBlocks) {
+  u64* counts = write ? fs->stats.blockWrites : fs->stats.blockReads;
+  for (i32 d = dbn; d < dbn + numBlocks; ++d) {
+    i32 kind = g_statKind;
+    if      (d == DBNSUPER)  kind = STATSUPER;
+    else if (d == DBNINODES) kind = STATINODE;
+    else if (d == DBNDIR)    kind = STATDIR;
+    else if (d < fs->statEnd) kind = STATMETA;
+    __atomic_fetch_add(&counts[kind], 1, __ATOMIC_RELAXED);
+  }
+}
+
+
+
+// ============================================================================
+// Note that the metadata of volume 'fs' ends before DBN 'end'
+// ============================================================================
+void statsLayout(BFS* fs, i32 end) { fs->statEnd = end; }
+
+
+
+// ============================================================================
+// Return a monotonic timestamp, in nanoseconds
+// ============================================================================
+u64 statsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Count one call of kind 'op' on volume 'fs', begun at 'start' (see
+// statsNow), that moved 'numb' bytes, into its latency histogram
+// ============================================================================
+void statsOp(BFS* fs, i32 op, u64 start, i64 numb) {
+  u64 nanos = statsNow() - start;
+  i32 b = 0;
+  while (b < STATBUCKETS - 1 && (nanos >> (b + 1)) != 0) ++b;
+
+  StatOp* so = &fs->stats.ops[op];
+  __atomic_fetch_add(&so->calls, 1, __ATOMIC_RELAXED);
+  if (numb > 0) __atomic_fetch_add(&so->bytes, (u64)numb, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&so->nanos, nanos, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&so->hist[b], 1, __ATOMIC_RELAXED);
+}
+
+
+
+// ============================================================================
+// Copy every counter of volume 'fs' into 'stats', unless it is NULL.  With
+// 'reset', zero each one as it is read, so no count falls between the two
+// ============================================================================
+void statsSnap(BFS* fs, Stats* stats, bool reset) {
+  u64* src = (u64*)&fs->stats;
+  u64* dst = (u64*)stats;
+  for (u32 i = 0; i < sizeof(Stats) / sizeof(u64); ++i) {
+    u64 v = reset ? __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED)
+                  : __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    if (dst != NULL) dst[i] = v;
+  }
+}
+
+#else
+
+void statsBlocks(BFS* fs, bool write, i32 dbn, i32 numBlocks) {}
+void statsLayout(BFS* fs, i32 end) {}
+u64  statsNow() { return 0; }
+void statsOp(BFS* fs, i32 op, u64 start, i64 numb) {}
+void statsSnap(BFS* fs, Stats* stats, bool reset) {
+  if (stats != NULL) memset(stats, 0, sizeof(Stats));
+}
+
+#endif
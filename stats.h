@@ -0,0 +1,100 @@
+#ifndef STATS_H
+#define STATS_H
+
+// ============================================================================
+// stats.h - I/O counters and latency histograms for the fs, bfs and bio
+// layers, kept per volume (BFS.stats).  Counting is on unless built with
+// -DBFSSTATS=0, which compiles every STAT* macro to nothing
+// ============================================================================
+
+#include <stdbool.h>
+
+#include "alias.h"
+
+#ifndef BFSSTATS
+#define BFSSTATS 1
+#endif
+
+#define STATFSREAD    0       // StatOp slots: fs calls
+#define STATFSWRITE   1
+#define STATFSOPEN    2
+#define STATFSCREATE  3
+#define STATFSCLOSE   4
+#define STATFSDELETE  5
+#define STATBIOREAD   6       // bio calls: bioRead or bioReadRun
+#define STATBIOWRITE  7       // bio calls: bioWrite or bioWriteRun
+#define NUMSTATOPS    8
+
+#define STATSUPER     0       // kinds of block, for block counts
+#define STATINODE     1
+#define STATDIR       2
+#define STATMETA      3       // free-space bitmap, checksum table, RefTable
+#define STATINDIRECT  4
+#define STATDATA      5
+#define NUMSTATKINDS  6
+
+#define STATBUCKETS   32      // latency buckets: 1 ns .. 2^32 ns
+
+typedef struct {              // StatOp: counts for one kind of call
+  u64 calls;                  // # calls made
+  u64 bytes;                  // # bytes they moved
+  u64 nanos;                  // total time they took
+  u64 hist[STATBUCKETS];      // # calls taking 2^b .. 2^(b+1) - 1 ns
+} StatOp;
+
+typedef struct {              // Stats: what fsStats reports.  All u64
+  StatOp ops[NUMSTATOPS];     // fs and bio calls, by STATFS* / STATBIO*
+  u64 blockReads [NUMSTATKINDS];  // bio: blocks read, by STAT* kind
+  u64 blockWrites[NUMSTATKINDS];  // bio: blocks written, by STAT* kind
+  u64 discards;               // bio: blocks discarded
+  u64 tierHits;               // bio: blocks found in the RAM tier
+  u64 tierMisses;             // bio: blocks that went below it
+  u64 promotions;             // bio: blocks copied up into the RAM tier
+  u64 demotions;              // bio: blocks dropped from it, to make room
+  u64 throttles;              // bio: waits by writers for the flusher
+  u64 flushRuns;              // bio: runs written back by the flusher
+  u64 flushBlocks;            // bio: blocks in them
+  u64 elevMerges;             // bio: requests merged into another's
+  u64 elevSeeks;              // bio: requests not where the last one ended
+  u64 elevSeekDist;           // bio: blocks the head moved, for them
+  u64 elevExpired;            // bio: sweeps begun for requests overdue
+  u64 lfsSegWrites;           // bio: segment writes to the log
+  u64 lfsSegBlocks;           // bio: blocks new to the log, in them
+  u64 lfsCleaned;             // bio: segments emptied by the cleaner
+  u64 lfsCopies;              // bio: live blocks it copied to the head
+  u64 lfsCheckpoints;         // bio: checkpoints of the block map
+  u64 allocs;                 // bfs: blocks allocated
+  u64 frees;                  // bfs: blocks freed
+  u64 inodeReads;             // bfs: Inodes read
+  u64 inodeWrites;            // bfs: Inodes written
+  u64 lookups;                // bfs: Directory lookups
+} Stats;
+
+#if BFSSTATS
+
+extern __thread i32 g_statKind;       // kind of the data blocks now moving
+
+#define STATADD(fs, field, n)   __atomic_fetch_add(&(fs)->stats.field, \
+                                                   (u64)(n), __ATOMIC_RELAXED)
+#define STATSTART(t)            u64 t = statsNow()
+#define STATEND(fs, op, t, n)   statsOp((fs), (op), (t), (n))
+#define STATBLOCKS(fs, w, d, n) statsBlocks((fs), (w), (d), (n))
+#define STATKIND(k)             (g_statKind = (k))
+
+#else
+
+#define STATADD(fs, field, n)
+#define STATSTART(t)
+#define STATEND(fs, op, t, n)
+#define STATBLOCKS(fs, w, d, n)
+#define STATKIND(k)
+
+#endif
+
+void statsBlocks(BFS* fs, bool write, i32 dbn, i32 numBlocks);
+void statsLayout(BFS* fs, i32 end);
+u64  statsNow();
+void statsOp(BFS* fs, i32 op, u64 start, i64 numb);
+void statsSnap(BFS* fs, Stats* stats, bool reset);
+
+#endif
@@ -0,0 +1,340 @@
+// ============================================================================
+// stripe.c - RAID-0 block backend (see stripe.h).  A request is split into
+// one StripeJob per member it touches.  The calling thread runs the first
+// job itself, and hands the rest to the members' workers, so the members
+// transfer in parallel; it returns once all of them are done
+// ============================================================================
+
+#define _GNU_SOURCE                 // fallocate
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "crc.h"
+#include "stripe.h"
+
+typedef struct {          // StripeReq: one stripeIO call, until it is done
+  pthread_mutex_t lock;   // guards 'pending'
+  pthread_cond_t  done;   // 'pending' reached 0
+  i32 pending;            // # jobs handed to workers, not yet finished
+} StripeReq;
+
+struct StripeJob {        // one member's share of a request
+  StripeJob*   next;      // in the member's queue
+  StripeReq*   req;       // request it belongs to
+  bool         write;
+  i64          off;       // byte offset of the range in the member file
+  i32          numBlocks; // # blocks in the range
+  i32          numIov;    // # entries in 'iov'
+  struct iovec iov[BLOCKSPERDISK];  // where in the caller's buffer
+};
+
+
+
+// ============================================================================
+// Return the byte offset, in its member file, of DBN 'dbn'.  Block 0 of each
+// member holds its StripeLabel
+// ============================================================================
+static i64 stripeOffset(Stripe* st, i32 dbn) {
+  i32 s = dbn / st->unit;
+  i32 mbn = (s / st->width) * st->unit + dbn % st->unit;
+  return (i64)(1 + mbn) * BYTESPERBLOCK;
+}
+
+
+
+// ============================================================================
+// Split the run of 'numBlocks' DBNs from 'dbn' into 'jobs', one per member.
+// Each job covers one contiguous range of its member file, gathered from
+// (or scattered to) pieces of 'buf'.  'buf' may be NULL, for stripeDiscard
+// ============================================================================
+static void stripeSplit(Stripe* st, i32 dbn, i32 numBlocks, i8* buf,
+                        StripeJob* jobs) {
+  for (i32 m = 0; m < st->width; ++m) {
+    jobs[m].numBlocks = 0;
+    jobs[m].numIov    = 0;
+  }
+
+  for (i32 d = dbn; d < dbn + numBlocks; ) {
+    i32 len = st->unit - d % st->unit;      // to the end of this unit
+    if (len > dbn + numBlocks - d) len = dbn + numBlocks - d;
+
+    StripeJob* job = &jobs[(d / st->unit) % st->width];
+    if (job->numBlocks == 0) job->off = stripeOffset(st, d);
+    job->numBlocks += len;
+
+    if (buf != NULL) {
+      i8* p = buf + (d - dbn) * BYTESPERBLOCK;
+      struct iovec* last = job->numIov > 0 ? &job->iov[job->numIov - 1] : NULL;
+      if (last != NULL && (i8*)last->iov_base + last->iov_len == p) {
+        last->iov_len += len * BYTESPERBLOCK;   // adjoins the last piece
+      } else {
+        job->iov[job->numIov].iov_base = p;
+        job->iov[job->numIov].iov_len  = len * BYTESPERBLOCK;
+        ++job->numIov;
+      }
+    }
+    d += len;
+  }
+}
+
+
+
+// ============================================================================
+// Do 'job' on member 'mb': one vectored read or write.  On failure, abort
+// ============================================================================
+static void stripeRun(StripeMember* mb, StripeJob* job) {
+  i64 want = (i64)job->numBlocks * BYTESPERBLOCK;
+  i32 fd   = fileno(mb->fp);
+  i64 got  = job->write ? pwritev(fd, job->iov, job->numIov, job->off)
+                        : preadv (fd, job->iov, job->numIov, job->off);
+  if (got != want) FATAL(job->write ? EBADWRITE : EBADREAD);
+}
+
+
+
+// ============================================================================
+// A member's worker: runs the jobs queued for it, oldest first, and tells
+// each request as its job finishes.  'arg' is its StripeMember.  Exits once
+// told to stop by stripeClose and the queue is empty
+// ============================================================================
+static void* stripeWorker(void* arg) {
+  StripeMember* mb = (StripeMember*)arg;
+
+  for (;;) {
+    pthread_mutex_lock(&mb->lock);
+    while (mb->head == NULL && !mb->stop) {
+      pthread_cond_wait(&mb->work, &mb->lock);
+    }
+    StripeJob* job = mb->head;
+    if (job != NULL) {
+      mb->head = job->next;
+      if (mb->head == NULL) mb->tail = NULL;
+    }
+    pthread_mutex_unlock(&mb->lock);
+    if (job == NULL) break;
+
+    stripeRun(mb, job);
+
+    StripeReq* req = job->req;
+    pthread_mutex_lock(&req->lock);
+    if (--req->pending == 0) pthread_cond_signal(&req->done);
+    pthread_mutex_unlock(&req->lock);
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Start a worker for every member, once all of them are open.  A stripe of
+// one member needs none
+// ============================================================================
+static void stripeStart(Stripe* st) {
+  if (st->width < 2) return;
+  for (i32 m = 0; m < st->width; ++m) {
+    StripeMember* mb = &st->members[m];
+    if (pthread_create(&mb->thread, NULL, stripeWorker, mb) != 0) {
+      FATAL(ENOMEM);
+    }
+    mb->started = true;
+  }
+}
+
+
+
+// ============================================================================
+// Stop the workers, close the member files, and forget the layout.  Does
+// nothing if 'st' is not striped
+// ============================================================================
+void stripeClose(Stripe* st) {
+  for (i32 m = 0; m < st->width; ++m) {
+    StripeMember* mb = &st->members[m];
+    if (mb->started) {
+      pthread_mutex_lock(&mb->lock);
+      mb->stop = true;
+      pthread_cond_signal(&mb->work);
+      pthread_mutex_unlock(&mb->lock);
+      pthread_join(mb->thread, NULL);
+    }
+    if (mb->fp != NULL) fclose(mb->fp);
+    pthread_mutex_destroy(&mb->lock);
+    pthread_cond_destroy(&mb->work);
+    free(mb->path);
+  }
+  memset(st, 0, sizeof(Stripe));
+}
+
+
+
+// ============================================================================
+// Create the member files of a new stripe, replacing any old ones.  Each is
+// given the full size its share of the disk needs, as a hole, and its
+// StripeLabel.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 stripeCreate(Stripe* st) {
+  if (st->unit <= 0) FATAL(EBADFLAGS);
+
+  struct timespec ts;                       // any id will do, if it differs
+  clock_gettime(CLOCK_REALTIME, &ts);       // from other volumes'
+  st->id = crcCompute(&ts, sizeof(ts));
+
+  i32 numUnits = (BLOCKSPERDISK + st->unit - 1) / st->unit;
+  i32 perMember = (numUnits + st->width - 1) / st->width * st->unit;
+
+  for (i32 m = 0; m < st->width; ++m) {
+    StripeMember* mb = &st->members[m];
+    mb->fp = fopen(mb->path, "w+b");
+    if (mb->fp == NULL) FATAL(EDISKCREATE);
+
+    i8 block[BYTESPERBLOCK] = {0};
+    StripeLabel label = {STRIPEMAGIC, st->id, m, st->width, st->unit};
+    memcpy(block, &label, sizeof(label));
+    i32 end = (1 + perMember) * BYTESPERBLOCK;  // a hole, up to its last byte
+    if (fwrite(block, BYTESPERBLOCK, 1, mb->fp) != 1)     FATAL(EBADWRITE);
+    if (fseek(mb->fp, end - 1, SEEK_SET) != 0)            FATAL(EBADWRITE);
+    if (fputc(0, mb->fp) == EOF || fflush(mb->fp) != 0)   FATAL(EBADWRITE);
+  }
+  stripeStart(st);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Punch a hole over DBNs 'dbn' .. 'dbn' + 'numBlocks' - 1, in each member
+// that holds some of them (see bioDiscard), or write zeroes over them where
+// the host has no hole punch.  Return 0 if every member could, or -1 if some
+// member could not, and so keeps the old contents
+// ============================================================================
+i32 stripeDiscard(Stripe* st, i32 dbn, i32 numBlocks) {
+  StripeJob jobs[MAXMEMBERS];
+  stripeSplit(st, dbn, numBlocks, NULL, jobs);
+
+  i32 ret = 0;
+  for (i32 m = 0; m < st->width; ++m) {
+    if (jobs[m].numBlocks == 0) continue;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    i32 fd = fileno(st->members[m].fp);
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, jobs[m].off,
+                  (off_t)jobs[m].numBlocks * BYTESPERBLOCK) != 0) {
+      ret = -1;
+    }
+#else
+    u8 zero[BYTESPERBLOCK] = {0};
+    FILE* fp = st->members[m].fp;
+    if (fseek(fp, jobs[m].off, SEEK_SET) != 0)             FATAL(EBADWRITE);
+    for (i32 b = 0; b < jobs[m].numBlocks; ++b) {
+      if (fwrite(zero, BYTESPERBLOCK, 1, fp) != 1)         FATAL(EBADWRITE);
+    }
+    if (fflush(fp) != 0)                                   FATAL(EBADWRITE);
+#endif
+  }
+  return ret;
+}
+
+
+
+// ============================================================================
+// Set up 'st' to stripe over the 'width' member files in 'paths', in that
+// order, 'unit' blocks at a time.  'unit' 0 means it is to be read from the
+// StripeLabels, by stripeOpen.  Nothing is opened yet.  On success, return 0.
+// On failure, abort
+// ============================================================================
+i32 stripeInit(Stripe* st, str* paths, i32 width, i32 unit) {
+  if (paths == NULL) FATAL(ENULLPTR);
+  if (width < 1 || width > MAXMEMBERS)    FATAL(EBADFLAGS);
+  if (unit < 0  || unit > BLOCKSPERDISK)  FATAL(EBADFLAGS);
+
+  memset(st, 0, sizeof(Stripe));
+  st->width = width;
+  st->unit  = unit;
+  for (i32 m = 0; m < width; ++m) {
+    StripeMember* mb = &st->members[m];
+    if (paths[m] == NULL) FATAL(ENULLPTR);
+    mb->path = strdup(paths[m]);
+    if (mb->path == NULL) FATAL(ENOMEM);
+    pthread_mutex_init(&mb->lock, NULL);
+    pthread_cond_init(&mb->work, NULL);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from DBN 'dbn', to or from 'buf'.
+// Each member touched transfers its share in one call, all of them at once.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 stripeIO(Stripe* st, bool write, i32 dbn, i32 numBlocks, void* buf) {
+  StripeJob jobs[MAXMEMBERS];
+  stripeSplit(st, dbn, numBlocks, (i8*)buf, jobs);
+
+  StripeReq req;
+  pthread_mutex_init(&req.lock, NULL);
+  pthread_cond_init(&req.done, NULL);
+  req.pending = -1;                         // the job run here is not counted
+  for (i32 m = 0; m < st->width; ++m) {
+    if (jobs[m].numBlocks > 0) ++req.pending;
+  }
+
+  i32 mine = -1;                            // member whose job is run here
+  for (i32 m = 0; m < st->width; ++m) {
+    StripeJob* job = &jobs[m];
+    if (job->numBlocks == 0) continue;
+    job->next  = NULL;
+    job->req   = &req;
+    job->write = write;
+    if (mine < 0) { mine = m; continue; }
+
+    StripeMember* mb = &st->members[m];
+    pthread_mutex_lock(&mb->lock);
+    if (mb->tail != NULL) mb->tail->next = job;
+    else                  mb->head       = job;
+    mb->tail = job;
+    pthread_cond_signal(&mb->work);
+    pthread_mutex_unlock(&mb->lock);
+  }
+
+  if (mine >= 0) stripeRun(&st->members[mine], &jobs[mine]);
+
+  pthread_mutex_lock(&req.lock);
+  while (req.pending > 0) pthread_cond_wait(&req.done, &req.lock);
+  pthread_mutex_unlock(&req.lock);
+  pthread_mutex_destroy(&req.lock);
+  pthread_cond_destroy(&req.done);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Open the member files of an existing stripe, and check their StripeLabels:
+// each must be the member its place in the list says, of a stripe this wide,
+// with the same id and unit as the rest.  If not, abort with EBADSTRIPE.  A
+// member that cannot be opened aborts with ENODISK.  On success, return 0
+// ============================================================================
+i32 stripeOpen(Stripe* st) {
+  u32 id = 0;
+  for (i32 m = 0; m < st->width; ++m) {
+    StripeMember* mb = &st->members[m];
+    mb->fp = fopen(mb->path, "rb+");
+    if (mb->fp == NULL) FATAL(ENODISK);
+
+    StripeLabel label;
+    if (fread(&label, sizeof(label), 1, mb->fp) != 1) FATAL(EBADSTRIPE);
+    if (m == 0)        id = label.id;
+    if (st->unit == 0) st->unit = label.unit;
+    if (label.magic != STRIPEMAGIC || label.id    != id
+     || label.index != m           || label.width != st->width
+     || label.unit  != st->unit    || label.unit  <= 0) {
+      FATAL(EBADSTRIPE);
+    }
+  }
+  st->id = id;
+  stripeStart(st);
+  return 0;
+}
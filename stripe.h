@@ -0,0 +1,60 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+// ============================================================================
+// stripe.h - RAID-0 block backend for bio.  The blocks of a volume are
+// spread over several member files, 'unit' blocks at a time, round robin:
+// DBN 'd' lies in stripe unit 's' = d / unit, on member s % width.  A
+// contiguous run of DBNs is one contiguous range on each member it touches,
+// so each member takes a single vectored read or write, and the members
+// work in parallel, one thread apiece.  Every member file starts with a
+// StripeLabel block, so that a member missing, out of order, or from some
+// other volume is caught at mount
+// ============================================================================
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "alias.h"
+
+#define STRIPEMAGIC   0x50525453  // "STRP": first 4 bytes of a member file
+#define MAXMEMBERS    16          // most member files in a stripe
+
+typedef struct {          // StripeLabel: block 0 of each member file
+  u32 magic;              // STRIPEMAGIC
+  u32 id;                 // same in every member, and in the SuperBlock
+  i16 index;              // which member this is, from 0
+  i16 width;              // # members
+  i16 unit;               // blocks per stripe unit
+} StripeLabel;
+
+typedef struct StripeJob StripeJob;
+
+typedef struct {          // StripeMember: one member file, and its worker
+  str  path;              // the member file
+  FILE* fp;               // open on 'path'.  NULL => not open
+  pthread_mutex_t lock;   // guards the queue, and 'stop'
+  pthread_cond_t  work;   // queue filled, or 'stop' set
+  StripeJob* head;        // jobs for the worker, oldest first
+  StripeJob* tail;
+  pthread_t  thread;      // the worker, once 'started'
+  bool started;           // worker thread is running
+  bool stop;              // worker should exit, once the queue is empty
+} StripeMember;
+
+typedef struct {          // Stripe: a volume's layout (BFS.stripe)
+  i32 width;              // # members.  0 => not striped
+  i32 unit;               // blocks per stripe unit
+  u32 id;                 // from the StripeLabels
+  StripeMember members[MAXMEMBERS];
+} Stripe;
+
+void stripeClose  (Stripe* st);
+i32  stripeCreate (Stripe* st);
+i32  stripeDiscard(Stripe* st, i32 dbn, i32 numBlocks);
+i32  stripeInit   (Stripe* st, str* paths, i32 width, i32 unit);
+i32  stripeIO     (Stripe* st, bool write, i32 dbn, i32 numBlocks, void* buf);
+i32  stripeOpen   (Stripe* st);
+
+#endif
@@ -0,0 +1,294 @@
+// ============================================================================
+// tier.c - RAM tier for bio (see tier.h).  Callers of tierIO hold the tier
+// lock for the whole request, backend I/O included, so a block is never in
+// the tier and being changed below it at once.  The promoter drops the lock
+// while it reads a block up: if the block is written below meanwhile, its
+// copy is 'stale', and thrown away
+// ============================================================================
+
+#include "bfs.h"
+#include "stats.h"
+#include "tier.h"
+
+
+
+// ============================================================================
+// Count an access to DBN 'dbn'.  Every TIERDECAY accesses, all counts are
+// halved, so blocks that were hot once, and are no longer, cool off.  Queue
+// 'dbn' for promotion if it is hot, and not in the tier.  Return whether it
+// was queued.  The caller holds the tier lock
+// ============================================================================
+static bool tierTouch(Tier* tr, i32 dbn) {
+  if (tr->heat[dbn] < 0xFFFF) ++tr->heat[dbn];
+  if (++tr->ticks >= TIERDECAY) {
+    for (i32 d = 0; d < BLOCKSPERDISK; ++d) tr->heat[d] /= 2;
+    tr->ticks = 0;
+  }
+
+  if (tr->slotOf[dbn] >= 0 || tr->heat[dbn] < TIERHOT) return false;
+  if (dbn == tr->busy || tr->qLen == TIERQUEUE)        return false;
+  for (i32 q = 0; q < tr->qLen; ++q) {
+    if (tr->queue[q] == dbn) return false;
+  }
+  tr->queue[tr->qLen++] = dbn;
+  return true;
+}
+
+
+
+// ============================================================================
+// Drop the block in 'slot' from the tier, writing it back first if it is
+// dirty.  The caller holds the tier lock
+// ============================================================================
+static void tierDemote(Tier* tr, i32 slot) {
+  i32 dbn = tr->slotDbn[slot];
+  if (tr->dirty[slot]) {
+    tr->io(tr->fs, true, dbn, 1, tr->data + slot * BYTESPERBLOCK);
+    tr->dirty[slot] = false;
+  }
+  tr->slotOf[dbn]    = -1;
+  tr->slotDbn[slot]  = -1;
+  STATADD(tr->fs, demotions, 1);
+}
+
+
+
+// ============================================================================
+// Choose a slot for DBN 'dbn', about to be promoted: a free one, or else the
+// one holding the coldest block, if that is colder than 'dbn'.  Return the
+// slot, or -1 if 'dbn' is not worth it.  The caller holds the tier lock
+// ============================================================================
+static i32 tierVictim(Tier* tr, i32 dbn) {
+  i32 coldest = -1;
+  u16 least   = 0xFFFF;
+  for (i32 s = 0; s < tr->cap; ++s) {
+    if (tr->slotDbn[s] < 0) return s;
+    u16 heat = tr->heat[tr->slotDbn[s]];
+    if (coldest < 0 || heat < least) { coldest = s; least = heat; }
+  }
+  return (least < tr->heat[dbn]) ? coldest : -1;
+}
+
+
+
+// ============================================================================
+// Body of the promoter thread.  'arg' is the Tier.  Copies each queued block
+// up into the tier, demoting another to make room if need be.  Exits once
+// told to stop by tierClose
+// ============================================================================
+static void* tierPromoter(void* arg) {
+  Tier* tr = (Tier*)arg;
+
+  pthread_mutex_lock(&tr->lock);
+  for (;;) {
+    while (tr->qLen == 0 && !tr->stop) pthread_cond_wait(&tr->work, &tr->lock);
+    if (tr->stop) break;
+
+    i32 dbn = tr->queue[0];
+    --tr->qLen;
+    memmove(tr->queue, tr->queue + 1, tr->qLen * sizeof(i16));
+    if (tr->slotOf[dbn] >= 0) continue;
+
+    i32 slot = tierVictim(tr, dbn);
+    if (slot < 0) continue;
+    if (tr->slotDbn[slot] >= 0) tierDemote(tr, slot);
+
+    tr->busy  = dbn;                          // read it up, unlocked
+    tr->stale = false;
+    pthread_mutex_unlock(&tr->lock);
+    tr->io(tr->fs, false, dbn, 1, tr->data + slot * BYTESPERBLOCK);
+    pthread_mutex_lock(&tr->lock);
+    tr->busy = -1;
+
+    if (tr->stale) continue;                  // slot stays free
+    tr->slotDbn[slot] = dbn;
+    tr->slotOf[dbn]   = slot;
+    STATADD(tr->fs, promotions, 1);
+  }
+  pthread_mutex_unlock(&tr->lock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Write back every dirty block in the tier, in DBN order, but for the
+// SuperBlock, last.  They stay in the tier, now clean.  The caller holds the
+// tier lock
+// ============================================================================
+static void tierFlushLocked(Tier* tr) {
+  for (i32 i = 1; i <= BLOCKSPERDISK; ++i) {
+    i32 dbn  = (DBNSUPER + i) % BLOCKSPERDISK;
+    i32 slot = tr->slotOf[dbn];
+    if (slot < 0 || !tr->dirty[slot]) continue;
+    tr->io(tr->fs, true, dbn, 1, tr->data + slot * BYTESPERBLOCK);
+    tr->dirty[slot] = false;
+  }
+}
+
+
+
+// ============================================================================
+// Stop the promoter, write back what is dirty, and free the tier.  Does
+// nothing if 'tr' is not tiered
+// ============================================================================
+void tierClose(Tier* tr) {
+  if (tr->cap == 0) return;
+
+  pthread_mutex_lock(&tr->lock);
+  tr->stop = true;
+  pthread_cond_signal(&tr->work);
+  pthread_mutex_unlock(&tr->lock);
+  if (tr->started) pthread_join(tr->thread, NULL);
+
+  tierFlushLocked(tr);
+  free(tr->data);
+  free(tr->slotDbn);
+  free(tr->dirty);
+  free(tr->slotOf);
+  free(tr->heat);
+  pthread_mutex_destroy(&tr->lock);
+  pthread_cond_destroy(&tr->work);
+  memset(tr, 0, sizeof(Tier));
+}
+
+
+
+// ============================================================================
+// Forget DBNs 'dbn' .. 'dbn' + 'numBlocks' - 1, about to be discarded below:
+// drop any of them in the tier, dirty or not, so none can be demoted over
+// the hole, and unqueue them.  Their counts start again from 0
+// ============================================================================
+void tierDiscard(Tier* tr, i32 dbn, i32 numBlocks) {
+  pthread_mutex_lock(&tr->lock);
+  for (i32 d = dbn; d < dbn + numBlocks; ++d) {
+    i32 slot = tr->slotOf[d];
+    if (slot >= 0) {
+      tr->slotOf[d]     = -1;
+      tr->slotDbn[slot] = -1;
+      tr->dirty[slot]   = false;
+    }
+    if (d == tr->busy) tr->stale = true;
+    tr->heat[d] = 0;
+  }
+
+  i32 keep = 0;
+  for (i32 q = 0; q < tr->qLen; ++q) {
+    i32 d = tr->queue[q];
+    if (d < dbn || d >= dbn + numBlocks) tr->queue[keep++] = d;
+  }
+  tr->qLen = keep;
+  pthread_mutex_unlock(&tr->lock);
+}
+
+
+
+// ============================================================================
+// Write back every dirty block in the tier, so the backend holds the whole
+// disk as it stands.  bioFlush calls this, so blocks reach the backend at
+// the same points the checksum table does.  On success, return 0
+// ============================================================================
+i32 tierFlush(Tier* tr) {
+  pthread_mutex_lock(&tr->lock);
+  tierFlushLocked(tr);
+  pthread_mutex_unlock(&tr->lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Set up 'tr' as an empty RAM tier of 'capacity' blocks for volume 'fs',
+// above the backend reached through 'io', and start its promoter.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 tierInit(Tier* tr, BFS* fs, TierIO* io, i32 capacity) {
+  if (fs == NULL || io == NULL)                   FATAL(ENULLPTR);
+  if (capacity < 1 || capacity > BLOCKSPERDISK)   FATAL(EBADFLAGS);
+
+  memset(tr, 0, sizeof(Tier));
+  tr->cap     = capacity;
+  tr->fs      = fs;
+  tr->io      = io;
+  tr->busy    = -1;
+  tr->data    = malloc(capacity * BYTESPERBLOCK);
+  tr->slotDbn = malloc(capacity * sizeof(i16));
+  tr->dirty   = calloc(capacity, sizeof(bool));
+  tr->slotOf  = malloc(BLOCKSPERDISK * sizeof(i16));
+  tr->heat    = calloc(BLOCKSPERDISK, sizeof(u16));
+  if (tr->data == NULL || tr->slotDbn == NULL || tr->dirty == NULL
+   || tr->slotOf == NULL || tr->heat == NULL) {
+    FATAL(ENOMEM);
+  }
+  memset(tr->slotDbn, -1, capacity * sizeof(i16));
+  memset(tr->slotOf,  -1, BLOCKSPERDISK * sizeof(i16));
+
+  pthread_mutex_init(&tr->lock, NULL);
+  pthread_cond_init(&tr->work, NULL);
+  if (pthread_create(&tr->thread, NULL, tierPromoter, tr) != 0) FATAL(ENOMEM);
+  tr->started = true;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from DBN 'dbn', to or from 'buf'.
+// Blocks in the tier are copied there and back; the rest go to the backend,
+// a run at a time.  Every block's count goes up, and those now hot are
+// queued for the promoter.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 tierIO(Tier* tr, bool write, i32 dbn, i32 numBlocks, void* buf) {
+  i8* p = (i8*)buf;
+  bool queued = false;
+  i32 hits = 0;
+
+  pthread_mutex_lock(&tr->lock);
+  for (i32 b = 0; b < numBlocks; ++b) {
+    queued |= tierTouch(tr, dbn + b);
+    i32 slot = tr->slotOf[dbn + b];
+    if (slot < 0) continue;
+    i8* data = tr->data + slot * BYTESPERBLOCK;
+    if (write) {
+      memcpy(data, p + b * BYTESPERBLOCK, BYTESPERBLOCK);
+      tr->dirty[slot] = !tr->through;
+    } else {
+      memcpy(p + b * BYTESPERBLOCK, data, BYTESPERBLOCK);
+    }
+    ++hits;
+  }
+
+  for (i32 b = 0; b < numBlocks; ) {          // the rest: a run at a time
+    bool below = tr->slotOf[dbn + b] < 0 || (write && tr->through);
+    if (!below) { ++b; continue; }
+    i32 end = b + 1;
+    while (end < numBlocks
+        && (tr->slotOf[dbn + end] < 0 || (write && tr->through))) {
+      ++end;
+    }
+    if (write && tr->busy >= dbn + b && tr->busy < dbn + end) tr->stale = true;
+    tr->io(tr->fs, write, dbn + b, end - b, p + b * BYTESPERBLOCK);
+    b = end;
+  }
+
+  if (queued) pthread_cond_signal(&tr->work);
+  pthread_mutex_unlock(&tr->lock);
+
+  STATADD(tr->fs, tierHits, hits);
+  STATADD(tr->fs, tierMisses, numBlocks - hits);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Turn write-through on or off.  While on, every write reaches the backend
+// at once, as well as the tier, so a bioMap of the backend sees it.  Turning
+// it on first writes back whatever is dirty
+// ============================================================================
+void tierWriteThrough(Tier* tr, bool on) {
+  pthread_mutex_lock(&tr->lock);
+  if (on) tierFlushLocked(tr);
+  tr->through = on;
+  pthread_mutex_unlock(&tr->lock);
+}
@@ -0,0 +1,56 @@
+#ifndef TIER_H
+#define TIER_H
+
+// ============================================================================
+// tier.h - RAM tier for bio.  A small, fixed number of blocks are held in
+// memory, above the backend that holds the whole disk.  Which blocks is
+// decided by how often each DBN is read or written: a block accessed
+// TIERHOT times, recently, is queued for promotion, and a worker thread
+// copies it up, demoting the coldest block in the tier to make room.  Reads
+// and writes of a block in the tier never reach the backend: writes are held
+// there, dirty, until demoted or tierFlush'ed.  bio calls in here instead of
+// its backend, so bfs.c sees the same blocks either way
+// ============================================================================
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "alias.h"
+
+#define TIERBLOCKS  16        // fsFormat, fsMount: blocks in the RAM tier
+#define TIERHOT     2         // accesses that make a block worth promoting
+#define TIERDECAY   256       // accesses between halvings of every count
+#define TIERQUEUE   32        // most blocks waiting for promotion
+
+typedef i32 TierIO(BFS* fs, bool write, i32 dbn, i32 numBlocks, void* buf);
+
+typedef struct {          // Tier: a volume's RAM tier (BFS.tier)
+  i32     cap;            // # blocks the tier holds.  0 => not tiered
+  BFS*    fs;             // volume the tier belongs to
+  TierIO* io;             // reads and writes the backend, below the tier
+  i8*     data;           // 'cap' blocks
+  i16*    slotDbn;        // DBN held in each slot of 'data'.  -1 => free
+  bool*   dirty;          // slot is newer than the backend
+  i16*    slotOf;         // slot holding each DBN.  -1 => not in the tier
+  u16*    heat;           // recent accesses to each DBN
+  u32     ticks;          // accesses since 'heat' was last halved
+  i16     queue[TIERQUEUE];   // DBNs waiting for promotion, oldest first
+  i32     qLen;           // # DBNs in 'queue'
+  i32     busy;           // DBN being promoted.  -1 => none
+  bool    stale;          // 'busy' was written below the tier meanwhile
+  bool    through;        // write through to the backend too (bioMap)
+  pthread_mutex_t lock;   // guards all of the above, once 'started'
+  pthread_cond_t  work;   // queue filled, or 'stop' set
+  pthread_t thread;       // the promoter, once 'started'
+  bool    started;        // promoter thread is running
+  bool    stop;           // promoter should exit
+} Tier;
+
+void tierClose  (Tier* tr);
+void tierDiscard(Tier* tr, i32 dbn, i32 numBlocks);
+i32  tierFlush  (Tier* tr);
+i32  tierInit   (Tier* tr, BFS* fs, TierIO* io, i32 capacity);
+i32  tierIO     (Tier* tr, bool write, i32 dbn, i32 numBlocks, void* buf);
+void tierWriteThrough(Tier* tr, bool on);
+
+#endif
@@ -0,0 +1,491 @@
+// ============================================================================
+// bfsbench.c - throughput and latency benchmarks for the fs.h API
+//
+// usage: bfsbench [-n ops] [-o outfile] [-s members [-u unit]]
+//
+//   -n   operations per workload (default 2000)
+//   -o   where to write results (default bench_output.txt)
+//   -s   also run every workload striped over this many member files,
+//        BFSDISK.s0 and on (see fsFormatStriped)
+//   -u   blocks per stripe unit (default 4)
+//
+// Every workload runs against a freshly formatted disk, once on file, once
+// in memory (FSMEMORY), once on file under a RAM tier (FSTIERED), once with
+// write-back (FSWRITEBACK), once as a log (FSLOG) and, with -s, once
+// striped.  On file, it uses BFSDISK in the current directory, overwriting
+// it, so run this from a scratch directory.  The shardsN workloads spread
+// the ops across N volumes, BFSDISK.0 and on, each driven by a thread of its
+// own.  Each result is one line of "key=value" pairs in the output file:
+// workload, backend, I/O size, # ops, seconds, MB/s, ops/s and p50/p99/p999
+// latency in microseconds.  The csumwrite and csumread workloads instead
+// report what FEATCSUM costs, in percent, against CSUMTARGET, the "a few
+// percent" the checksums were asked to stay under, and whether they do.
+// Build, from the top of the tree, with LIB every .c file there but main.c:
+//
+//   gcc -O2 -I. -o bfsbench tools/bfsbench.c $LIB -lpthread -lm
+// ============================================================================
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "fs.h"
+
+#define FILEBLOCKS 64                         // size of the file under test
+#define FILEBYTES  (FILEBLOCKS * BYTESPERBLOCK)
+#define MAXIOSIZE  16384
+#define SMALLSIZE  100                        // bytes in each small file
+
+#define MAXSHARDS  8                           // most volumes, in benchShards
+
+#define CSUMTARGET 5.0                        // % FEATCSUM may cost, at most
+#define CSUMREPS   5                          // runs of benchCsum, best kept
+
+#define CREATE     0                          // benchSmallFiles op kinds
+#define OPEN       1
+#define DELETE     2
+
+static i32   g_numOps  = 2000;                // ops per workload
+static i64*  g_lat     = NULL;                // latency of each op, in ns
+static i32   g_numLat  = 0;                   // # entries in g_lat
+static i64   g_bytes   = 0;                   // bytes moved by the ops
+static FILE* g_out     = NULL;                // results, for machines
+
+static BFS*  g_fs      = NULL;                // volume under test
+static i32   g_opts    = 0;                   // fsFormat opts: FSMEMORY
+static i32   g_feats   = 0;                   // fsFormat features: FEATCSUM
+static i32   g_width   = 0;                   // # stripe members.  0 => none
+static i32   g_unit    = 4;                   // blocks per stripe unit
+static str   g_members[MAXMEMBERS];           // stripe member files
+static i64   g_wall    = 0;                   // elapsed ns, if ops overlap
+
+static i8    g_buf[MAXIOSIZE];
+
+static const i32 g_ioSizes[] = {128, 512, 4096, 16384};
+#define NUMIOSIZES (i32)(sizeof(g_ioSizes) / sizeof(g_ioSizes[0]))
+
+typedef struct {          // one volume of benchShards, and its thread's ops
+  BFS* fs;                // this shard's volume
+  i32  numOps;            // ops to run
+  i64* lat;               // latency of each op, in ns
+  u32  seed;              // for rand_r
+} Shard;
+
+
+
+// ============================================================================
+// Return a monotonic timestamp, in nanoseconds
+// ============================================================================
+static i64 benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Record one op, begun at 'start', that moved 'numb' bytes
+// ============================================================================
+static void benchOp(i64 start, i32 numb) {
+  g_lat[g_numLat++] = benchNow() - start;
+  g_bytes += numb;
+}
+
+
+
+static int benchCmp(const void* a, const void* b) {
+  i64 x = *(const i64*)a, y = *(const i64*)b;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Start a workload: reformat the disk, and clear the op record
+// ============================================================================
+static void benchBegin() {
+  if (g_fs != NULL) fsUnmount(g_fs);
+  if (g_width > 0) {
+    g_fs = fsFormatStriped(g_members, g_width, g_unit, g_feats, 0);
+  } else {
+    g_fs = fsFormat(BFSDISK, g_feats, g_opts);
+  }
+  g_numLat = 0;
+  g_bytes  = 0;
+  g_wall   = 0;
+}
+
+
+
+// ============================================================================
+// Finish a workload, reporting what benchOp recorded, on stdout and as one
+// line of g_out
+// ============================================================================
+static void benchEnd(str name, str backend, i32 ioSize) {
+  i64 total = 0;
+  for (i32 i = 0; i < g_numLat; ++i) total += g_lat[i];
+  qsort(g_lat, g_numLat, sizeof(i64), benchCmp);
+
+  double secs = (g_wall > 0 ? g_wall : total) / 1e9;
+  double mbps = secs > 0 ? g_bytes / secs / 1e6 : 0;
+  double opss = secs > 0 ? g_numLat / secs : 0;
+  double p50  = g_lat[g_numLat * 50  / 100]  / 1e3;
+  double p99  = g_lat[g_numLat * 99  / 100]  / 1e3;
+  double p999 = g_lat[g_numLat * 999 / 1000] / 1e3;
+
+  printf("%-12s %-4s %6d %8.2f MB/s %10.0f ops/s  p50 %8.1f  p99 %8.1f"
+         "  p999 %8.1f us \n", name, backend, ioSize, mbps, opss, p50, p99,
+         p999);
+  fprintf(g_out, "workload=%s backend=%s iosize=%d ops=%d secs=%.6f "
+          "mbps=%.3f opsps=%.1f p50us=%.2f p99us=%.2f p999us=%.2f\n",
+          name, backend, ioSize, g_numLat, secs, mbps, opss, p50, p99, p999);
+  fflush(g_out);
+}
+
+
+
+// ============================================================================
+// Create file "F" and fill it with FILEBYTES of data.  Return its fd
+// ============================================================================
+static i32 benchFill() {
+  i32 fd = fsCreate(g_fs, "F");
+  for (i32 off = 0; off < FILEBYTES; off += MAXIOSIZE) {
+    fsWrite(g_fs, fd, MAXIOSIZE, g_buf);
+  }
+  return fd;
+}
+
+
+
+// ============================================================================
+// Sequential or random reads or writes of 'ioSize' bytes over file "F".
+// Sequential ops wrap around at the end of the file; random ones land on
+// offsets that are multiples of 'ioSize'
+// ============================================================================
+static void benchRW(str backend, i32 ioSize, bool write, bool random) {
+  benchBegin();
+  i32 fd = benchFill();
+
+  i32 numSlots = FILEBYTES / ioSize;
+  for (i32 i = 0; i < g_numOps; ++i) {
+    i32 slot = random ? rand() % numSlots : i % numSlots;
+    i64 start = benchNow();
+    fsSeek(g_fs, fd, slot * ioSize, SEEK_SET);
+    if (write) fsWrite(g_fs, fd, ioSize, g_buf);
+    else       fsRead (g_fs, fd, ioSize, g_buf);
+    benchOp(start, ioSize);
+  }
+  fsClose(g_fs, fd);
+
+  char name[32];
+  sprintf(name, "%s%s", random ? "rand" : "seq", write ? "write" : "read");
+  benchEnd(name, backend, ioSize);
+}
+
+
+
+// ============================================================================
+// Appends of 'ioSize' bytes to file "A", which is deleted and started again
+// whenever it reaches FILEBYTES
+// ============================================================================
+static void benchAppend(str backend, i32 ioSize) {
+  benchBegin();
+  i32 fd = fsCreate(g_fs, "A");
+  for (i32 i = 0; i < g_numOps; ++i) {
+    if (fsSize(g_fs, fd) + ioSize > FILEBYTES) {
+      fsClose(g_fs, fd);
+      fsDelete(g_fs, "A");
+      fd = fsCreate(g_fs, "A");
+    }
+    i64 start = benchNow();
+    fsSeek(g_fs, fd, 0, SEEK_END);
+    fsWrite(g_fs, fd, ioSize, g_buf);
+    benchOp(start, ioSize);
+  }
+  fsClose(g_fs, fd);
+  benchEnd("append", backend, ioSize);
+}
+
+
+
+// ============================================================================
+// Random 4096-byte ops over file "F", 'readPct' percent of them reads
+// ============================================================================
+static void benchMixed(str backend, i32 readPct) {
+  i32 ioSize = 4096;
+  benchBegin();
+  i32 fd = benchFill();
+
+  i32 numSlots = FILEBYTES / ioSize;
+  for (i32 i = 0; i < g_numOps; ++i) {
+    i32 slot = rand() % numSlots;
+    bool read = rand() % 100 < readPct;
+    i64 start = benchNow();
+    fsSeek(g_fs, fd, slot * ioSize, SEEK_SET);
+    if (read) fsRead (g_fs, fd, ioSize, g_buf);
+    else      fsWrite(g_fs, fd, ioSize, g_buf);
+    benchOp(start, ioSize);
+  }
+  fsClose(g_fs, fd);
+
+  char name[32];
+  sprintf(name, "mixed%dr", readPct);
+  benchEnd(name, backend, ioSize);
+}
+
+
+
+// ============================================================================
+// Small-file storm: fill the Directory with small files, then open (look
+// up) and read each, then delete them all, over and over.  Creates, opens
+// and deletes are reported as separate workloads
+// ============================================================================
+static void benchSmallFiles(str backend) {
+  i64* lat[3];
+  i32  numLat[3] = {0};
+  for (i32 k = 0; k < 3; ++k) {
+    lat[k] = malloc(g_numOps * sizeof(i64));
+    if (lat[k] == NULL) FATAL(ENOMEM);
+  }
+
+  benchBegin();
+  char name[FNAMESIZE];
+  while (numLat[DELETE] < g_numOps) {
+    i32 numFiles = NUMINODES;
+    if (numFiles > g_numOps - numLat[DELETE]) {
+      numFiles = g_numOps - numLat[DELETE];
+    }
+
+    for (i32 f = 0; f < numFiles; ++f) {
+      sprintf(name, "S%d", f);
+      i64 start = benchNow();
+      i32 fd = fsCreate(g_fs, name);
+      fsWrite(g_fs, fd, SMALLSIZE, g_buf);
+      fsClose(g_fs, fd);
+      lat[CREATE][numLat[CREATE]++] = benchNow() - start;
+    }
+    for (i32 f = 0; f < numFiles; ++f) {
+      sprintf(name, "S%d", f);
+      i64 start = benchNow();
+      i32 fd = fsOpen(g_fs, name);
+      fsSeek(g_fs, fd, 0, SEEK_SET);
+      fsRead(g_fs, fd, SMALLSIZE, g_buf);
+      fsClose(g_fs, fd);
+      lat[OPEN][numLat[OPEN]++] = benchNow() - start;
+    }
+    for (i32 f = 0; f < numFiles; ++f) {
+      sprintf(name, "S%d", f);
+      i64 start = benchNow();
+      fsDelete(g_fs, name);
+      lat[DELETE][numLat[DELETE]++] = benchNow() - start;
+    }
+  }
+
+  static const str names[3] = {"smallcreate", "smallopen", "smalldelete"};
+  for (i32 k = 0; k < 3; ++k) {
+    memcpy(g_lat, lat[k], numLat[k] * sizeof(i64));
+    g_numLat = numLat[k];
+    g_bytes  = (k == DELETE) ? 0 : (i64)numLat[k] * SMALLSIZE;
+    benchEnd(names[k], backend, SMALLSIZE);
+    free(lat[k]);
+  }
+}
+
+
+
+// ============================================================================
+// One benchShards thread: random 4096-byte ops, half of them reads, over
+// file "F" of its own volume.  'arg' is its Shard
+// ============================================================================
+static void* benchShard(void* arg) {
+  Shard* sh = (Shard*)arg;
+  i32 ioSize = 4096;
+  i8* buf = malloc(ioSize);
+  if (buf == NULL) FATAL(ENOMEM);
+  memset(buf, 0x5A, ioSize);
+
+  i32 fd = fsCreate(sh->fs, "F");
+  for (i32 off = 0; off < FILEBYTES; off += ioSize) {
+    fsWrite(sh->fs, fd, ioSize, buf);
+  }
+
+  i32 numSlots = FILEBYTES / ioSize;
+  for (i32 i = 0; i < sh->numOps; ++i) {
+    i32 slot = rand_r(&sh->seed) % numSlots;
+    bool read = rand_r(&sh->seed) % 2;
+    i64 start = benchNow();
+    fsSeek(sh->fs, fd, slot * ioSize, SEEK_SET);
+    if (read) fsRead (sh->fs, fd, ioSize, buf);
+    else      fsWrite(sh->fs, fd, ioSize, buf);
+    sh->lat[i] = benchNow() - start;
+  }
+  fsClose(sh->fs, fd);
+  free(buf);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Shard the mixed workload across 'numShards' volumes, each mounted on its
+// own and driven by its own thread, the ops split evenly between them.
+// Throughput is over the elapsed time, so it shows how well independent
+// volumes scale, with nothing shared between them
+// ============================================================================
+static void benchShards(str backend, i32 numShards) {
+  Shard     shards[MAXSHARDS];
+  pthread_t threads[MAXSHARDS];
+  char      path[32];
+
+  benchBegin();
+  for (i32 s = 0; s < numShards; ++s) {
+    sprintf(path, "%s.%d", BFSDISK, s);
+    shards[s].fs     = fsFormat(path, 0, g_opts);
+    shards[s].numOps = g_numOps / numShards;
+    shards[s].lat    = g_lat + s * shards[s].numOps;
+    shards[s].seed   = s + 1;
+  }
+
+  i64 start = benchNow();
+  for (i32 s = 0; s < numShards; ++s) {
+    if (pthread_create(&threads[s], NULL, benchShard, &shards[s]) != 0) {
+      FATAL(ENOMEM);
+    }
+  }
+  for (i32 s = 0; s < numShards; ++s) pthread_join(threads[s], NULL);
+  g_wall = benchNow() - start;
+
+  for (i32 s = 0; s < numShards; ++s) {
+    fsUnmount(shards[s].fs);
+    sprintf(path, "%s.%d", BFSDISK, s);
+    remove(path);
+  }
+  g_numLat = numShards * (g_numOps / numShards);
+  g_bytes  = (i64)g_numLat * 4096;
+
+  char name[32];
+  sprintf(name, "shards%d", numShards);
+  benchEnd(name, backend, 4096);
+}
+
+
+
+// ============================================================================
+// What FEATCSUM costs: sequential 4096-byte writes, then reads, over file
+// "F", on a volume formatted without checksums and on one with, keeping the
+// best of CSUMREPS runs of each.  Report each slowdown, in percent, next to
+// CSUMTARGET, and whether it stays under it
+// ============================================================================
+static void benchCsum(str backend) {
+  static const str ops[2] = {"csumwrite", "csumread"};
+  i32    ioSize   = 4096;
+  i32    numSlots = FILEBYTES / ioSize;
+  double best[2][2];                          // [FEATCSUM?][read?], ns per op
+
+  for (i32 rep = 0; rep < CSUMREPS; ++rep) {
+    for (i32 c = 0; c < 2; ++c) {
+      g_feats = c ? FEATCSUM : 0;
+      benchBegin();
+      i32 fd = benchFill();
+      for (i32 r = 0; r < 2; ++r) {
+        i64 start = benchNow();
+        for (i32 i = 0; i < g_numOps; ++i) {
+          fsSeek(g_fs, fd, (i % numSlots) * ioSize, SEEK_SET);
+          if (r) fsRead (g_fs, fd, ioSize, g_buf);
+          else   fsWrite(g_fs, fd, ioSize, g_buf);
+        }
+        double ns = (double)(benchNow() - start) / g_numOps;
+        if (rep == 0 || ns < best[c][r]) best[c][r] = ns;
+      }
+      fsClose(g_fs, fd);
+    }
+  }
+  g_feats = 0;
+
+  for (i32 r = 0; r < 2; ++r) {
+    double pct = (best[1][r] / best[0][r] - 1) * 100;
+    bool   met = pct <= CSUMTARGET;
+    printf("%-12s %-4s %6d %8.2f us %8.2f us  %+6.1f%%  target %.0f%%: %s \n",
+           ops[r], backend, ioSize, best[0][r] / 1e3, best[1][r] / 1e3, pct,
+           CSUMTARGET, met ? "met" : "MISSED");
+    fprintf(g_out, "workload=%s backend=%s iosize=%d ops=%d basens=%.0f "
+            "csumns=%.0f overheadpct=%.1f targetpct=%.0f met=%s\n",
+            ops[r], backend, ioSize, g_numOps, best[0][r], best[1][r], pct,
+            CSUMTARGET, met ? "yes" : "no");
+  }
+  fflush(g_out);
+}
+
+
+
+int main(int argc, char** argv) {
+
+  str outName = "bench_output.txt";
+  i32 numMembers = 0;
+  for (i32 a = 1; a < argc; ++a) {
+    if (strcmp(argv[a], "-n") == 0 && a + 1 < argc) {
+      g_numOps = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+      outName = argv[++a];
+    } else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc) {
+      numMembers = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "-u") == 0 && a + 1 < argc) {
+      g_unit = atoi(argv[++a]);
+    } else {
+      printf("usage: %s [-n ops] [-o outfile] [-s members [-u unit]] \n",
+             argv[0]);
+      return 1;
+    }
+  }
+  if (g_numOps <= 0) g_numOps = 1;
+  if (numMembers > MAXMEMBERS) numMembers = MAXMEMBERS;
+  for (i32 m = 0; m < numMembers; ++m) {
+    g_members[m] = malloc(32);
+    if (g_members[m] == NULL) FATAL(ENOMEM);
+    sprintf(g_members[m], "%s.s%d", BFSDISK, m);
+  }
+
+  g_lat = malloc(g_numOps * sizeof(i64));
+  g_out = fopen(outName, "w");
+  if (g_lat == NULL) FATAL(ENOMEM);
+  if (g_out == NULL) FATAL(EBADWRITE);
+
+  fprintf(g_out, "# bfsbench blocksize=%d disk=%d ops=%d\n",
+          BYTESPERBLOCK, BYTESPERDISK, g_numOps);
+  memset(g_buf, 0x5A, sizeof(g_buf));
+  srand(1);
+
+  static const i32 opts[]  = {0, FSMEMORY, FSTIERED, FSWRITEBACK, FSLOG, 0};
+  static const str names[] = {"file", "mem", "tier", "wback", "log",
+                              "stripe"};
+
+  for (i32 b = 0; b < (numMembers > 0 ? 6 : 5); ++b) {
+    g_opts  = opts[b];
+    g_width = (b == 5) ? numMembers : 0;
+    for (i32 s = 0; s < NUMIOSIZES; ++s) {
+      benchRW(names[b], g_ioSizes[s], true,  false);
+      benchRW(names[b], g_ioSizes[s], false, false);
+      benchRW(names[b], g_ioSizes[s], true,  true);
+      benchRW(names[b], g_ioSizes[s], false, true);
+    }
+    benchAppend(names[b], 100);
+    benchAppend(names[b], 4096);
+    benchMixed(names[b], 90);
+    benchMixed(names[b], 50);
+    benchMixed(names[b], 10);
+    benchSmallFiles(names[b]);
+    benchCsum(names[b]);
+    if (g_width > 0) continue;
+    for (i32 n = 1; n <= MAXSHARDS; n *= 2) benchShards(names[b], n);
+  }
+  fsUnmount(g_fs);
+  for (i32 m = 0; m < numMembers; ++m) free(g_members[m]);
+
+  fclose(g_out);
+  free(g_lat);
+  return 0;
+}
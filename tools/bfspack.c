@@ -0,0 +1,162 @@
+// ============================================================================
+// bfspack.c - build, list, check and time read-only packed BFS images (see
+// pack.h)
+//
+// usage: bfspack [-o image] file ...
+//        bfspack [-o image] -l | -v | -b [-n rounds]
+//
+//   -o   the image (default BFSPACK)
+//   -l   list the files in the image, by name: size, first block, # blocks
+//   -v   check every file, and the tables, against their checksums
+//   -b   time a mount and unmount, a lookup of every name, and a scan of
+//        every file, a byte per cache line, 'rounds' times each (default
+//        1000), and report the mean
+//
+// With files, packs them into the image, replacing it, in the order given,
+// each under its path as given, less any leading "./".  Build, from the top
+// of the tree, with LIB every .c file there but main.c:
+//
+//   gcc -O2 -I. -o bfspack tools/bfspack.c $LIB -lpthread -lm
+// ============================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "pack.h"
+
+#define LIST    1                             // what to do with the image
+#define VERIFY  2
+#define BENCH   3
+
+
+
+// ============================================================================
+// Return a monotonic timestamp, in nanoseconds
+// ============================================================================
+static i64 packNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// List the files in image 'pk', in name order
+// ============================================================================
+static void packList(Pack* pk) {
+  for (u32 i = 0; i < pk->super->numFiles; ++i) {
+    str name = (str)pk->strings + pk->names[i].name;
+    const PackExtent* ex = &pk->extents[pk->names[i].file];
+    printf("%10u  %8u  %6u  %s \n", ex->size, ex->dbn, ex->numBlocks, name);
+  }
+  printf("%u files, %u blocks \n", pk->super->numFiles,
+         pk->super->numBlocks);
+}
+
+
+
+// ============================================================================
+// Time image 'path': mount and unmount, a lookup of every name, and a scan
+// of every file, in place, a byte per cache line, 'rounds' times each, and
+// report the mean of each
+// ============================================================================
+static void packBench(str path, i32 rounds) {
+  i64 start = packNow();
+  for (i32 r = 0; r < rounds; ++r) packUnmount(packMount(path));
+  double mountUs = (packNow() - start) / 1e3 / rounds;
+
+  Pack* pk = packMount(path);
+  i32 numFiles = pk->super->numFiles;
+  i64 sum = 0;
+  start = packNow();
+  for (i32 r = 0; r < rounds; ++r) {
+    for (i32 i = 0; i < numFiles; ++i) {
+      sum += packLookup(pk, (str)pk->strings + pk->names[i].name);
+    }
+  }
+  double lookupNs = numFiles > 0
+                  ? (double)(packNow() - start) / rounds / numFiles : 0;
+
+  i64 bytes = 0;
+  start = packNow();
+  for (i32 r = 0; r < rounds; ++r) {
+    for (i32 f = 0; f < numFiles; ++f) {
+      const i8* data;
+      i32 size = packView(pk, f, &data);
+      for (i32 b = 0; b < size; b += 64) sum += data[b];
+      bytes += size;
+    }
+  }
+  double secs = (packNow() - start) / 1e9;
+  packUnmount(pk);
+
+  printf("mount+unmount %8.1f us  lookup %8.1f ns  scan %8.1f MB/s"
+         "  (%d files, check %lld) \n", mountUs, lookupNs,
+         secs > 0 ? bytes / 1e6 / secs : 0, numFiles, (long long)sum);
+}
+
+
+
+int main(int argc, char** argv) {
+
+  str image  = "BFSPACK";
+  i32 what   = 0;
+  i32 rounds = 1000;
+  i32 a = 1;
+  for (; a < argc && argv[a][0] == '-'; ++a) {
+    if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+      image = argv[++a];
+    } else if (strcmp(argv[a], "-n") == 0 && a + 1 < argc) {
+      rounds = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "-l") == 0) {
+      what = LIST;
+    } else if (strcmp(argv[a], "-v") == 0) {
+      what = VERIFY;
+    } else if (strcmp(argv[a], "-b") == 0) {
+      what = BENCH;
+    } else {
+      break;
+    }
+  }
+  if ((what == 0) ? a == argc : a != argc) {      // files xor -l/-v/-b
+    printf("usage: %s [-o image] file ... \n"
+           "       %s [-o image] -l | -v | -b [-n rounds] \n",
+           argv[0], argv[0]);
+    return 1;
+  }
+  if (rounds <= 0) rounds = 1;
+
+  if (what == 0) {
+    i32 numFiles = argc - a;
+    str* names = malloc(numFiles * sizeof(str));
+    if (names == NULL) FATAL(ENOMEM);
+    for (i32 f = 0; f < numFiles; ++f) {
+      names[f] = argv[a + f];
+      while (strncmp(names[f], "./", 2) == 0) names[f] += 2;
+    }
+    packBuild(image, names, argv + a, numFiles);
+    free(names);
+    return 0;
+  }
+
+  if (what == BENCH) {
+    packBench(image, rounds);
+    return 0;
+  }
+
+  Pack* pk = packMount(image);
+  i32 numBad = 0;
+  if (what == LIST) {
+    packList(pk);
+  } else {
+    numBad = packVerify(pk);
+    printf("%d damaged, of %u files and the tables \n", numBad,
+           pk->super->numFiles);
+  }
+  packUnmount(pk);
+  return numBad == 0 ? 0 : 4;
+}
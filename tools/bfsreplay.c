@@ -0,0 +1,264 @@
+// ============================================================================
+// bfsreplay.c - analyse a block trace recorded by trace.c, and optionally
+// re-issue it against a BFS disk
+//
+// usage: bfsreplay [-r | -f] tracefile
+//
+//   -r   replay the trace against BFSDISK in the current directory, at the
+//        pace it was recorded
+//   -f   replay it as fast as possible
+//
+// Replaying writes blocks of filler over BFSDISK, so point it at a copy of
+// the image.  The analysis reports the mix of requests, how sequential and
+// how far apart they are, the working set, and the hit ratio an LRU block
+// cache of several sizes would have had.  Build, from the top of the tree,
+// with LIB every .c file there but main.c:
+//
+//   gcc -O2 -I. -o bfsreplay tools/bfsreplay.c $LIB -lpthread -lm
+// ============================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "trace.h"
+
+#define MAXDBNS  32768                        // i16 DBNs: all there can be
+
+static const i32 g_cacheSizes[] = {4, 8, 16, 32, 64, 128};
+#define NUMCACHES (i32)(sizeof(g_cacheSizes) / sizeof(g_cacheSizes[0]))
+
+
+
+// ============================================================================
+// Read the trace in 'path' into a new array, oldest record first.  Return it,
+// with its length in '*numRecs'
+// ============================================================================
+static TraceRec* replayLoad(str path, i32* numRecs) {
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) FATAL(ENODISK);
+
+  TraceHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1) FATAL(EBADREAD);
+  if (hdr.magic != TRACEMAGIC || hdr.capacity == 0) FATAL(EBADFLAGS);
+
+  u64 num   = hdr.total < hdr.capacity ? hdr.total : hdr.capacity;
+  u64 first = hdr.total - num;
+  TraceRec* recs = malloc((num > 0 ? num : 1) * sizeof(TraceRec));
+  if (recs == NULL) FATAL(ENOMEM);
+
+  for (u64 i = 0; i < num; ++i) {
+    u64 slot = (first + i) % hdr.capacity;
+    fseek(fp, sizeof(TraceHeader) + slot * sizeof(TraceRec), SEEK_SET);
+    if (fread(&recs[i], sizeof(TraceRec), 1, fp) != 1) FATAL(EBADREAD);
+    if (recs[i].type > TRACEDISCARD || recs[i].dbn < 0 ||
+        recs[i].numBlocks < 0 || recs[i].dbn + recs[i].numBlocks > MAXDBNS) {
+      FATAL(EBADFLAGS);
+    }
+  }
+  fclose(fp);
+
+  if (hdr.total > hdr.capacity) {
+    printf("trace wrapped: oldest %llu of %llu requests lost \n",
+           (unsigned long long)first, (unsigned long long)hdr.total);
+  }
+  *numRecs = (i32)num;
+  return recs;
+}
+
+
+
+// ============================================================================
+// Return the hit ratio, over blocks read, of an LRU cache of 'size' blocks
+// fed the requests in 'recs'.  Writes fill the cache; discards empty it of
+// their blocks
+// ============================================================================
+static double replayCache(TraceRec* recs, i32 numRecs, i32 size) {
+  static u64 used[MAXDBNS];                 // last use of each cached DBN
+  static bool cached[MAXDBNS];
+  memset(cached, 0, sizeof(cached));
+  i16* slots = calloc(size, sizeof(i16));   // DBN in each slot
+  if (slots == NULL) FATAL(ENOMEM);
+
+  i32 numCached = 0;
+  u64 now = 0, reads = 0, hits = 0;
+  for (i32 r = 0; r < numRecs; ++r) {
+    for (i32 b = 0; b < recs[r].numBlocks; ++b) {
+      i32 dbn = recs[r].dbn + b;
+      ++now;
+      if (recs[r].type == TRACEDISCARD) {
+        cached[dbn] = false;
+        continue;
+      }
+      if (recs[r].type == TRACEREAD) {
+        ++reads;
+        if (cached[dbn]) ++hits;
+      }
+      if (!cached[dbn]) {                   // bring it in
+        i32 s = 0;
+        if (numCached < size) {
+          s = numCached++;
+        } else {                            // evict the least recent
+          for (i32 i = 0; i < size; ++i) {
+            if (!cached[slots[i]]) { s = i; break; }
+            if (used[slots[i]] < used[slots[s]]) s = i;
+          }
+          cached[slots[s]] = false;
+        }
+        slots[s] = dbn;
+        cached[dbn] = true;
+      }
+      used[dbn] = now;
+    }
+  }
+
+  free(slots);
+  return reads > 0 ? (double)hits / reads : 0;
+}
+
+
+
+// ============================================================================
+// Report what the trace shows: mix, sequentiality, seek distance, working
+// set, fs calls, and LRU cache hit ratios
+// ============================================================================
+static void replayAnalyse(TraceRec* recs, i32 numRecs) {
+  static bool touched[MAXDBNS];
+  u64 count[3] = {0}, blocks[3] = {0};
+  u64 numSeq = 0, seekSum = 0, numMeta = 0, numWorking = 0;
+  u32 maxOpId = 0, minOpId = 0xFFFFFFFF;
+  i32 prevEnd = -1;
+
+  for (i32 r = 0; r < numRecs; ++r) {
+    TraceRec* rec = &recs[r];
+    ++count[rec->type];
+    blocks[rec->type] += rec->numBlocks;
+    if (rec->dbn < NUMMETA) ++numMeta;
+
+    if (prevEnd >= 0) {
+      if (rec->dbn == prevEnd) ++numSeq;
+      seekSum += (rec->dbn > prevEnd) ? rec->dbn - prevEnd : prevEnd - rec->dbn;
+    }
+    prevEnd = rec->dbn + rec->numBlocks;
+
+    for (i32 b = 0; b < rec->numBlocks; ++b) {
+      if (!touched[rec->dbn + b]) ++numWorking;
+      touched[rec->dbn + b] = true;
+    }
+    if (rec->opId != 0 && rec->opId > maxOpId) maxOpId = rec->opId;
+    if (rec->opId != 0 && rec->opId < minOpId) minOpId = rec->opId;
+  }
+
+  i32 numOps = maxOpId >= minOpId ? maxOpId - minOpId + 1 : 0;
+  double span = numRecs > 0 ? (recs[numRecs - 1].nanos - recs[0].nanos) / 1e9
+                            : 0;
+
+  printf("requests        = %d over %.3f s \n", numRecs, span);
+  printf("reads           = %llu (%llu blocks) \n",
+         (unsigned long long)count[TRACEREAD],
+         (unsigned long long)blocks[TRACEREAD]);
+  printf("writes          = %llu (%llu blocks) \n",
+         (unsigned long long)count[TRACEWRITE],
+         (unsigned long long)blocks[TRACEWRITE]);
+  printf("discards        = %llu (%llu blocks) \n",
+         (unsigned long long)count[TRACEDISCARD],
+         (unsigned long long)blocks[TRACEDISCARD]);
+  if (numRecs == 0) return;
+
+  printf("metadata 0..%d   = %.1f%% of requests \n", NUMMETA - 1,
+         100.0 * numMeta / numRecs);
+  printf("sequential      = %.1f%% (start where the last one ended) \n",
+         numRecs > 1 ? 100.0 * numSeq / (numRecs - 1) : 0);
+  printf("mean seek       = %.1f blocks \n",
+         numRecs > 1 ? (double)seekSum / (numRecs - 1) : 0);
+  printf("working set     = %llu blocks \n", (unsigned long long)numWorking);
+  if (numOps > 0) {
+    printf("fs calls        = %d, %.1f requests each \n", numOps,
+           (double)numRecs / numOps);
+  }
+  for (i32 c = 0; c < NUMCACHES; ++c) {
+    printf("LRU %4d blocks = %5.1f%% read hits \n", g_cacheSizes[c],
+           100.0 * replayCache(recs, numRecs, g_cacheSizes[c]));
+  }
+}
+
+
+
+// ============================================================================
+// Re-issue the requests in 'recs' against BFSDISK, keeping to the times they
+// were recorded at unless 'fast'.  Report how long it took
+// ============================================================================
+static void replayIssue(TraceRec* recs, i32 numRecs, bool fast) {
+  BFS* fs = bfsOpen(BFSDISK, BIOFILE);      // raw blocks: not mounted
+  bioCheckDisk(fs);
+
+  i8* buf = malloc(BLOCKSPERDISK * BYTESPERBLOCK);
+  if (buf == NULL) FATAL(ENOMEM);
+  memset(buf, 0x5A, BLOCKSPERDISK * BYTESPERBLOCK);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  u64 start = (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  u64 busy  = 0;
+  u64 base  = numRecs > 0 ? recs[0].nanos : 0;  // a wrapped trace starts late
+
+  for (i32 r = 0; r < numRecs; ++r) {
+    TraceRec* rec = &recs[r];
+    if (rec->dbn < 0 || rec->dbn + rec->numBlocks > BLOCKSPERDISK) {
+      FATAL(EBADDBN);                       // traced on a bigger disk
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    u64 now = (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    u64 due = rec->nanos - base;
+    if (!fast && now - start < due) {
+      u64 wait = due - (now - start);
+      struct timespec w = {wait / 1000000000, wait % 1000000000};
+      nanosleep(&w, NULL);
+      now = start + due;
+    }
+
+    switch (rec->type) {
+      case TRACEREAD:    bioReadRun (fs, rec->dbn, rec->numBlocks, buf); break;
+      case TRACEWRITE:   bioWriteRun(fs, rec->dbn, rec->numBlocks, buf); break;
+      case TRACEDISCARD: bioDiscard (fs, rec->dbn, rec->numBlocks);      break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    busy += (u64)ts.tv_sec * 1000000000 + ts.tv_nsec - now;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  u64 total = (u64)ts.tv_sec * 1000000000 + ts.tv_nsec - start;
+  printf("replayed %d requests in %.3f s, %.1f us each \n", numRecs,
+         total / 1e9, numRecs > 0 ? busy / 1e3 / numRecs : 0);
+  free(buf);
+  bfsClose(fs);
+}
+
+
+
+int main(int argc, char** argv) {
+
+  bool replay = false, fast = false;
+  str  path   = NULL;
+  for (i32 a = 1; a < argc; ++a) {
+    if      (strcmp(argv[a], "-r") == 0) replay = true;
+    else if (strcmp(argv[a], "-f") == 0) replay = fast = true;
+    else if (path == NULL)               path = argv[a];
+    else                                 path = NULL, a = argc;
+  }
+  if (path == NULL) {
+    printf("usage: %s [-r | -f] tracefile \n", argv[0]);
+    return 1;
+  }
+
+  i32 numRecs = 0;
+  TraceRec* recs = replayLoad(path, &numRecs);
+  replayAnalyse(recs, numRecs);
+  if (replay) replayIssue(recs, numRecs, fast);
+  free(recs);
+  return 0;
+}
@@ -0,0 +1,219 @@
+// ============================================================================
+// elevbench.c - the elevator I/O scheduler (see elev.h) against requests
+// sent in arrival order, on a disk with the latency of a spinning one
+//
+// usage: elevbench [-t threads] [-n ops] [-o outfile]
+//
+//   -t   threads making requests at once (default 8, at most 64)
+//   -n   requests each thread makes, per workload (default 100)
+//   -o   where to write results (default elev_output.txt)
+//
+// Every workload runs twice on an in-memory disk (BIOMEM), whose requests
+// take as long as ELEVMODEL says a spinning disk would: a seek that grows
+// with the distance the head moves, a rotational delay after it, and a
+// transfer time per block.  Once with ELEVFIFO, in arrival order, and once
+// with the elevator, sorted and merged.  The threads call bio directly, so
+// that requests overlap as they would under the flusher, the promoter and
+// many callers.  Workloads:
+//
+//   rand    single-block reads of data blocks, at random
+//   seq     single-block reads, the threads sharing one cursor across the
+//           disk, as a parallel scan would
+//   mixed   reads and writes of data blocks, at random, with a read of a
+//           metadata block, DBN 0 .. MINDBN - 1, before each
+//
+// Each result is one line of "key=value" pairs in the output file:
+// workload, scheduler, # requests, seconds, requests/s, mean and p99
+// latency in microseconds, seeks, mean seek distance in blocks, merges and
+// deadline expiries.  Built with -DBFSSTATS=0, the last four read 0.  Build,
+// from the top of the tree, with LIB every .c file there but main.c:
+//
+//   gcc -O2 -I. -o elevbench tools/elevbench.c $LIB -lpthread -lm
+// ============================================================================
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "elev.h"
+#include "stats.h"
+
+#define MAXTHREADS 64
+
+#define RAND       0                          // workloads
+#define SEQ        1
+#define MIXED      2
+
+static i32   g_numThreads = 8;                // threads per workload
+static i32   g_numOps     = 100;              // requests per thread
+static FILE* g_out        = NULL;             // results, for machines
+
+static BFS*  g_fs         = NULL;             // volume under test
+static i32   g_workload   = RAND;             // what the threads do
+static i32   g_cursor     = 0;                // next block, for SEQ
+
+typedef struct {          // one thread's requests
+  i32  numOps;            // # requests to make
+  i64* lat;               // latency of each, in ns
+  u32  seed;              // for rand_r
+} Worker;
+
+
+
+// ============================================================================
+// Return a monotonic timestamp, in nanoseconds
+// ============================================================================
+static i64 benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+static int benchCmp(const void* a, const void* b) {
+  i64 x = *(const i64*)a, y = *(const i64*)b;
+  return (x > y) - (x < y);
+}
+
+
+
+// ============================================================================
+// Return a data block's DBN, at random
+// ============================================================================
+static i32 benchDbn(u32* seed) {
+  return MINDBN + rand_r(seed) % (BLOCKSPERDISK - MINDBN);
+}
+
+
+
+// ============================================================================
+// One thread's requests, as g_workload says.  'arg' is its Worker.  For
+// MIXED, only the data request is timed
+// ============================================================================
+static void* benchWorker(void* arg) {
+  Worker* w = (Worker*)arg;
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0x5A, sizeof(buf));
+
+  for (i32 i = 0; i < w->numOps; ++i) {
+    i32 dbn;
+    bool write = false;
+    if (g_workload == SEQ) {
+      i32 next = __atomic_fetch_add(&g_cursor, 1, __ATOMIC_RELAXED);
+      dbn = MINDBN + next % (BLOCKSPERDISK - MINDBN);
+    } else {
+      dbn = benchDbn(&w->seed);
+    }
+    if (g_workload == MIXED) {
+      bioRead(g_fs, rand_r(&w->seed) % MINDBN, buf);
+      write = rand_r(&w->seed) % 2;
+    }
+
+    i64 start = benchNow();
+    if (write) bioWrite(g_fs, dbn, buf);
+    else       bioRead (g_fs, dbn, buf);
+    w->lat[i] = benchNow() - start;
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Run 'workload' once, on a fresh in-memory disk scheduled as 'flags' says,
+// plus ELEVMODEL, and report it, under 'name' and 'sched', on stdout and as
+// one line of g_out
+// ============================================================================
+static void benchRun(i32 workload, str name, i32 flags, str sched) {
+  Worker    workers[MAXTHREADS];
+  pthread_t threads[MAXTHREADS];
+  i32 numLat = g_numThreads * g_numOps;
+  i64* lat = malloc(numLat * sizeof(i64));
+  if (lat == NULL) FATAL(ENOMEM);
+
+  g_fs = bfsOpen(NULL, BIOMEM);
+  bioSetElevator(g_fs, flags | ELEVMODEL);
+  g_workload = workload;
+  g_cursor   = 0;
+
+  i64 start = benchNow();
+  for (i32 t = 0; t < g_numThreads; ++t) {
+    workers[t].numOps = g_numOps;
+    workers[t].lat    = lat + t * g_numOps;
+    workers[t].seed   = t + 1;
+    if (pthread_create(&threads[t], NULL, benchWorker, &workers[t]) != 0) {
+      FATAL(ENOMEM);
+    }
+  }
+  for (i32 t = 0; t < g_numThreads; ++t) pthread_join(threads[t], NULL);
+  double secs = (benchNow() - start) / 1e9;
+
+  Stats stats;
+  fsStats(g_fs, &stats, 0);
+  bfsClose(g_fs);
+
+  i64 total = 0;
+  for (i32 i = 0; i < numLat; ++i) total += lat[i];
+  qsort(lat, numLat, sizeof(i64), benchCmp);
+
+  u64 reqs = stats.ops[STATBIOREAD].calls + stats.ops[STATBIOWRITE].calls;
+  double opss  = secs > 0 ? reqs / secs : 0;
+  double mean  = total / 1e3 / numLat;
+  double p99   = lat[numLat * 99 / 100] / 1e3;
+  double dist  = stats.elevSeeks > 0
+               ? (double)stats.elevSeekDist / stats.elevSeeks : 0;
+
+  printf("%-6s %-5s %8.0f req/s  mean %8.1f  p99 %8.1f us  seeks %6llu"
+         "  dist %5.1f  merges %6llu  expired %5llu \n", name, sched, opss,
+         mean, p99, (unsigned long long)stats.elevSeeks, dist,
+         (unsigned long long)stats.elevMerges,
+         (unsigned long long)stats.elevExpired);
+  fprintf(g_out, "workload=%s sched=%s reqs=%llu secs=%.6f reqps=%.1f "
+          "meanus=%.2f p99us=%.2f seeks=%llu seekdist=%.2f merges=%llu "
+          "expired=%llu\n", name, sched, (unsigned long long)reqs, secs,
+          opss, mean, p99, (unsigned long long)stats.elevSeeks, dist,
+          (unsigned long long)stats.elevMerges,
+          (unsigned long long)stats.elevExpired);
+  fflush(g_out);
+  free(lat);
+}
+
+
+
+int main(int argc, char** argv) {
+
+  str outName = "elev_output.txt";
+  for (i32 a = 1; a < argc; ++a) {
+    if (strcmp(argv[a], "-t") == 0 && a + 1 < argc) {
+      g_numThreads = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "-n") == 0 && a + 1 < argc) {
+      g_numOps = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+      outName = argv[++a];
+    } else {
+      printf("usage: %s [-t threads] [-n ops] [-o outfile] \n", argv[0]);
+      return 1;
+    }
+  }
+  if (g_numThreads <= 0) g_numThreads = 1;
+  if (g_numThreads > MAXTHREADS) g_numThreads = MAXTHREADS;
+  if (g_numOps <= 0) g_numOps = 1;
+
+  g_out = fopen(outName, "w");
+  if (g_out == NULL) FATAL(EBADWRITE);
+  fprintf(g_out, "# elevbench blocksize=%d disk=%d threads=%d ops=%d\n",
+          BYTESPERBLOCK, BLOCKSPERDISK, g_numThreads, g_numOps);
+
+  static const str names[] = {"rand", "seq", "mixed"};
+  for (i32 w = RAND; w <= MIXED; ++w) {
+    benchRun(w, names[w], ELEVFIFO, "fifo");
+    benchRun(w, names[w], 0,        "elev");
+  }
+
+  fclose(g_out);
+  return 0;
+}
@@ -0,0 +1,50 @@
+// ============================================================================
+// fsck.c - check, and optionally repair, the BFS volume in BFSDISK
+//
+// usage: fsck [-r]
+//
+//   -r   repair what is found, rather than just report it
+//
+// A volume that was not unmounted cleanly is recovered by fsMount before
+// the check begins.  Exit status: 0 if the volume is consistent, 1 if
+// problems were found and repaired, 4 if problems were found and left
+// ============================================================================
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bfs.h"
+#include "fs.h"
+
+int main(int argc, char** argv) {
+
+  i32 flags = 0;
+  for (i32 a = 1; a < argc; ++a) {
+    if (strcmp(argv[a], "-r") == 0) {
+      flags |= FSCKREPAIR;
+    } else {
+      printf("usage: %s [-r] \n", argv[0]);
+      return 8;
+    }
+  }
+
+  BFS* fs = fsMount(BFSDISK, 0);
+
+  FsckReport report;
+  i32 numProblems = fsCheck(fs, flags, &report);
+
+  printf("files checked     = %d \n", report.numFiles);
+  printf("data blocks used  = %d \n", report.numOwned);
+  printf("leaked blocks     = %d \n", report.numLeaked);
+  printf("lost blocks       = %d \n", report.numLost);
+  printf("doubly-mapped     = %d \n", report.numDoubled);
+  printf("bad ref counts    = %d \n", report.numBadRefs);
+  printf("out-of-range DBNs = %d \n", report.numBadDbns);
+  if (flags & FSCKREPAIR) printf("repairs made      = %d \n", report.numRepaired);
+
+  fsUnmount(fs);
+
+  if (numProblems == 0)     return 0;
+  if (flags & FSCKREPAIR)   return 1;
+  return 4;
+}
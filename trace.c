@@ -0,0 +1,154 @@
+// ============================================================================
+// trace.c - block request tracing (see trace.h).  Records are gathered in a
+// TRACEBATCH buffer under the volume's trace lock, and written to the ring
+// file a batch at a time, so a traced request costs a lock and a copy, not a
+// write
+// ============================================================================
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "trace.h"
+
+static __thread u32 g_trcOpId = 0;    // fs call this thread is in.  0 => none
+static __thread u8  g_trcOp   = TRACEBG;
+
+
+
+// ============================================================================
+// Return a monotonic timestamp, in nanoseconds.  Like statsNow, but there
+// whether or not BFSSTATS is
+// ============================================================================
+static u64 traceNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Write the records buffered in 'tr' to their slots in the ring, and the
+// header after them.  The caller holds 'tr->lock'
+// ============================================================================
+static void traceWriteBatch(Trace* tr) {
+  u64 first = tr->total - tr->len;          // record # of tr->buf[0]
+  for (i32 i = 0; i < tr->len; ) {
+    u32 slot = (first + i) % tr->cap;
+    i32 num  = tr->len - i;
+    if (slot + num > tr->cap) num = tr->cap - slot;     // wraps: split
+    fseek(tr->file, sizeof(TraceHeader) + slot * sizeof(TraceRec), SEEK_SET);
+    if (fwrite(&tr->buf[i], sizeof(TraceRec), num, tr->file) != (u32)num) {
+      FATAL(EBADWRITE);
+    }
+    i += num;
+  }
+  tr->len = 0;
+
+  TraceHeader hdr = {TRACEMAGIC, tr->cap, tr->total};
+  fseek(tr->file, 0, SEEK_SET);
+  if (fwrite(&hdr, sizeof(hdr), 1, tr->file) != 1) FATAL(EBADWRITE);
+}
+
+
+
+// ============================================================================
+// Note that this thread has entered an fs call of kind 'op' (STATFS*) on the
+// volume traced by 'tr'.  Block requests it makes until traceEnd are tagged
+// with the call
+// ============================================================================
+void traceBegin(Trace* tr, i32 op) {
+  if (!__atomic_load_n(&tr->on, __ATOMIC_RELAXED)) return;
+  g_trcOpId = __atomic_add_fetch(&tr->nextId, 1, __ATOMIC_RELAXED);
+  g_trcOp   = (u8)op;
+}
+
+
+
+// ============================================================================
+// Note that this thread has left the fs call it was in
+// ============================================================================
+void traceEnd() {
+  g_trcOpId = 0;
+  g_trcOp   = TRACEBG;
+}
+
+
+
+// ============================================================================
+// Set up 'tr' for a newly opened volume: not tracing
+// ============================================================================
+void traceInit(Trace* tr) {
+  memset(tr, 0, sizeof(Trace));
+  pthread_mutex_init(&tr->lock, NULL);
+}
+
+
+
+// ============================================================================
+// Record a block request: 'type' (TRACEREAD, etc) of 'numBlocks' blocks from
+// 'dbn'.  Called through TRACEIO, only while tracing
+// ============================================================================
+void traceRecord(Trace* tr, i32 type, i32 dbn, i32 numBlocks) {
+  TraceRec rec = {0};
+  rec.opId      = g_trcOpId;
+  rec.dbn       = dbn;
+  rec.numBlocks = numBlocks;
+  rec.type      = type;
+  rec.op        = g_trcOp;
+
+  pthread_mutex_lock(&tr->lock);
+  if (tr->file != NULL) {
+    rec.nanos = traceNow() - tr->start;
+    tr->buf[tr->len++] = rec;
+    ++tr->total;
+    if (tr->len == TRACEBATCH) traceWriteBatch(tr);
+  }
+  pthread_mutex_unlock(&tr->lock);
+}
+
+
+
+// ============================================================================
+// Start tracing every block request into a new ring file 'path', with room
+// for the last 'capacity' of them.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 traceStart(Trace* tr, str path, i32 capacity) {
+  if (path == NULL)  FATAL(ENULLPTR);
+  if (capacity <= 0) FATAL(EBIGNUMB);
+
+  pthread_mutex_lock(&tr->lock);
+  if (tr->file != NULL) FATAL(EBADFLAGS);   // already tracing
+  tr->file = fopen(path, "w+b");
+  if (tr->file == NULL) FATAL(EDISKCREATE);
+
+  tr->cap   = capacity;
+  tr->total = 0;
+  tr->len   = 0;
+  tr->start = traceNow();
+  traceWriteBatch(tr);                      // just the header, for now
+  __atomic_store_n(&tr->on, true, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&tr->lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Stop tracing, write what is buffered, and close the ring file.  Does
+// nothing if not tracing.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 traceStop(Trace* tr) {
+  pthread_mutex_lock(&tr->lock);
+  __atomic_store_n(&tr->on, false, __ATOMIC_RELAXED);
+  if (tr->file != NULL) {
+    traceWriteBatch(tr);
+    if (fclose(tr->file) != 0) FATAL(EBADWRITE);
+    tr->file = NULL;
+  }
+  pthread_mutex_unlock(&tr->lock);
+  return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// ============================================================================
+// trace.h - record every block request bio makes on a volume to a binary
+// trace file, for tools/bfsreplay to analyse or re-issue.  The file is a
+// ring: a TraceHeader, then room for 'capacity' TraceRecs, the oldest
+// overwritten once it is full
+// ============================================================================
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "alias.h"
+#include "stats.h"
+
+#define TRACEMAGIC    0x43525442  // "BTRC"
+#define TRACEBATCH    256         // TraceRecs buffered between file writes
+
+#define TRACEREAD     0           // TraceRec.type
+#define TRACEWRITE    1
+#define TRACEDISCARD  2
+
+#define TRACEBG       0xFF        // TraceRec.op: not inside any fs call
+
+typedef struct {          // TraceHeader: start of a trace file
+  u32 magic;              // TRACEMAGIC
+  u32 capacity;           // # TraceRecs the file has room for
+  u64 total;              // # TraceRecs ever recorded.  Record 'i' is in
+                          // slot 'i' % 'capacity'; the last 'capacity' stay
+} TraceHeader;
+
+typedef struct {          // TraceRec: one block request
+  u64 nanos;              // when issued, in ns since traceStart
+  u32 opId;               // which fs call issued it, numbered from 1.  0 => none
+  i16 dbn;                // first block
+  i16 numBlocks;          // # consecutive blocks
+  u8  type;               // TRACEREAD, TRACEWRITE or TRACEDISCARD
+  u8  op;                 // kind of fs call: STATFS*, or TRACEBG
+  u8  pad[6];
+} TraceRec;
+
+typedef struct {          // Trace: one volume's tracing state (BFS.trace)
+  bool     on;            // traceStart'ed, not yet traceStop'ed
+  pthread_mutex_t lock;   // guards the rest
+  FILE*    file;          // the ring file
+  u32      cap;           // # TraceRecs the file holds
+  u64      total;         // # TraceRecs recorded so far
+  u64      start;         // traceNow at traceStart
+  u32      nextId;        // last opId handed out
+  i32      len;           // # TraceRecs in 'buf'
+  TraceRec buf[TRACEBATCH];   // recorded, not yet written
+} Trace;
+
+#define TRACEIO(fs, type, dbn, n) \
+  { if (__atomic_load_n(&(fs)->trace.on, __ATOMIC_RELAXED)) \
+      traceRecord(&(fs)->trace, (type), (dbn), (n)); }
+#define TRACEBEGIN(fs, op)     traceBegin(&(fs)->trace, op)
+#define TRACEEND(fs)           traceEnd()
+
+void traceBegin (Trace* tr, i32 op);
+void traceEnd   ();
+void traceInit  (Trace* tr);
+void traceRecord(Trace* tr, i32 type, i32 dbn, i32 numBlocks);
+i32  traceStart (Trace* tr, str path, i32 capacity);
+i32  traceStop  (Trace* tr);
+
+#endif
@@ -0,0 +1,379 @@
+// ============================================================================
+// wback.c - write-back buffer for bio (see wback.h).  Callers of wbIO hold
+// the buffer lock for the whole request, I/O below included.  The flusher
+// copies the blocks it has chosen into a batch, marks them 'flying', and
+// drops the lock while it writes the batch: a block written again meanwhile
+// has a new 'gen', and so stays dirty once the flight lands.  The SuperBlock
+// is always written last in a batch, so a crash part way through one never
+// leaves it newer than the blocks it describes
+// ============================================================================
+
+#include <time.h>
+
+#include "bfs.h"
+#include "stats.h"
+#include "wback.h"
+
+typedef struct {          // WbRun: dirty neighbours, written in one request
+  i16 dbn;                // first DBN of the run
+  i16 numBlocks;          // # blocks in the run
+  i16 off;                // where in the batch its blocks start, in blocks
+} WbRun;
+
+
+
+// ============================================================================
+// Return a monotonic timestamp, in nanoseconds
+// ============================================================================
+static u64 wbNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+
+// ============================================================================
+// Return whether the flusher should write back the dirty block 'dbn', in
+// slot 'slot', now: because every block should be, because a wbSync waits
+// on it, or because it has been dirty too long.  The caller holds the lock
+// ============================================================================
+static bool wbChosen(WBack* wb, i32 dbn, i32 slot, bool all, u64 now) {
+  if (all || wb->wantAll || wb->want[dbn]) return true;
+  return now - wb->since[slot] >= (u64)WBEXPIRE * 1000000;
+}
+
+
+
+// ============================================================================
+// Gather the runs of dirty blocks in DBNs 'lo' .. 'hi' - 1 that hold a block
+// the flusher should write (see wbChosen) into 'runs', and their contents,
+// at '*numb' blocks on, into 'batch', marking them flying.  Each one's 'gen'
+// goes into 'gens', by DBN.  The caller holds the lock
+// ============================================================================
+static void wbGather(WBack* wb, i32 lo, i32 hi, bool all, u64 now, i8* batch,
+                     u32* gens, WbRun* runs, i32* numRuns, i32* numb) {
+  for (i32 d = lo; d < hi; ) {
+    i32 slot = wb->slotOf[d];
+    if (slot < 0 || wb->flying[slot]) { ++d; continue; }
+
+    i32 end = d;                            // [d, end): dirty, on the ground
+    bool chosen = false;
+    while (end < hi && wb->slotOf[end] >= 0 && !wb->flying[wb->slotOf[end]]) {
+      chosen |= wbChosen(wb, end, wb->slotOf[end], all, now);
+      ++end;
+    }
+    if (chosen) {
+      WbRun* run = &runs[(*numRuns)++];
+      run->dbn       = d;
+      run->numBlocks = end - d;
+      run->off       = *numb;
+      for (i32 b = d; b < end; ++b) {
+        i32 s = wb->slotOf[b];
+        memcpy(batch + (*numb)++ * BYTESPERBLOCK,
+               wb->data + s * BYTESPERBLOCK, BYTESPERBLOCK);
+        wb->flying[s] = true;
+        gens[b] = wb->gen[s];
+      }
+    }
+    d = end;
+  }
+}
+
+
+
+// ============================================================================
+// Write back what the flusher should now (see wbChosen), in DBN order, the
+// SuperBlock last, and free the slots of blocks not written again meanwhile.
+// The caller holds the lock, which is dropped while the batch is written
+// ============================================================================
+static void wbPass(WBack* wb, i8* batch, bool all, u64 now) {
+  WbRun runs[BLOCKSPERDISK];
+  u32   gens[BLOCKSPERDISK];
+  i32   numRuns = 0;
+  i32   numb    = 0;
+  wbGather(wb, DBNSUPER + 1, BLOCKSPERDISK, all, now, batch, gens, runs,
+           &numRuns, &numb);
+  wbGather(wb, DBNSUPER, DBNSUPER + 1, all, now, batch, gens, runs,
+           &numRuns, &numb);
+  if (numRuns == 0) return;
+
+  pthread_mutex_unlock(&wb->lock);
+  for (i32 r = 0; r < numRuns; ++r) {
+    wb->io(wb->fs, true, runs[r].dbn, runs[r].numBlocks,
+           batch + runs[r].off * BYTESPERBLOCK);
+  }
+  STATADD(wb->fs, flushRuns, numRuns);
+  STATADD(wb->fs, flushBlocks, numb);
+  pthread_mutex_lock(&wb->lock);
+
+  for (i32 r = 0; r < numRuns; ++r) {       // land them
+    for (i32 d = runs[r].dbn; d < runs[r].dbn + runs[r].numBlocks; ++d) {
+      i32 slot = wb->slotOf[d];
+      wb->flying[slot] = false;
+      if (wb->gen[slot] != gens[d]) continue;   // written again: still dirty
+      wb->slotOf[d]     = -1;
+      wb->slotDbn[slot] = -1;
+      --wb->numDirty;
+    }
+  }
+  pthread_cond_broadcast(&wb->room);
+}
+
+
+
+// ============================================================================
+// Finish the wbSync calls made so far if none of the blocks they wait on is
+// still dirty.  The caller holds the lock
+// ============================================================================
+static void wbSyncCheck(WBack* wb) {
+  for (i32 d = 0; d < BLOCKSPERDISK; ++d) {
+    if (wb->slotOf[d] >= 0 && (wb->wantAll || wb->want[d])) return;
+  }
+  memset(wb->want, 0, BLOCKSPERDISK * sizeof(bool));
+  wb->wantAll  = false;
+  wb->syncDone = wb->syncReq;
+  pthread_cond_broadcast(&wb->room);
+}
+
+
+
+// ============================================================================
+// Body of the flusher thread.  'arg' is the WBack.  Sleeps until there is
+// work: a wbSync, too many dirty blocks, or blocks dirty too long, checking
+// the last every WBINTERVAL ms.  Exits once told to stop by wbClose
+// ============================================================================
+static void* wbFlusher(void* arg) {
+  WBack* wb = (WBack*)arg;
+  i8* batch = malloc(wb->cap * BYTESPERBLOCK);
+  if (batch == NULL) FATAL(ENOMEM);
+
+  pthread_mutex_lock(&wb->lock);
+  while (!wb->stop) {
+    u64  now  = wbNow();
+    bool sync = wb->syncDone != wb->syncReq;
+    bool full = wb->numDirty >= wb->bgLimit;
+    bool old  = false;
+    for (i32 s = 0; !old && s < wb->cap; ++s) {
+      old = wb->slotDbn[s] >= 0 && !wb->flying[s]
+         && wbChosen(wb, wb->slotDbn[s], s, false, now);
+    }
+
+    if (sync || full || old) {
+      wbPass(wb, batch, full, now);
+      if (sync) wbSyncCheck(wb);
+      continue;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += WBINTERVAL * 1000000;
+    ts.tv_sec  += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&wb->work, &wb->lock, &ts);
+  }
+  pthread_mutex_unlock(&wb->lock);
+
+  free(batch);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Write back everything, stop the flusher, and free the buffer.  Does
+// nothing if 'wb' is not buffered
+// ============================================================================
+void wbClose(WBack* wb) {
+  if (wb->cap == 0) return;
+
+  wbSync(wb, NULL);
+  pthread_mutex_lock(&wb->lock);
+  wb->stop = true;
+  pthread_cond_signal(&wb->work);
+  pthread_mutex_unlock(&wb->lock);
+  if (wb->started) pthread_join(wb->thread, NULL);
+
+  free(wb->data);
+  free(wb->slotDbn);
+  free(wb->since);
+  free(wb->gen);
+  free(wb->flying);
+  free(wb->slotOf);
+  free(wb->want);
+  pthread_mutex_destroy(&wb->lock);
+  pthread_cond_destroy(&wb->work);
+  pthread_cond_destroy(&wb->room);
+  memset(wb, 0, sizeof(WBack));
+}
+
+
+
+// ============================================================================
+// Forget DBNs 'dbn' .. 'dbn' + 'numBlocks' - 1, about to be discarded below:
+// drop any of them still dirty, once none is in flight, so the flusher
+// cannot write them back over the hole
+// ============================================================================
+void wbDiscard(WBack* wb, i32 dbn, i32 numBlocks) {
+  pthread_mutex_lock(&wb->lock);
+  for (i32 d = dbn; d < dbn + numBlocks; ) {
+    i32 slot = wb->slotOf[d];
+    if (slot >= 0 && wb->flying[slot]) {
+      pthread_cond_wait(&wb->room, &wb->lock);
+      continue;                               // look again
+    }
+    if (slot >= 0) {
+      wb->slotOf[d]     = -1;
+      wb->slotDbn[slot] = -1;
+      --wb->numDirty;
+    }
+    ++d;
+  }
+  pthread_cond_broadcast(&wb->room);
+  pthread_mutex_unlock(&wb->lock);
+}
+
+
+
+// ============================================================================
+// Set up 'wb' as an empty write-back buffer for volume 'fs', above whatever
+// is reached through 'io', and start its flusher.  On success, return 0.  On
+// failure, abort
+// ============================================================================
+i32 wbInit(WBack* wb, BFS* fs, TierIO* io) {
+  if (fs == NULL || io == NULL) FATAL(ENULLPTR);
+
+  memset(wb, 0, sizeof(WBack));
+  wb->cap     = BLOCKSPERDISK * WBRATIO / 100;
+  wb->bgLimit = BLOCKSPERDISK * WBBGRATIO / 100;
+  if (wb->cap < 1)           wb->cap     = 1;
+  if (wb->bgLimit < 1)       wb->bgLimit = 1;
+  if (wb->bgLimit > wb->cap) wb->bgLimit = wb->cap;
+  wb->fs      = fs;
+  wb->io      = io;
+  wb->data    = malloc(wb->cap * BYTESPERBLOCK);
+  wb->slotDbn = malloc(wb->cap * sizeof(i16));
+  wb->since   = calloc(wb->cap, sizeof(u64));
+  wb->gen     = calloc(wb->cap, sizeof(u32));
+  wb->flying  = calloc(wb->cap, sizeof(bool));
+  wb->slotOf  = malloc(BLOCKSPERDISK * sizeof(i16));
+  wb->want    = calloc(BLOCKSPERDISK, sizeof(bool));
+  if (wb->data == NULL || wb->slotDbn == NULL || wb->since == NULL
+   || wb->gen == NULL || wb->flying == NULL || wb->slotOf == NULL
+   || wb->want == NULL) {
+    FATAL(ENOMEM);
+  }
+  memset(wb->slotDbn, -1, wb->cap * sizeof(i16));
+  memset(wb->slotOf,  -1, BLOCKSPERDISK * sizeof(i16));
+
+  pthread_condattr_t attr;                  // timed waits: monotonic
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&wb->lock, NULL);
+  pthread_cond_init(&wb->work, &attr);
+  pthread_cond_init(&wb->room, NULL);
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_create(&wb->thread, NULL, wbFlusher, wb) != 0) FATAL(ENOMEM);
+  wb->started = true;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read or write the 'numBlocks' blocks from DBN 'dbn', to or from 'buf'.  A
+// write is copied into the buffer, and left for the flusher; if the buffer
+// is full, it first waits for the flusher to make room.  A read takes dirty
+// blocks from the buffer, and the rest from below, a run at a time.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 wbIO(WBack* wb, bool write, i32 dbn, i32 numBlocks, void* buf) {
+  i8* p = (i8*)buf;
+  i32 throttled = 0;
+
+  pthread_mutex_lock(&wb->lock);
+  if (write && wb->through) {
+    wb->io(wb->fs, true, dbn, numBlocks, buf);
+    pthread_mutex_unlock(&wb->lock);
+    return 0;
+  }
+
+  if (write) {
+    for (i32 b = 0; b < numBlocks; ++b) {
+      i32 d = dbn + b;
+      while (wb->slotOf[d] < 0 && wb->numDirty >= wb->cap) {
+        ++throttled;
+        pthread_cond_signal(&wb->work);
+        pthread_cond_wait(&wb->room, &wb->lock);
+      }
+      i32 slot = wb->slotOf[d];
+      if (slot < 0) {
+        for (slot = 0; wb->slotDbn[slot] >= 0; ++slot) ;
+        wb->slotDbn[slot] = d;
+        wb->slotOf[d]     = slot;
+        wb->since[slot]   = wbNow();
+        ++wb->numDirty;
+      }
+      memcpy(wb->data + slot * BYTESPERBLOCK, p + b * BYTESPERBLOCK,
+             BYTESPERBLOCK);
+      ++wb->gen[slot];
+    }
+    if (wb->numDirty >= wb->bgLimit) pthread_cond_signal(&wb->work);
+  } else {
+    for (i32 b = 0; b < numBlocks; ) {
+      i32 slot = wb->slotOf[dbn + b];
+      if (slot >= 0) {
+        memcpy(p + b * BYTESPERBLOCK, wb->data + slot * BYTESPERBLOCK,
+               BYTESPERBLOCK);
+        ++b;
+        continue;
+      }
+      i32 end = b + 1;                        // a run not buffered
+      while (end < numBlocks && wb->slotOf[dbn + end] < 0) ++end;
+      wb->io(wb->fs, false, dbn + b, end - b, p + b * BYTESPERBLOCK);
+      b = end;
+    }
+  }
+  pthread_mutex_unlock(&wb->lock);
+
+  STATADD(wb->fs, throttles, throttled);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write back the dirty blocks whose DBNs are marked in 'dbns', or every one
+// if 'dbns' is NULL, and wait until they are written.  The flusher does the
+// writing, batched with whatever else it has.  On success, return 0
+// ============================================================================
+i32 wbSync(WBack* wb, bool* dbns) {
+  pthread_mutex_lock(&wb->lock);
+  if (dbns == NULL) {
+    wb->wantAll = true;
+  } else {
+    for (i32 d = 0; d < BLOCKSPERDISK; ++d) wb->want[d] |= dbns[d];
+  }
+  u32 ticket = ++wb->syncReq;
+  pthread_cond_signal(&wb->work);
+  while ((i32)(wb->syncDone - ticket) < 0) {
+    pthread_cond_wait(&wb->room, &wb->lock);
+  }
+  pthread_mutex_unlock(&wb->lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Turn write-through on or off.  While on, writes go straight below, so a
+// bioMap of the backend sees them.  Turning it on first writes back every
+// dirty block
+// ============================================================================
+void wbWriteThrough(WBack* wb, bool on) {
+  if (on) wbSync(wb, NULL);
+  pthread_mutex_lock(&wb->lock);
+  wb->through = on;
+  pthread_mutex_unlock(&wb->lock);
+}
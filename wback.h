@@ -0,0 +1,57 @@
+#ifndef WBACK_H
+#define WBACK_H
+
+// ============================================================================
+// wback.h - write-back buffer for bio.  Blocks written are held in memory,
+// dirty, and bio returns at once.  A flusher thread writes them on down, to
+// the RAM tier or the backend, in DBN order, each run of neighbouring dirty
+// blocks in one request.  It starts once WBBGRATIO percent of the disk is
+// dirty, or some block has been dirty for WBEXPIRE ms; writers wait for it
+// once WBRATIO percent is.  wbSync writes back chosen blocks, or all, and
+// waits for them
+// ============================================================================
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "alias.h"
+#include "tier.h"
+
+#define WBBGRATIO   10        // % of the disk dirty: the flusher starts
+#define WBRATIO     20        // % of the disk dirty: writers wait for it
+#define WBEXPIRE    100       // ms a block may stay dirty
+#define WBINTERVAL  25        // ms between the flusher's checks of age
+
+typedef struct {          // WBack: a volume's write-back buffer (BFS.wback)
+  i32     cap;            // # blocks it holds: WBRATIO.  0 => not buffered
+  i32     bgLimit;        // # dirty at which the flusher starts: WBBGRATIO
+  i32     numDirty;       // # slots in use
+  BFS*    fs;             // volume the buffer belongs to
+  TierIO* io;             // reads and writes below: RAM tier, or backend
+  i8*     data;           // 'cap' blocks
+  i16*    slotDbn;        // DBN held in each slot of 'data'.  -1 => free
+  u64*    since;          // when each slot was first dirtied, in ns
+  u32*    gen;            // bumped by each write to the slot
+  bool*   flying;         // slot is being written by the flusher
+  i16*    slotOf;         // slot holding each DBN.  -1 => not buffered
+  bool*   want;           // DBNs a wbSync is waiting on
+  bool    wantAll;        // a wbSync is waiting on every DBN
+  u32     syncReq;        // # wbSync calls made
+  u32     syncDone;       // # of them the flusher has finished
+  bool    through;        // write straight through (bioMap)
+  pthread_mutex_t lock;   // guards all of the above
+  pthread_cond_t  work;   // flusher has work: dirty, or a wbSync
+  pthread_cond_t  room;   // slots freed, a flight landed, or a wbSync done
+  pthread_t thread;       // the flusher, once 'started'
+  bool    started;        // flusher thread is running
+  bool    stop;           // flusher should exit
+} WBack;
+
+void wbClose  (WBack* wb);
+void wbDiscard(WBack* wb, i32 dbn, i32 numBlocks);
+i32  wbInit   (WBack* wb, BFS* fs, TierIO* io);
+i32  wbIO     (WBack* wb, bool write, i32 dbn, i32 numBlocks, void* buf);
+i32  wbSync   (WBack* wb, bool* dbns);
+void wbWriteThrough(WBack* wb, bool on);
+
+#endif